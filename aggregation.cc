@@ -0,0 +1,169 @@
+/*
+ * Bulk URB aggregation statistics per endpoint and direction. RX URBs are
+ * also accounted per RX aggregation setting of USB_DMA_CFG in effect when
+ * they completed.
+ */
+
+#define AGG_MAX_EP	16
+#define AGG_HIST	16	// frames per URB histogram, last bucket is 15 and more
+#define AGG_MAX_CFG	8
+#define USB_DMA_CFG	0x02a0
+
+struct bulk_summary {
+	int frames;
+	int payload;	// MPDU bytes
+	int desc;	// TXINFO/TXWI or RXINFO/RXWI/RXD bytes
+};
+
+struct agg_stats {
+	uint64_t urbs;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t buf_bytes;	// submitted URB lengths
+	uint64_t payload;
+	uint64_t desc;
+	uint64_t gap_sum;
+	uint32_t gap_min;
+	uint32_t gap_max;
+	uint64_t last_ts;
+	uint64_t hist[AGG_HIST];
+};
+
+struct agg_rx_cfg {
+	bool known;
+	bool en;
+	uint8_t lmt;
+	uint8_t to;
+	struct agg_stats st;
+};
+
+bool agg_enabled;
+static struct agg_stats agg_ep[2][AGG_MAX_EP];
+static struct agg_rx_cfg agg_cfg[AGG_MAX_CFG];
+static struct agg_stats agg_cfg_other;
+static int agg_ncfg;
+
+static void agg_update(struct agg_stats *st, uint64_t ts, int len, int buf_len, struct bulk_summary *sum)
+{
+	if (st->urbs) {
+		uint64_t gap = ts - st->last_ts;
+
+		st->gap_sum += gap;
+		if (gap < st->gap_min || st->urbs == 1)
+			st->gap_min = gap;
+		if (gap > st->gap_max)
+			st->gap_max = gap;
+	}
+	st->last_ts = ts;
+
+	st->urbs++;
+	st->frames += sum->frames;
+	st->bytes += len;
+	st->buf_bytes += buf_len;
+	st->payload += sum->payload;
+	st->desc += sum->desc;
+	st->hist[sum->frames < AGG_HIST ? sum->frames : AGG_HIST - 1]++;
+}
+
+static struct agg_stats *agg_rx_cfg_stats(void)
+{
+	const int nr = USB_DMA_CFG / 2;
+	const struct shadow_regs *shadow = rt2x00usb_shadow(decoder);
+	struct agg_rx_cfg c;
+	int i;
+
+	memset(&c, 0, sizeof(c));
+	if (is_known(shadow->mac_known, nr) && is_known(shadow->mac_known, nr + 1)) {
+		uint32_t val = shadow->mac[nr] | shadow->mac[nr + 1] << 16;
+
+		c.known = true;
+		c.en = val & (1 << 21);
+		c.lmt = (val >> 8) & 0x7f;
+		c.to = val & 0xff;
+	}
+
+	for (i = 0; i < agg_ncfg; i++) {
+		struct agg_rx_cfg *p = &agg_cfg[i];
+
+		if (p->known == c.known && p->en == c.en && p->lmt == c.lmt && p->to == c.to)
+			return &p->st;
+	}
+
+	if (agg_ncfg == AGG_MAX_CFG)
+		return &agg_cfg_other;
+
+	agg_cfg[agg_ncfg] = c;
+	return &agg_cfg[agg_ncfg++].st;
+}
+
+// Account bulk URB at its RT2X00USB_BULK_END event
+void agg_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	const bool in = ev->addr & USB_DIR_IN;
+	const int ep = ev->addr & 0x7f;
+	struct bulk_summary sum;
+
+	if (ev->type != RT2X00USB_BULK_END || ep >= AGG_MAX_EP)
+		return;
+
+	sum.frames = ev->arg[0];
+	sum.payload = ev->arg[1];
+	sum.desc = ev->arg[2];
+
+	agg_update(&agg_ep[in][ep], ev->ts, ev->len, ev->shdr->length, &sum);
+	if (in)
+		agg_update(agg_rx_cfg_stats(), ev->ts, ev->len, ev->shdr->length, &sum);
+}
+
+static void agg_print(const char *prefix, struct agg_stats *st)
+{
+	if (st->urbs == 0)
+		return;
+
+	const double urbs = st->urbs;
+	const double bytes = st->bytes ? st->bytes : 1;
+	const uint64_t pad = st->bytes - st->payload - st->desc;
+
+	printf("AGG %s: %" PRIu64 " URBs %" PRIu64 " frames (%.2f/URB) %.1f bytes/URB of %.1f max (%.1f%%)\n",
+	       prefix, st->urbs, st->frames, st->frames / urbs, st->bytes / urbs, st->buf_bytes / urbs,
+	       st->buf_bytes ? 100.0 * st->bytes / st->buf_bytes : 0.0);
+	printf("AGG %s: payload %.1f%% descriptors %.1f%% padding %.1f%%", prefix,
+	       100.0 * st->payload / bytes, 100.0 * st->desc / bytes, 100.0 * pad / bytes);
+	if (st->urbs > 1)
+		printf(" gap avg %.1f min %u max %u us", st->gap_sum / (urbs - 1), st->gap_min, st->gap_max);
+	printf("\n");
+
+	printf("AGG %s: frames/URB", prefix);
+	for (int i = 0; i < AGG_HIST; i++)
+		if (st->hist[i])
+			printf(" %d%s:%" PRIu64, i, i == AGG_HIST - 1 ? "+" : "", st->hist[i]);
+	printf("\n");
+}
+
+void agg_report(void)
+{
+	char prefix[64];
+
+	if (!agg_enabled)
+		return;
+
+	for (int in = 1; in >= 0; in--) {
+		for (int ep = 0; ep < AGG_MAX_EP; ep++) {
+			snprintf(prefix, sizeof(prefix), "BULK%d %s", ep, in ? "<-" : "->");
+			agg_print(prefix, &agg_ep[in][ep]);
+		}
+	}
+
+	for (int i = 0; i < agg_ncfg; i++) {
+		struct agg_rx_cfg *c = &agg_cfg[i];
+
+		if (c->known)
+			snprintf(prefix, sizeof(prefix), "RX RX_AGG_EN %d RX_AGG_LMT 0x%x RX_AGG_TO 0x%x",
+				 c->en, c->lmt, c->to);
+		else
+			snprintf(prefix, sizeof(prefix), "RX USB_DMA_CFG unknown");
+		agg_print(prefix, &c->st);
+	}
+	agg_print("RX other USB_DMA_CFG settings", &agg_cfg_other);
+	fflush(stdout);
+}
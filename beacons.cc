@@ -0,0 +1,240 @@
+/*
+ * Beacon template updates. Slot n starts at 0x4000 + 64 * BCN_OFFSET0/1
+ * byte n, the driver writes TXWI and the beacon there in CSR cache sized
+ * control transfers. Update is complete when TXWI and MPDU_TOTAL_BYTE_COUNT
+ * bytes of the frame are written. Update rewritten before the frame header
+ * and fixed fields are there is partial. Every distinct image of a slot is
+ * decoded once, identical rewrites are only counted.
+ */
+
+#include <map>
+
+#define BCN_SLOTS	8
+#define BCN_SLOT_SIZE	0x200
+#define BCN_OFFSET0	0x042c
+#define BCN_OFFSET1	0x0430
+#define BCN_TXWI_LEN	16
+#define BCN_HDR_LEN	24	// 802.11 header
+#define BCN_FIXED_LEN	12	// timestamp, interval, capabilities
+
+struct bcn_slot {
+	// Update being written
+	bool active;
+	unsigned int end;	// bytes written from the slot start
+	uint64_t cur_bytes;
+	uint64_t cur_time;
+	unsigned char image[BCN_SLOT_SIZE];
+	// Statistics
+	uint64_t updates;
+	uint64_t identical;	// same as the previous image
+	uint64_t clears;
+	uint64_t partial;	// rewritten before the frame header was complete
+	uint64_t bytes;		// including setup packets
+	uint64_t time;		// usec of control transfers
+	uint32_t last;
+	std::map<uint32_t, unsigned int> images;	// hash to image number
+};
+
+bool bcn_enabled;
+static struct bcn_slot bcn_slots[BCN_SLOTS];
+static uint64_t bcn_first_ts, bcn_last_ts;
+
+// Values set by the driver at initialization, if not seen
+static const uint8_t bcn_default[BCN_SLOTS] = { 0xe0, 0xe8, 0xf0, 0xf8, 0xc8, 0xd0, 0x77, 0x6f };
+
+static uint16_t bcn_base(int slot)
+{
+	const struct shadow_regs *s = rt2x00usb_shadow(decoder);
+	const int nr = (slot < 4 ? BCN_OFFSET0 : BCN_OFFSET1) / 2 + (slot % 4) / 2;
+
+	if (!is_known(s->mac_known, nr))
+		return 0x4000 + 64 * bcn_default[slot];
+	return 0x4000 + 64 * ((s->mac[nr] >> (8 * (slot % 2))) & 0xff);
+}
+
+// Slot containing @addr, -1 if none
+int bcn_slot(uint16_t addr)
+{
+	for (int i = 0; i < BCN_SLOTS; i++) {
+		const uint16_t base = bcn_base(i);
+
+		if (addr >= base && addr < base + BCN_SLOT_SIZE)
+			return i;
+	}
+	return -1;
+}
+
+// Area write printed by the beacons instead of a hex dump
+bool bcn_covers(const struct rt2x00usb_event *ev)
+{
+	return bcn_enabled && ev->type == RT2X00USB_AREA_WRITE && bcn_slot(ev->addr) >= 0;
+}
+
+static uint32_t bcn_hash(const unsigned char *data, unsigned int len)
+{
+	uint32_t h = 2166136261U;
+
+	for (unsigned int i = 0; i < len; i++)
+		h = (h ^ data[i]) * 16777619U;
+	return h;
+}
+
+static void bcn_print_mac(const char *name, const unsigned char *a)
+{
+	printf(" %s %02x:%02x:%02x:%02x:%02x:%02x", name, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+// Beacon frame of a new image
+static void bcn_decode(const unsigned char *frame, unsigned int len)
+{
+	const unsigned char *ie = frame + BCN_HDR_LEN + BCN_FIXED_LEN;
+	const unsigned char *end = frame + len;
+
+	printf(" %u bytes", len);
+	if (len < BCN_HDR_LEN + BCN_FIXED_LEN || frame[0] != 0x80) {
+		printf(" not a beacon\n");
+		return;
+	}
+
+	bcn_print_mac("BSSID", frame + 16);
+	printf(" interval %u TU caps 0x%04x", frame[32] | frame[33] << 8, frame[34] | frame[35] << 8);
+
+	for (; ie + 2 <= end && ie + 2 + ie[1] <= end; ie += 2 + ie[1]) {
+		switch (ie[0]) {
+		case 0:
+			printf(" SSID \"%.*s\"", ie[1], ie + 2);
+			break;
+		case 3:
+			if (ie[1] >= 1)
+				printf(" channel %u", ie[2]);
+			break;
+		case 5:
+			if (ie[1] < 3)
+				break;
+			printf(" TIM DTIM %u/%u bitmap %02x:", ie[2], ie[3], ie[4]);
+			for (int i = 5; i < 2 + ie[1]; i++)
+				printf("%02x", ie[i]);
+			break;
+		}
+	}
+
+	printf(" IEs");
+	for (ie = frame + BCN_HDR_LEN + BCN_FIXED_LEN; ie + 2 <= end && ie + 2 + ie[1] <= end; ie += 2 + ie[1])
+		printf(" %u", ie[0]);
+	printf("\n");
+}
+
+static void bcn_complete(int nr, unsigned int len)
+{
+	struct bcn_slot *s = &bcn_slots[nr];
+	const uint32_t h = bcn_hash(s->image, len);
+
+	s->active = false;
+	s->updates++;
+	s->bytes += s->cur_bytes;
+	s->time += s->cur_time;
+
+	if (s->updates > 1 && h == s->last) {
+		s->identical++;
+		return;
+	}
+	s->last = h;
+
+	// Decoded only the first time, TIM changing back and forth is common
+	if (s->images.count(h)) {
+		printf("BEACON slot %d image %u\n", nr, s->images[h]);
+		return;
+	}
+	const unsigned int n = s->images.size() + 1;
+
+	s->images[h] = n;
+	printf("BEACON slot %d image %u:", nr, n);
+	bcn_decode(s->image + BCN_TXWI_LEN, len - BCN_TXWI_LEN);
+}
+
+static void bcn_clear(int nr, bool partial)
+{
+	struct bcn_slot *s = &bcn_slots[nr];
+
+	s->active = false;
+	if (partial)
+		s->partial++;
+	else
+		s->clears++;
+	s->bytes += s->cur_bytes;
+	s->time += s->cur_time;
+}
+
+static void bcn_write(int nr, const struct rt2x00usb_event *ev)
+{
+	struct bcn_slot *s = &bcn_slots[nr];
+	const unsigned int off = ev->addr - bcn_base(nr);
+	const unsigned int len = ev->len < BCN_SLOT_SIZE - off ? ev->len : BCN_SLOT_SIZE - off;
+	const uint64_t duration = ev->hdr && ev->shdr ? get_ts(ev->hdr) - get_ts(ev->shdr) : 0;
+
+	if (off == 0) {
+		// Previous update not finished, count what was written if it has a frame
+		if (s->active && s->end >= BCN_TXWI_LEN + BCN_HDR_LEN + BCN_FIXED_LEN)
+			bcn_complete(nr, s->end);
+		else if (s->active)
+			bcn_clear(nr, true);
+		s->active = true;
+		s->end = 0;
+		s->cur_bytes = s->cur_time = 0;
+	} else if (!s->active || off != s->end) {
+		return;
+	}
+
+	memcpy(s->image + off, ev->data, len);
+	s->end = off + len;
+	s->cur_bytes += SETUP_LEN + ev->len;
+	s->cur_time += duration;
+
+	if (s->end < BCN_TXWI_LEN) {
+		// Driver clears the slot with a zero TXWI word
+		if (s->end == 4 && decode_reg_val(s->image) == 0)
+			bcn_clear(nr, false);
+		return;
+	}
+
+	const unsigned int frame_len = (decode_reg_val(s->image + 4) >> 16) & 0xfff;	// MPDU_TOTAL_BYTE_COUNT
+
+	if (frame_len == 0)
+		bcn_clear(nr, false);
+	else if (s->end >= BCN_TXWI_LEN + frame_len)
+		bcn_complete(nr, BCN_TXWI_LEN + frame_len);
+}
+
+void bcn_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	int nr;
+
+	if (bcn_first_ts == 0)
+		bcn_first_ts = ev->ts;
+	bcn_last_ts = ev->ts;
+
+	if (ev->type != RT2X00USB_AREA_WRITE || (nr = bcn_slot(ev->addr)) < 0)
+		return;
+	bcn_write(nr, ev);
+}
+
+void bcn_report(void)
+{
+	if (!bcn_enabled)
+		return;
+
+	const double span = bcn_last_ts > bcn_first_ts ? (bcn_last_ts - bcn_first_ts) / 1e6 : 1;
+
+	for (int i = 0; i < BCN_SLOTS; i++) {
+		struct bcn_slot *s = &bcn_slots[i];
+
+		if (s->updates == 0 && s->clears == 0 && s->partial == 0)
+			continue;
+
+		printf("BEACON slot %d at 0x%04x: %" PRIu64 " updates %.2f/s, %" PRIu64 " identical %zu images"
+		       " %" PRIu64 " clears %" PRIu64 " partial, %.1f bytes/s, %.3f ms USB time (%.3f%%)\n",
+		       i, bcn_base(i), s->updates, s->updates / span, s->identical, s->images.size(), s->clears,
+		       s->partial, s->bytes / span, s->time / 1000.0, s->time / span / 1e4);
+	}
+	fflush(stdout);
+}
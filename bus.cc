@@ -0,0 +1,236 @@
+/*
+ * Shared memory event bus. Decoded events are published into a ring in a
+ * POSIX shared memory object, any number of processes can attach to it and
+ * read events independently, each with its own cursor.
+ *
+ * The producer never waits for consumers. Every slot carries the sequence
+ * number of the event in it, written last, so a consumer detects that it
+ * was lapped either from the ring head or when the slot changed while it
+ * was copying it.
+ */
+
+#include <sys/mman.h>
+
+#define BUS_MAGIC	"RT2XBUS1"
+#define BUS_EVENTS	65536	// power of 2
+
+enum bus_event_type {
+	BUS_MAC_READ = 1,	// addr, value, arg[0] size in bytes
+	BUS_MAC_WRITE,
+	BUS_BBP_READ,		// addr, value
+	BUS_BBP_WRITE,
+	BUS_RF_READ,
+	BUS_RF_WRITE,
+	BUS_MCU_COMMAND,	// addr command, value token, arg[0] arg0, arg[1] arg1
+	BUS_TX_FRAME,		// addr WCID, value TXWI_W0, arg[0] MPDU bytes
+	BUS_RX_FRAME,		// addr WCID, value RXWI_W1, arg[0] MPDU bytes, arg[1] RXWI_W2
+	BUS_DROP,		// value lost usbmon events
+	BUS_FIRMWARE,		// value size, arg[0] crc32
+	BUS_REENUM,		// addr new address, value old address
+};
+
+struct bus_event {
+	uint64_t seq;		// 1 for the first event, 0 for empty slot
+	uint64_t ts;
+	uint16_t type;
+	uint16_t addr;
+	uint32_t value;
+	uint32_t arg[2];
+};
+
+struct bus_header {
+	char magic[8];
+	uint32_t event_size;
+	uint32_t n_events;
+	char pad[48];
+	uint64_t head;		// number of events published, own cache line
+	char pad2[56];
+};
+
+struct bus {
+	struct bus_header *hdr;
+	struct bus_event *ring;
+	size_t map_len;
+	char name[NAME_MAX];
+};
+
+static struct bus bus;
+
+static inline bool bus_enabled(void)
+{
+	return bus.hdr != NULL;
+}
+
+int bus_create(const char *name)
+{
+	const size_t len = sizeof(struct bus_header) + BUS_EVENTS * sizeof(struct bus_event);
+	void *p;
+	int fd;
+
+	if ((fd = shm_open(name, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+		return -1;
+	if (ftruncate(fd, len) < 0) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	bus.hdr = static_cast<struct bus_header *>(p);
+	bus.ring = reinterpret_cast<struct bus_event *>(bus.hdr + 1);
+	bus.map_len = len;
+	snprintf(bus.name, sizeof(bus.name), "%s", name);
+
+	bus.hdr->event_size = sizeof(struct bus_event);
+	bus.hdr->n_events = BUS_EVENTS;
+	// Consumers check magic last
+	__atomic_store(reinterpret_cast<uint64_t *>(bus.hdr->magic),
+		       reinterpret_cast<const uint64_t *>(BUS_MAGIC), __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void bus_publish(uint64_t ts, uint16_t type, uint16_t addr, uint32_t value,
+			uint32_t arg0 = 0, uint32_t arg1 = 0)
+{
+	const uint64_t n = bus.hdr->head;
+	struct bus_event *e = &bus.ring[n & (BUS_EVENTS - 1)];
+
+	__atomic_store_n(&e->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	e->ts = ts;
+	e->type = type;
+	e->addr = addr;
+	e->value = value;
+	e->arg[0] = arg0;
+	e->arg[1] = arg1;
+	__atomic_store_n(&e->seq, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&bus.hdr->head, n + 1, __ATOMIC_RELEASE);
+}
+
+void bus_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	switch (ev->type) {
+	case RT2X00USB_MAC_READ:
+		bus_publish(ev->ts, BUS_MAC_READ, ev->addr, ev->value, ev->arg[0]);
+		break;
+	case RT2X00USB_MAC_WRITE:
+		bus_publish(ev->ts, BUS_MAC_WRITE, ev->addr, ev->value, ev->arg[0]);
+		break;
+	case RT2X00USB_BBP_READ:
+		bus_publish(ev->ts, BUS_BBP_READ, ev->addr, ev->value);
+		break;
+	case RT2X00USB_BBP_WRITE:
+		bus_publish(ev->ts, BUS_BBP_WRITE, ev->addr, ev->value);
+		break;
+	case RT2X00USB_RF_READ:
+		bus_publish(ev->ts, BUS_RF_READ, ev->addr, ev->value);
+		break;
+	case RT2X00USB_RF_WRITE:
+		bus_publish(ev->ts, BUS_RF_WRITE, ev->addr, ev->value);
+		break;
+	case RT2X00USB_MCU_COMMAND:
+		bus_publish(ev->ts, BUS_MCU_COMMAND, ev->addr, ev->value, ev->arg[0], ev->arg[1]);
+		break;
+	case RT2X00USB_TX_FRAME:
+		bus_publish(ev->ts, BUS_TX_FRAME, ev->addr, ev->value, ev->arg[1]);
+		break;
+	case RT2X00USB_RX_FRAME:
+		bus_publish(ev->ts, BUS_RX_FRAME, ev->addr, ev->value, ev->arg[1], ev->arg[2]);
+		break;
+	case RT2X00USB_DROP:
+		bus_publish(ev->ts, BUS_DROP, 0, ev->value);
+		break;
+	case RT2X00USB_FIRMWARE:
+		bus_publish(ev->ts, BUS_FIRMWARE, 0, ev->value, ev->arg[0]);
+		break;
+	case RT2X00USB_REENUM:
+		bus_publish(ev->ts, BUS_REENUM, ev->addr, ev->value);
+		break;
+	}
+}
+
+void bus_close(void)
+{
+	if (!bus_enabled())
+		return;
+
+	munmap(bus.hdr, bus.map_len);
+	shm_unlink(bus.name);
+	bus.hdr = NULL;
+}
+
+static void bus_print_event(struct bus_event *e)
+{
+	static const char *names[] = {
+		"?", "MAC_READ", "MAC_WRITE", "BBP_READ", "BBP_WRITE", "RF_READ", "RF_WRITE",
+		"MCU_COMMAND", "TX_FRAME", "RX_FRAME", "DROP", "FIRMWARE", "REENUM",
+	};
+	const char *name = e->type < ARRAY_SIZE(names) ? names[e->type] : "?";
+
+	printf("%" PRIu64 " %" PRIu64 ".%06" PRIu64 " %s 0x%04x 0x%08x 0x%x 0x%x\n", e->seq,
+	       e->ts / 1000000, e->ts % 1000000, name, e->addr, e->value, e->arg[0], e->arg[1]);
+}
+
+/*
+ * Consumer: attach to bus @name and print events from now on, until the
+ * process is terminated.
+ */
+int bus_attach(const char *name)
+{
+	struct bus_header *hdr;
+	struct bus_event *ring, e;
+	struct stat st;
+	uint64_t cursor;
+	void *p;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -1;
+
+	hdr = static_cast<struct bus_header *>(p);
+	ring = reinterpret_cast<struct bus_event *>(hdr + 1);
+	if (memcmp(hdr->magic, BUS_MAGIC, sizeof(hdr->magic)) || hdr->event_size != sizeof(e) ||
+	    sizeof(*hdr) + (size_t) hdr->n_events * sizeof(e) > (size_t) st.st_size) {
+		fprintf(stderr, "%s: not an event bus\n", name);
+		return -1;
+	}
+
+	const uint64_t n_events = hdr->n_events;
+	cursor = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		const uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+
+		if (cursor == head) {
+			fflush(stdout);
+			usleep(1000);
+			continue;
+		}
+		if (head - cursor > n_events) {
+			printf("LAPPED: %" PRIu64 " events lost\n", head - n_events - cursor);
+			cursor = head - n_events;
+		}
+
+		struct bus_event *slot = &ring[cursor % n_events];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != cursor + 1)
+			continue;	// overwritten, head tells how much
+		e = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != cursor + 1)
+			continue;
+
+		bus_print_event(&e);
+		cursor++;
+	}
+	return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Capture files are pcap files with LINKTYPE_USB_LINUX_MMAPPED records,
+ * i.e. usbmon_packet header followed by captured data, the same format
+ * "tcpdump -i usbmonN -w" produces, so they can be opened in wireshark too.
+ */
+
+#define PCAP_MAGIC			0xa1b2c3d4
+#define PCAP_MAGIC_NSEC			0xa1b23c4d
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+#define CAPTURE_SNAPLEN			0x40000
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_header {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct capture {
+	int fd;
+	unsigned char *buf;
+	size_t len;
+	size_t truncated;	// offset of incomplete last record, if any
+	// Aligned copy of the current event
+	struct usbmon_packet *ev;
+	size_t ev_size;
+};
+
+FILE *capture_create(const char *name)
+{
+	struct pcap_file_header fh;
+	FILE *fp;
+
+	fp = fopen(name, "w");
+	if (fp == NULL)
+		return NULL;
+
+	fh.magic = PCAP_MAGIC;
+	fh.version_major = 2;
+	fh.version_minor = 4;
+	fh.thiszone = 0;
+	fh.sigfigs = 0;
+	fh.snaplen = CAPTURE_SNAPLEN;
+	fh.linktype = LINKTYPE_USB_LINUX_MMAPPED;
+
+	if (fwrite(&fh, sizeof(fh), 1, fp) != 1) {
+		fclose(fp);
+		return NULL;
+	}
+	return fp;
+}
+
+// Return capture offset of the written record
+uint64_t capture_write(FILE *fp, struct usbmon_packet *hdr)
+{
+	struct pcap_rec_header rh;
+	uint64_t off = ftello(fp);
+
+	rh.ts_sec = hdr->ts_sec;
+	rh.ts_usec = hdr->ts_usec;
+	rh.incl_len = sizeof(struct usbmon_packet) + hdr->len_cap;
+	rh.orig_len = sizeof(struct usbmon_packet) + hdr->length;
+
+	fwrite(&rh, sizeof(rh), 1, fp);
+	fwrite(hdr, rh.incl_len, 1, fp);
+	return off;
+}
+
+int capture_open(struct capture *cap, const char *name)
+{
+	struct pcap_file_header *fh;
+	struct stat st;
+
+	memset(cap, 0, sizeof(*cap));
+
+	if ((cap->fd = open(name, O_RDONLY)) == -1) {
+		printf("unable to open %s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(cap->fd, &st) == -1 || st.st_size < (off_t) sizeof(*fh)) {
+		printf("%s: not a capture file\n", name);
+		goto err;
+	}
+	cap->len = st.st_size;
+
+	cap->buf = static_cast<unsigned char *>(mmap(NULL, cap->len, PROT_READ, MAP_SHARED, cap->fd, 0));
+	if (cap->buf == MAP_FAILED) {
+		printf("unable to mmap %s: %s\n", name, strerror(errno));
+		goto err;
+	}
+
+	fh = reinterpret_cast<struct pcap_file_header *>(cap->buf);
+	if ((fh->magic != PCAP_MAGIC && fh->magic != PCAP_MAGIC_NSEC) ||
+	    fh->linktype != LINKTYPE_USB_LINUX_MMAPPED) {
+		printf("%s: not a usbmon mmapped pcap file\n", name);
+		munmap(cap->buf, cap->len);
+		goto err;
+	}
+
+	return 0;
+err:
+	close(cap->fd);
+	return -1;
+}
+
+void capture_close(struct capture *cap)
+{
+	munmap(cap->buf, cap->len);
+	close(cap->fd);
+	free(cap->ev);
+}
+
+static inline uint32_t capture_rec_len(struct capture *cap, size_t off)
+{
+	struct pcap_rec_header rh;
+
+	memcpy(&rh, cap->buf + off, sizeof(rh));
+	return rh.incl_len;
+}
+
+// Return @off if a complete record starts there, cap->len otherwise
+static size_t capture_check(struct capture *cap, size_t off)
+{
+	if (off + sizeof(struct pcap_rec_header) > cap->len)
+		return cap->len;
+
+	uint32_t incl_len = capture_rec_len(cap, off);
+	if (incl_len < sizeof(struct usbmon_packet) ||
+	    off + sizeof(struct pcap_rec_header) + incl_len > cap->len) {
+		cap->truncated = off;
+		return cap->len;
+	}
+
+	return off;
+}
+
+size_t capture_first(struct capture *cap)
+{
+	return capture_check(cap, sizeof(struct pcap_file_header));
+}
+
+// Return offset of the record following one at @off, or cap->len at the end
+size_t capture_next(struct capture *cap, size_t off)
+{
+	return capture_check(cap, off + sizeof(struct pcap_rec_header) + capture_rec_len(cap, off));
+}
+
+// Header only, without copying data
+void capture_header(struct capture *cap, size_t off, struct usbmon_packet *hdr)
+{
+	memcpy(hdr, cap->buf + off + sizeof(struct pcap_rec_header), sizeof(*hdr));
+}
+
+// Return aligned copy of event at @off, valid until next call
+struct usbmon_packet *capture_event(struct capture *cap, size_t off)
+{
+	uint32_t incl_len = capture_rec_len(cap, off);
+
+	if (incl_len > cap->ev_size) {
+		free(cap->ev);
+		cap->ev_size = incl_len;
+		cap->ev = static_cast<struct usbmon_packet *>(malloc(incl_len));
+		assert(cap->ev);
+	}
+
+	memcpy(cap->ev, cap->buf + off + sizeof(struct pcap_rec_header), incl_len);
+
+	// Data might be cut by snaplen
+	if (cap->ev->len_cap > incl_len - sizeof(struct usbmon_packet))
+		cap->ev->len_cap = incl_len - sizeof(struct usbmon_packet);
+
+	return cap->ev;
+}
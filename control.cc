@@ -0,0 +1,313 @@
+/*
+ * Control socket for querying live decoder state while sniffing.
+ *
+ * Clients connect to a Unix stream socket and send one request per line,
+ * each answered by zero or more lines followed by "OK" or "ERR <reason>":
+ *
+ *	status			time of last event, events, pending URBs, lost events,
+ *				bulk decoding mode and lag with --overload
+ *	reg <name|addr> [field]	last known value of MAC register or its field
+ *	bbp <nr> [n]		last n (default 1) values of BBP register
+ *	rf <nr> [n]		last n (default 1) values of RF register
+ *	count <mac|bbp|rf> <reg>	number of accesses to register
+ *
+ * Requests are served by a separate thread from a snapshot of the state. The
+ * decoder publishes snapshots through a triple buffer, it never waits for the
+ * server and the server never sees a half written snapshot.
+ */
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CTL_HIST	16	// values kept per BBP/RF register
+#define CTL_PUBLISH_US	1000	// minimal interval of snapshots under load
+#define CTL_FRESH	4	// snapshot in the middle buffer not yet taken
+
+struct ctl_snapshot {
+	uint64_t seq;
+	uint64_t ts;
+	uint64_t events;
+	uint64_t dropped;
+	uint32_t pending;
+	int mode;
+	uint64_t lag;
+	struct shadow_regs shadow;
+	uint32_t mac_count[MAX_MAC_SHADOW];
+	uint32_t bbp_count[MAX_BBP_RF_SHADOW];
+	uint32_t rf_count[MAX_BBP_RF_SHADOW];
+	// Ring of last values, count tells the position
+	uint8_t bbp_hist[MAX_BBP_RF_SHADOW][CTL_HIST];
+	uint8_t rf_hist[MAX_BBP_RF_SHADOW][CTL_HIST];
+};
+
+bool ctl_enabled;
+// Counters and history maintained by the decoder
+static struct ctl_snapshot ctl_live;
+static struct ctl_snapshot ctl_buf[3];
+// Buffer owned by decoder, the one in the middle and owned by server
+static int ctl_writer = 0, ctl_middle = 1, ctl_reader = 2;
+static uint64_t ctl_last_publish;
+
+static inline void ctl_mac(uint16_t addr)
+{
+	if (addr / 2 < MAX_MAC_SHADOW)
+		ctl_live.mac_count[addr / 2]++;
+}
+
+// Count accesses and keep history of BBP/RF values
+void ctl_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	const uint16_t addr = ev->addr;
+
+	switch (ev->type) {
+	case RT2X00USB_MAC_READ:
+	case RT2X00USB_MAC_WRITE:
+		ctl_mac(addr);
+		if (ev->arg[0] == 4)
+			ctl_mac(addr + 2);
+		break;
+	case RT2X00USB_MAC_DATA_WRITE:
+		for (unsigned int i = 0; i < ev->len / 2; i++)
+			ctl_mac(addr + 2 * i);
+		break;
+	case RT2X00USB_BBP_READ:
+	case RT2X00USB_BBP_WRITE:
+		ctl_live.bbp_hist[addr][ctl_live.bbp_count[addr]++ % CTL_HIST] = ev->value;
+		break;
+	case RT2X00USB_RF_READ:
+	case RT2X00USB_RF_WRITE:
+		ctl_live.rf_hist[addr][ctl_live.rf_count[addr]++ % CTL_HIST] = ev->value;
+		break;
+	}
+}
+
+// Called by decoder, @idle means no more events are queued now
+void ctl_publish(uint64_t now, bool idle, uint64_t events, uint32_t pending)
+{
+	struct ctl_snapshot *s = &ctl_buf[ctl_writer];
+
+	if (!ctl_enabled || events == ctl_live.events || (!idle && now - ctl_last_publish < CTL_PUBLISH_US))
+		return;
+
+	ctl_live.seq++;
+	ctl_live.ts = cur_ts;
+	ctl_live.events = events;
+	ctl_live.dropped = dropped_events;
+	ctl_live.pending = pending;
+	ctl_live.mode = overload_mode;
+	ctl_live.lag = overload_lag;
+	ctl_live.shadow = *rt2x00usb_shadow(decoder);
+	*s = ctl_live;
+
+	ctl_writer = __atomic_exchange_n(&ctl_middle, ctl_writer | CTL_FRESH, __ATOMIC_ACQ_REL) & ~CTL_FRESH;
+	ctl_last_publish = now;
+}
+
+static struct ctl_snapshot *ctl_snapshot(void)
+{
+	if (__atomic_load_n(&ctl_middle, __ATOMIC_ACQUIRE) & CTL_FRESH)
+		ctl_reader = __atomic_exchange_n(&ctl_middle, ctl_reader, __ATOMIC_ACQ_REL) & ~CTL_FRESH;
+	return &ctl_buf[ctl_reader];
+}
+
+// Register by name or address, -1 if not in the shadow
+static int ctl_mac_addr(const char *arg)
+{
+	struct reg *reg = find_reg(arg);
+	char *end;
+	long addr;
+
+	if (reg) {
+		addr = reg->offset;
+	} else {
+		addr = strtol(arg, &end, 0);
+		if (*end)
+			return -1;
+	}
+	if (addr < 0 || addr / 2 + 1 >= MAX_MAC_SHADOW)
+		return -1;
+	return addr & ~1;
+}
+
+static const char *ctl_reg(FILE *fp, struct ctl_snapshot *s, const char *arg, const char *field)
+{
+	const int addr = ctl_mac_addr(arg);
+	const int nr = addr / 2;
+
+	if (addr < 0)
+		return "unknown register";
+	if (!is_known(s->shadow.mac_known, nr) || !is_known(s->shadow.mac_known, nr + 1))
+		return "value not known";
+
+	const uint32_t val = s->shadow.mac[nr] | s->shadow.mac[nr + 1] << 16;
+	struct reg *reg = get_reg(addr);
+
+	if (field == NULL) {
+		fprintf(fp, "0x%04x 0x%08x\n", addr, val);
+		for (int i = reg ? reg->n_fields - 1 : -1; i >= 0; i--) {
+			struct field *f = &reg->fields[i];
+			uint32_t mask = (0xffffffff << f->first) & (0xffffffff >> (31 - f->last));
+
+			fprintf(fp, "%s 0x%x\n", f->name, (val & mask) >> f->first);
+		}
+		return NULL;
+	}
+
+	for (int i = reg ? reg->n_fields - 1 : -1; i >= 0; i--) {
+		struct field *f = &reg->fields[i];
+		uint32_t mask = (0xffffffff << f->first) & (0xffffffff >> (31 - f->last));
+
+		if (!strcasecmp(f->name, field)) {
+			fprintf(fp, "0x%x\n", (val & mask) >> f->first);
+			return NULL;
+		}
+	}
+	return "unknown field";
+}
+
+static const char *ctl_hist(FILE *fp, const uint32_t *count, uint8_t (*hist)[CTL_HIST], int max,
+			    const char *arg, const char *n_arg)
+{
+	const int nr = strtol(arg, NULL, 0);
+	int n = n_arg ? atoi(n_arg) : 1;
+
+	if (nr < 0 || nr >= max)
+		return "unknown register";
+	if (n > CTL_HIST)
+		n = CTL_HIST;
+	if ((uint32_t) n > count[nr])
+		n = count[nr];
+
+	// Newest first
+	for (int i = 1; i <= n; i++)
+		fprintf(fp, "0x%02x\n", hist[nr][(count[nr] - i) % CTL_HIST]);
+	return NULL;
+}
+
+static const char *ctl_count(FILE *fp, struct ctl_snapshot *s, const char *type, const char *arg)
+{
+	int nr;
+
+	if (type == NULL || arg == NULL)
+		return "missing argument";
+
+	if (!strcmp(type, "mac")) {
+		if ((nr = ctl_mac_addr(arg)) < 0)
+			return "unknown register";
+		// Halves are counted separately
+		fprintf(fp, "%u\n", std::max(s->mac_count[nr / 2], s->mac_count[nr / 2 + 1]));
+		return NULL;
+	}
+
+	nr = strtol(arg, NULL, 0);
+	if (!strcmp(type, "bbp") && nr >= 0 && nr < MAX_BBP_RF_SHADOW)
+		fprintf(fp, "%u\n", s->bbp_count[nr]);
+	else if (!strcmp(type, "rf") && nr >= 0 && nr < MAX_BBP_RF_SHADOW)
+		fprintf(fp, "%u\n", s->rf_count[nr]);
+	else
+		return "unknown register";
+	return NULL;
+}
+
+static void ctl_request(FILE *fp, char *line)
+{
+	struct ctl_snapshot *s = ctl_snapshot();
+	char *save, *cmd, *a1, *a2;
+	const char *err = NULL;
+
+	cmd = strtok_r(line, " \t\r\n", &save);
+	a1 = strtok_r(NULL, " \t\r\n", &save);
+	a2 = strtok_r(NULL, " \t\r\n", &save);
+
+	if (cmd == NULL)
+		return;
+
+	if (!strcmp(cmd, "status")) {
+		fprintf(fp, "ts %" PRIu64 ".%06" PRIu64 " events %" PRIu64 " pending %u dropped %" PRIu64,
+			s->ts / 1000000, s->ts % 1000000, s->events, s->pending, s->dropped);
+		if (overload_enabled)
+			fprintf(fp, " mode %s lag %.3f", overload_name[s->mode], s->lag / 1000.0);
+		fprintf(fp, "\n");
+	}
+	else if (strcmp(cmd, "reg") && strcmp(cmd, "bbp") && strcmp(cmd, "rf") && strcmp(cmd, "count"))
+		err = "unknown request";
+	else if (a1 == NULL)
+		err = "missing argument";
+	else if (!strcmp(cmd, "reg"))
+		err = ctl_reg(fp, s, a1, a2);
+	else if (!strcmp(cmd, "bbp"))
+		err = ctl_hist(fp, s->bbp_count, s->bbp_hist, MAX_BBP_RF_SHADOW, a1, a2);
+	else if (!strcmp(cmd, "rf"))
+		err = ctl_hist(fp, s->rf_count, s->rf_hist, MAX_BBP_RF_SHADOW, a1, a2);
+	else
+		err = ctl_count(fp, s, a1, a2);
+
+	if (err)
+		fprintf(fp, "ERR %s\n", err);
+	else
+		fprintf(fp, "OK\n");
+	fflush(fp);
+}
+
+static void *ctl_server(void *arg)
+{
+	const int sock = (long) arg;
+	char line[256];
+
+	for (;;) {
+		int fd = accept(sock, NULL, NULL);
+		FILE *in, *out;
+
+		if (fd < 0)
+			continue;
+		if ((in = fdopen(fd, "r")) == NULL) {
+			close(fd);
+			continue;
+		}
+		if ((out = fdopen(dup(fd), "w")) == NULL) {
+			fclose(in);
+			continue;
+		}
+		while (fgets(line, sizeof(line), in))
+			ctl_request(out, line);
+		fclose(out);
+		fclose(in);
+	}
+	return NULL;
+}
+
+int ctl_start(const char *path)
+{
+	struct sockaddr_un addr;
+	sigset_t set, old;
+	pthread_t thread;
+	int sock, ret;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return -1;
+	unlink(path);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 4) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	// Signals are handled by the decoding thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&thread, NULL, ctl_server, (void *) (long) sock);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		close(sock);
+		return -1;
+	}
+
+	ctl_enabled = true;
+	return 0;
+}
@@ -0,0 +1,1124 @@
+/*
+ * Copyright (C) 2011-2015 Stanislaw Gruszka
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decoder of rt2x00 USB traffic, see rt2x00usb.h. Everything the decoder
+ * knows is in struct rt2x00usb, results are only passed to callbacks.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+
+#include <map>
+#include <list>
+#include <vector>
+
+#include "rt2x00usb.h"
+
+#if 0
+#define DEBUG(x,...) printf("%s: " x, __func__, ##__VA_ARGS__)
+#else
+#define DEBUG(x,...)
+#endif
+
+#include "registers.cc"
+
+// flag_data of pending submission copied without payload
+#define FLAG_DATA_DROPPED	'X'
+
+struct rt2x00usb_cb {
+	rt2x00usb_callback fn;
+	void *priv;
+};
+
+struct rt2x00usb {
+	struct decoder_state state;
+	struct shadow_regs shadow;
+	// Submitted URBs waiting for completion
+	std::map<uint64_t, char *> pkts_map;
+	// Values written to registers, allocated by rt2x00usb_enable_maps()
+	std::list<uint16_t> *mac_map;
+	std::list<uint8_t> *bbp_map;
+	std::list<uint8_t> *rf_map;
+	std::vector<struct rt2x00usb_cb> callbacks;
+	// Merge halves written within this many usec, 0 disables merging
+	uint64_t coalesce_timeout;
+	// Bulk URBs decoded, see rt2x00usb_bulk_mode()
+	int bulk_mode;
+	unsigned int bulk_sample;
+	unsigned int bulk_seq[256];	// per endpoint, not to follow the traffic pattern
+	unsigned int inflight[256];	// pending URBs per endpoint
+	// Event being decoded
+	uint64_t ts;
+	struct usbmon_packet *shdr;
+	struct usbmon_packet *hdr;
+	char msg[256];
+};
+
+static void event_init(struct rt2x00usb *d, struct rt2x00usb_event *ev, int type)
+{
+	memset(ev, 0, sizeof(*ev));
+	ev->type = type;
+	ev->ts = d->ts;
+	ev->shdr = d->shdr;
+	ev->hdr = d->hdr;
+}
+
+static void half_flush(struct rt2x00usb *d);
+static void emit_complete(struct rt2x00usb *d, struct usbmon_packet *shdr, struct usbmon_packet *hdr,
+			  unsigned int inflight);
+
+static void emit(struct rt2x00usb *d, const struct rt2x00usb_event *ev)
+{
+	// Unpaired half goes out before anything decoded after it, the upper
+	// half is submitted after the lower one completes
+	if (d->state.half.active && ev->type != RT2X00USB_SUBMIT)
+		half_flush(d);
+
+	for (unsigned int i = 0; i < d->callbacks.size(); i++)
+		d->callbacks[i].fn(ev, d->callbacks[i].priv);
+}
+
+static void emit_value(struct rt2x00usb *d, int type, uint16_t addr, uint32_t value,
+		       uint32_t arg0 = 0, uint32_t arg1 = 0)
+{
+	struct rt2x00usb_event ev;
+
+	event_init(d, &ev, type);
+	ev.addr = addr;
+	ev.value = value;
+	ev.arg[0] = arg0;
+	ev.arg[1] = arg1;
+	emit(d, &ev);
+}
+
+static void emit_data(struct rt2x00usb *d, int type, uint16_t addr, struct usbmon_packet *hdr)
+{
+	struct rt2x00usb_event ev;
+
+	event_init(d, &ev, type);
+	ev.addr = addr;
+	ev.data = get_data(hdr);
+	ev.len = hdr->len_cap;
+	emit(d, &ev);
+}
+
+static void warn(struct rt2x00usb *d, int line, const char *fmt, ...) __attribute__ ((format (printf, 3, 4)));
+
+static void warn(struct rt2x00usb *d, int line, const char *fmt, ...)
+{
+	struct rt2x00usb_event ev;
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(d->msg, sizeof(d->msg), fmt, ap);
+	va_end(ap);
+
+	event_init(d, &ev, RT2X00USB_WARN);
+	ev.value = line;
+	ev.msg = d->msg;
+	emit(d, &ev);
+}
+
+#include "firmware.cc"
+
+static inline void set_known(uint8_t *bitmap, int nr)
+{
+	bitmap[nr / 8] |= 1 << (nr % 8);
+}
+
+static void shadow_mac(struct rt2x00usb *d, uint16_t addr, uint16_t data)
+{
+	if (addr/2 >= MAX_MAC_SHADOW)
+		return;
+
+	d->shadow.mac[addr/2] = data;
+	set_known(d->shadow.mac_known, addr/2);
+}
+
+static void shadow_mac32(struct rt2x00usb *d, uint16_t addr, uint32_t data)
+{
+	shadow_mac(d, addr, data & 0xffff);
+	shadow_mac(d, addr + 2, data >> 16);
+}
+
+static void shadow_bbp(struct rt2x00usb *d, uint8_t addr, uint8_t data)
+{
+	d->shadow.bbp[addr] = data;
+	set_known(d->shadow.bbp_known, addr);
+}
+
+static void shadow_rf(struct rt2x00usb *d, uint8_t addr, uint8_t data)
+{
+	d->shadow.rf[addr] = data;
+	set_known(d->shadow.rf_known, addr);
+}
+
+static void mac_add_to_map(struct rt2x00usb *d, uint16_t addr, uint32_t data)
+{
+	assert(addr/2 < MAX_MAC_REG);
+
+	shadow_mac(d, addr, data);
+
+	if (d->mac_map)
+		d->mac_map[addr/2].push_back(data);
+}
+
+static void mac_add_data_to_map(struct rt2x00usb *d, struct usb_ctrlrequest *cr, struct usbmon_packet *shdr)
+{
+	unsigned char *data = get_data(shdr);
+	for (unsigned int i = 0; i < shdr->len_cap/2; i++)
+		mac_add_to_map(d, cr->wIndex + 2*i , data[2*i] | (((unsigned short)data[2*i + 1]) << 8));
+}
+
+static void bbp_add_to_map(struct rt2x00usb *d, uint16_t addr, uint8_t data)
+{
+	assert(addr < MAX_BBP_REG);
+
+	shadow_bbp(d, addr, data);
+
+	if (d->bbp_map)
+		d->bbp_map[addr].push_back(data);
+}
+
+static void rf_add_to_map(struct rt2x00usb *d, uint16_t addr, uint8_t data)
+{
+	assert(addr < MAX_RF_REG);
+
+	shadow_rf(d, addr, data);
+
+	if (d->rf_map)
+		d->rf_map[addr].push_back(data);
+}
+
+// Deliver held lower half as it was written
+static void half_flush(struct rt2x00usb *d)
+{
+	struct half_write h = d->state.half;
+	struct rt2x00usb_event ev;
+
+	// Idle state is all zero, it is part of decoder state
+	memset(&d->state.half, 0, sizeof(d->state.half));
+
+	event_init(d, &ev, RT2X00USB_MAC_WRITE);
+	ev.ts = h.ts;
+	ev.shdr = &h.shdr;
+	ev.hdr = &h.hdr;
+	ev.addr = h.addr;
+	ev.value = h.value;
+	ev.arg[0] = 2;
+	emit(d, &ev);
+
+	if (h.complete)
+		emit_complete(d, &h.shdr, &h.hdr, h.inflight);
+}
+
+/*
+ * rt2x00usb writes 32-bit registers with two wValue writes, 16 LSB first.
+ * Hold the lower half and deliver both as one 32-bit write when the upper
+ * half follows. Return true if the write was held or merged.
+ */
+static bool half_write(struct rt2x00usb *d, struct usb_ctrlrequest *cr,
+		       struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+{
+	struct half_write *h = &d->state.half;
+
+	if (h->active && cr->wIndex == h->addr + 2) {
+		struct half_write lower = *h;
+		struct rt2x00usb_event ev;
+
+		event_init(d, &ev, RT2X00USB_MAC_WRITE);
+		ev.addr = h->addr;
+		ev.value = h->value | cr->wValue << 16;
+		ev.arg[0] = 4;
+		ev.arg[1] = 2;
+		ev.duration = d->ts - h->ts;
+
+		memset(h, 0, sizeof(*h));
+		emit(d, &ev);
+		if (lower.complete)
+			emit_complete(d, &lower.shdr, &lower.hdr, lower.inflight);
+		return true;
+	}
+
+	// Registers are 32-bit aligned, upper half without the lower one
+	if (cr->wIndex % 4)
+		return false;
+
+	if (h->active)
+		half_flush(d);
+
+	h->active = 1;
+	h->ts = d->ts;
+	h->addr = cr->wIndex;
+	h->value = cr->wValue;
+	// Data is in wValue, headers are all what is needed
+	h->shdr = *shdr;
+	h->hdr = *hdr;
+	return true;
+}
+
+static uint32_t get_reg_val(struct usbmon_packet *hdr, int nr = 0)
+{
+	unsigned char *buf = get_data(hdr);
+	buf += nr * sizeof(uint32_t);
+	return decode_reg_val(buf);
+}
+
+// Indirect access through @reg is complete
+static void special_reg_done(struct rt2x00usb *d, const struct special_reg *reg, struct special_reg_state *s,
+			     bool read)
+{
+	const bool bbp = reg->addr == BBP_SPECIAL_ADDR;
+
+	if (read)
+		emit_value(d, bbp ? RT2X00USB_BBP_READ : RT2X00USB_RF_READ, s->cur_addr, s->cur_data);
+	else
+		emit_value(d, bbp ? RT2X00USB_BBP_WRITE : RT2X00USB_RF_WRITE, s->cur_addr, s->cur_data);
+
+	if (read && bbp)
+		shadow_bbp(d, s->cur_addr, s->cur_data);
+	else if (read)
+		shadow_rf(d, s->cur_addr, s->cur_data);
+	else if (bbp)
+		bbp_add_to_map(d, s->cur_addr, s->cur_data);
+	else
+		rf_add_to_map(d, s->cur_addr, s->cur_data);
+
+	s->state = CHECKING_STATUS;
+}
+
+static void process_special_register_rw(struct rt2x00usb *d, struct usb_ctrlrequest *cr,
+					struct usbmon_packet *shdr, struct usbmon_packet *hdr,
+					const struct special_reg *reg, struct special_reg_state *s)
+{
+	const uint32_t DATA_MASK = 0x000000ff;
+	const uint32_t ADDR_MASK = reg->ADDR_MASK;
+	const uint32_t RW_BIT	 = 0x00010000; // 0 - Write, 1 - Read
+	const uint32_t KICK_BIT	 = 0x00020000;
+
+	if (is_read_cr(cr)) {
+		// Read
+		assert(hdr->len_cap == 4);
+		uint32_t reg_val = get_reg_val(hdr);
+
+		if (s->state == KICK_READ) {
+			bool busy = reg_val & KICK_BIT;
+			if (busy)
+				return;
+
+			if (s->cur_addr != ((reg_val & ADDR_MASK) >> 8))
+				warn(d, __LINE__, "cur_addr %02x addr %02x reg_val %08x", s->cur_addr, (reg_val & ADDR_MASK) >> 8, reg_val);
+
+			s->cur_data = reg_val & DATA_MASK;
+
+			special_reg_done(d, reg, s, true);
+		} else {
+			if (s->state != CHECKING_STATUS)
+				warn(d, __LINE__, "reg->state (%d) != CHECKING_STATUS", s->state);
+		}
+	} else {
+		// Write
+		if (shdr->len_cap == 4) {
+			uint32_t reg_val = get_reg_val(shdr);
+
+			s->cur_data = reg_val & DATA_MASK;
+			s->cur_addr = (reg_val & ADDR_MASK) >> 8;
+
+			bool do_read = reg_val & RW_BIT;
+			if (reg->write_is_1)
+				do_read = !do_read;
+			bool do_kick = reg_val & KICK_BIT;
+
+			assert(do_kick == true);
+
+			if (do_read)
+				s->state = KICK_READ;
+			else
+				special_reg_done(d, reg, s, false);
+		} else if (shdr->len_cap == 0) {
+			if (cr->wIndex == reg->addr) {
+				s->cur_data = cr->wValue & DATA_MASK;
+				s->cur_addr = (cr->wValue & ADDR_MASK) >> 8;
+
+				s->state = SET_ADDR_DATA;
+			} else {
+				if (s->state != SET_ADDR_DATA) {
+					s->state = CHECKING_STATUS;
+					return;
+				}
+
+				// UpperHalf (cr->wIndex == 0x101e)
+				bool do_read = cr->wValue & (RW_BIT >> 16);
+				if (reg->write_is_1)
+					do_read = !do_read;
+				bool do_kick = cr->wValue & (KICK_BIT >> 16);
+
+				assert(do_kick == true);
+
+				if (do_read == false)
+					special_reg_done(d, reg, s, false);
+				else
+					s->state = KICK_READ;
+			}
+		} else
+			assert(false);
+	}
+}
+
+static void process_register_rw(struct rt2x00usb *d, struct usb_ctrlrequest *cr,
+				struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+{
+	if (is_read_cr(cr)) {
+		// Read
+		assert(shdr->len_cap == 0);
+
+		if (hdr->len_cap != 4) {
+			emit_data(d, RT2X00USB_MAC_DATA_READ, cr->wIndex, hdr);
+			return;
+		}
+
+		uint32_t reg_val = get_reg_val(hdr);
+		shadow_mac32(d, cr->wIndex, reg_val);
+		emit_value(d, RT2X00USB_MAC_READ, cr->wIndex, reg_val, 4);
+	} else {
+		// Write
+		assert(hdr->len_cap == 0);
+
+		if (shdr->len_cap != 4 && shdr->len_cap != 0) {
+			emit_data(d, RT2X00USB_MAC_DATA_WRITE, cr->wIndex, shdr);
+			mac_add_data_to_map(d, cr, shdr);
+			return;
+		}
+
+		if (shdr->len_cap == 4) {
+			uint32_t reg_val = get_reg_val(shdr);
+
+			emit_value(d, RT2X00USB_MAC_WRITE, cr->wIndex, reg_val, 4);
+			// Halves of two consecutive registers written at once are not recorded
+			if (!get_reg(cr->wIndex - 2) || !get_reg(cr->wIndex + 2)) {
+				mac_add_to_map(d, cr->wIndex, reg_val & 0xffff);	// LowerHalf
+				mac_add_to_map(d, cr->wIndex + 2, reg_val >> 16);	// UpperHalf
+			}
+		} else if (shdr->len_cap == 0) {
+			// Using wValue as data, Lower or Upper Half
+			mac_add_to_map(d, cr->wIndex, cr->wValue);
+			if (d->coalesce_timeout && half_write(d, cr, shdr, hdr))
+				return;
+			emit_value(d, RT2X00USB_MAC_WRITE, cr->wIndex, cr->wValue, 2);
+		}
+	}
+}
+
+static bool process_mcu_request(struct rt2x00usb *d, struct usb_ctrlrequest *cr,
+				struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+{
+	const uint16_t H2M_MAILBOX_CSR = 0x7010;
+	const uint32_t OWNER_BIT = 0x00000001;
+	const uint32_t HOST_CMD = 0x404;
+	struct mcu_state *mcu = &d->state.mcu;
+
+	switch (mcu->state) {
+	case 0:
+		// Check busy or not
+		if (cr->wIndex == H2M_MAILBOX_CSR) {
+			if (is_read_cr(cr)) {
+				assert(hdr->len_cap == 4);
+
+				uint32_t reg_val = get_reg_val(hdr);
+
+				if (!(reg_val & OWNER_BIT)) // not busy
+					mcu->state = 1;
+			} else {
+				// For some MCU command driver skip "check busy" part
+				mcu->state = 1;
+				goto state_1;
+			}
+		} else {
+			return false;
+		}
+		break;
+	case 1:
+state_1:
+		if (cr->wIndex != H2M_MAILBOX_CSR)
+			return false;
+
+		if (is_read_cr(cr))
+			goto stop_processing;
+
+		if (hdr->len_cap == 4) {
+			uint32_t reg_val = get_reg_val(hdr);
+			mcu->arg0 = reg_val & 0x000000ff;
+			mcu->arg1 = (reg_val & 0x0000ff00) >> 8;
+			mcu->token = (reg_val & 0x00ff0000) >> 16;
+			mcu->owner = (reg_val & 0xff000000) >> 24;
+			mcu->state = 3;
+		} else {
+			// Write 16 LSB to MAILBOX_CSR
+			assert(cr->wIndex == H2M_MAILBOX_CSR);
+			mcu->arg0 = cr->wValue & 0x00ff;
+			mcu->arg1 = (cr->wValue & 0xff00) >> 8;
+			mcu->state = 2;
+		}
+		break;
+	case 2:
+		// Write 16 MSB to MAILBOX_CSR
+		if (cr->wIndex != H2M_MAILBOX_CSR + 2)
+			goto stop_processing;
+		assert(!is_read_cr(cr));
+
+		mcu->token = cr->wValue & 0x00ff;
+		mcu->owner = (cr->wValue & 0xff00) >> 8;
+		mcu->state = 3;
+		break;
+	case 3:
+		if (cr->wIndex != HOST_CMD)
+			goto stop_processing;
+		assert(!is_read_cr(cr));
+
+		if (hdr->len_cap == 4) {
+			uint32_t reg_val = get_reg_val(hdr);
+			mcu->command = reg_val & 0xff;
+			goto done;
+		} else {
+			mcu->command = cr->wValue & 0xff;
+			mcu->state = 4;
+		}
+		break;
+	case 4:
+		if (cr->wIndex != HOST_CMD + 2)
+			goto stop_processing;
+		assert(!is_read_cr(cr));
+done:
+		emit_value(d, RT2X00USB_MCU_COMMAND, mcu->command, mcu->token, mcu->arg0, mcu->arg1);
+		mcu->state = 0;
+		break;
+	}
+
+	// Packet was processed here
+	return true;
+
+stop_processing:
+	warn(d, __LINE__, "fail to parse MCU command at state %d", mcu->state);
+	mcu->state = 0;
+	return false;
+}
+
+// Return: 0 not processing, 1 not processing, but in middle state (not process MCU), 2 - processing
+static int process_h2m_bbp(struct rt2x00usb *d, struct usb_ctrlrequest *cr,
+			   struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+{
+	const uint16_t H2M_BBP_AGENT = 0x7028;
+	const uint32_t KICK_BIT	 = 0x00020000;
+	struct h2m_bbp_state *h2m_bbp = &d->state.h2m_bbp;
+
+	switch (h2m_bbp->state) {
+	case 0:
+		// Check busy
+		if (cr->wIndex == H2M_BBP_AGENT) {
+			DEBUG("step 0\n");
+			if (!is_read_cr(cr))
+				break;
+
+			assert(hdr->len_cap == 4);
+			uint32_t reg_val = get_reg_val(hdr);
+
+			if (!(reg_val & KICK_BIT)) // not busy
+				h2m_bbp->state = 1;
+		} else {
+			return 0;
+		}
+		break;
+	case 1:
+		DEBUG("step 1\n");
+		// Ignore most of MCU processing, it can be mixed with H2M_BBP_AGENT I/O
+		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
+			break;
+
+		if (is_read_cr(cr))
+			break;
+
+		if (cr->wIndex != H2M_BBP_AGENT)
+			return 1;
+
+		// Write 16 LSB to H2M_BBP_AGENT
+		h2m_bbp->cur_addr = (cr->wValue & 0xff00) >> 8;
+		h2m_bbp->cur_data = cr->wValue & 0x00ff;
+		h2m_bbp->state = 2;
+		break;
+	case 2:
+		DEBUG("step 2\n");
+		// Ignore most of MCU processing, it can be mixed with H2M_BBP_AGENT I/O
+		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
+			break;
+
+		if (cr->wIndex != H2M_BBP_AGENT + 2)
+			return 1;
+
+		assert(!is_read_cr(cr));
+		h2m_bbp->is_read = (cr->wValue & 0x1) ? true : false;
+		h2m_bbp->state = 3;
+		break;
+	case 3:
+		DEBUG("step 3\n");
+		// Ignore most of MCU processing
+		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
+			break;
+
+		// End of MCU processing
+		if (cr->wIndex == 0x0406) {
+			if (h2m_bbp->is_read) {
+				h2m_bbp->state = 4;
+			} else {
+				emit_value(d, RT2X00USB_BBP_WRITE, h2m_bbp->cur_addr, h2m_bbp->cur_data);
+				h2m_bbp->state = 0;
+
+				bbp_add_to_map(d, h2m_bbp->cur_addr, h2m_bbp->cur_data);
+			}
+		} else {
+			return 1;
+		}
+		break;
+	case 4:
+		DEBUG("step 4\n");
+		// Ignore most of MCU processing, it can be mixed with H2M_BBP_AGENT I/O
+		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
+			break;
+
+		if (cr->wIndex != H2M_BBP_AGENT)
+			return 1;
+
+		assert(is_read_cr(cr));
+		assert(hdr->len_cap == 4);
+
+		uint32_t reg_val = get_reg_val(hdr);
+		uint8_t addr = (reg_val & 0xff00) >> 8;
+		h2m_bbp->cur_data = reg_val & 0x00ff;
+
+		if (addr != h2m_bbp->cur_addr)
+			warn(d, __LINE__, "BBP read expected addr %u get %u", h2m_bbp->cur_addr, addr);
+
+		emit_value(d, RT2X00USB_BBP_READ, addr, h2m_bbp->cur_data);
+		shadow_bbp(d, addr, h2m_bbp->cur_data);
+
+		h2m_bbp->state = 0;
+		break;
+	}
+
+	// Packet was processed here
+	return 2;
+}
+
+static void process_control_packet(struct rt2x00usb *d, struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+{
+	struct usb_ctrlrequest *cr = reinterpret_cast<struct usb_ctrlrequest *>(shdr->s.setup);
+	int ret;
+
+	fw_check_end(d, cr, shdr);
+
+	if (!(cr->bRequestType & 0x40)) {
+		// Not vendor request
+		emit_data(d, RT2X00USB_CTRL, cr->wIndex, is_read_cr(cr) ? hdr : shdr);
+		return;
+	}
+
+	// FIXME: check urb statuses
+
+	ret = process_h2m_bbp(d, cr, shdr, hdr);
+	if (ret == 2)
+		return;
+	if (ret == 0 && process_mcu_request(d, cr, shdr, hdr))
+		return;
+
+	if (cr->wIndex > 0x17ff) {
+		// Not registers area
+		if (is_read_cr(cr)) {
+			// Read
+			emit_data(d, RT2X00USB_AREA_READ, cr->wIndex, hdr);
+		} else {
+			// Write
+			if (shdr->len_cap == 0) {
+				assert(cr->wLength == 0);
+				emit_value(d, RT2X00USB_AREA_WRITE_VALUE, cr->wIndex, cr->wValue);
+				mac_add_to_map(d, cr->wIndex , cr->wValue);
+			} else if (fw_write(d, cr, shdr, hdr)) {
+				mac_add_data_to_map(d, cr, shdr);
+			} else {
+				emit_data(d, RT2X00USB_AREA_WRITE, cr->wIndex, shdr);
+				mac_add_data_to_map(d, cr, shdr);
+			}
+		}
+		return;
+	}
+
+	// BBP and RF registers are indirectly addressed, print only valuable data
+	if (cr->wIndex == reg_bbp.addr || cr->wIndex == reg_bbp.addr + 2)
+		process_special_register_rw(d, cr, shdr, hdr, &reg_bbp, &d->state.bbp);
+	else if (cr->wIndex == reg_rf.addr || cr->wIndex == reg_rf.addr + 2)
+		process_special_register_rw(d, cr, shdr, hdr, &reg_rf, &d->state.rf);
+	else
+		process_register_rw(d, cr, shdr, hdr);
+}
+
+// TXWI/RXWI descriptors of every frame in bulk URBs
+static void process_rx_frames(struct rt2x00usb *d, unsigned char *buf, int len, struct rt2x00usb_event *end)
+{
+	struct rt2x00usb_event ev;
+	int frame_nr = 0;
+
+	while (len > 24) { // FIXME: why 24
+		uint32_t rxinfo_val = decode_reg_val(buf);
+		int frame_len = rxinfo_val & 0xffff;
+
+		frame_len += 4; // RXINFO size
+		assert(frame_len <= len - 4);
+		frame_len += 4; // RXD size
+
+		event_init(d, &ev, RT2X00USB_RX_FRAME);
+		ev.addr = decode_reg_val(buf + 4) & 0xff;
+		ev.value = decode_reg_val(buf + 8);
+		ev.arg[0] = frame_nr++;
+		ev.arg[1] = (decode_reg_val(buf + 4) >> 16) & 0xfff; // MPDU_TOTAL_BYTE_COUNT
+		ev.arg[2] = decode_reg_val(buf + 12);
+		ev.data = buf;
+		ev.len = frame_len;
+		emit(d, &ev);
+
+		end->arg[0]++;
+		end->arg[1] += ev.arg[1];
+		end->arg[2] += 4 + 16 + 4;
+
+		len -= frame_len;
+		buf += frame_len;
+	}
+}
+
+static void process_tx_frames(struct rt2x00usb *d, unsigned char *buf, int len, struct rt2x00usb_event *end)
+{
+	struct rt2x00usb_event ev;
+	int frame_nr = 0;
+
+	while (len > 20) { // FIXME: why 16
+		uint32_t txinfo_val = decode_reg_val(buf);
+		int frame_len = txinfo_val & 0xffff;
+
+		frame_len += 4; // TXINFO size
+
+		event_init(d, &ev, RT2X00USB_TX_FRAME);
+		ev.addr = (decode_reg_val(buf + 8) >> 8) & 0xff;
+		ev.value = decode_reg_val(buf + 4);
+		ev.arg[0] = frame_nr++;
+		ev.arg[1] = (decode_reg_val(buf + 8) >> 16) & 0xfff; // MPDU_TOTAL_BYTE_COUNT
+		ev.arg[2] = decode_reg_val(buf + 8);
+		ev.data = buf;
+		ev.len = frame_len;
+		emit(d, &ev);
+
+		end->arg[0]++;
+		end->arg[1] += ev.arg[1];
+		end->arg[2] += 4 + 16;
+
+		len -= frame_len;
+		buf += frame_len;
+	}
+}
+
+static void process_bulk_packet(struct rt2x00usb *d, struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+{
+	// Read data is in the completion, written in the submission
+	struct usbmon_packet *data_hdr = (hdr->epnum & USB_DIR_IN) ? hdr : shdr;
+	struct rt2x00usb_event end;
+
+	emit_data(d, RT2X00USB_BULK, hdr->epnum, data_hdr);
+
+	event_init(d, &end, RT2X00USB_BULK_END);
+	end.addr = hdr->epnum;
+	end.len = data_hdr->len_cap;
+
+	if (hdr->epnum & USB_DIR_IN)
+		process_rx_frames(d, get_data(hdr), hdr->len_cap, &end);
+	else
+		process_tx_frames(d, get_data(shdr), shdr->len_cap, &end);
+
+	emit(d, &end);
+}
+
+static void emit_complete(struct rt2x00usb *d, struct usbmon_packet *shdr, struct usbmon_packet *hdr,
+			  unsigned int inflight)
+{
+	struct rt2x00usb_event ev;
+
+	event_init(d, &ev, RT2X00USB_COMPLETE);
+	// Held with a lower half it is delivered later
+	ev.ts = get_ts(hdr);
+	ev.shdr = shdr;
+	ev.hdr = hdr;
+	ev.addr = hdr->epnum;
+	ev.value = shdr->xfer_type;
+	ev.len = (hdr->epnum & USB_DIR_IN) ? hdr->length : shdr->length;
+	ev.arg[0] = hdr->status;
+	ev.arg[1] = inflight;
+	ev.duration = get_ts(hdr) - get_ts(shdr);
+	emit(d, &ev);
+}
+
+static void emit_submit(struct rt2x00usb *d, struct usbmon_packet *hdr)
+{
+	struct rt2x00usb_event ev;
+
+	event_init(d, &ev, RT2X00USB_SUBMIT);
+	ev.addr = hdr->epnum;
+	ev.value = hdr->xfer_type;
+	ev.len = hdr->length;
+	ev.arg[0] = d->inflight[hdr->epnum];
+	emit(d, &ev);
+}
+
+struct rt2x00usb *rt2x00usb_new(void)
+{
+	struct rt2x00usb *d = new rt2x00usb;
+
+	memset(&d->state, 0, sizeof(d->state));
+	memset(&d->shadow, 0, sizeof(d->shadow));
+	d->mac_map = NULL;
+	d->bbp_map = NULL;
+	d->rf_map = NULL;
+	d->coalesce_timeout = 0;
+	d->bulk_mode = RT2X00USB_BULK_FULL;
+	d->bulk_sample = 1;
+	memset(d->bulk_seq, 0, sizeof(d->bulk_seq));
+	memset(d->inflight, 0, sizeof(d->inflight));
+	d->ts = 0;
+	d->shdr = d->hdr = NULL;
+	return d;
+}
+
+void rt2x00usb_free(struct rt2x00usb *d)
+{
+	rt2x00usb_clear_pending(d);
+	delete[] d->mac_map;
+	delete[] d->bbp_map;
+	delete[] d->rf_map;
+	delete d;
+}
+
+void rt2x00usb_add_callback(struct rt2x00usb *d, rt2x00usb_callback cb, void *priv)
+{
+	struct rt2x00usb_cb c = { cb, priv };
+
+	d->callbacks.push_back(c);
+}
+
+void rt2x00usb_coalesce(struct rt2x00usb *d, uint64_t timeout)
+{
+	d->coalesce_timeout = timeout;
+}
+
+void rt2x00usb_tick(struct rt2x00usb *d, uint64_t ts)
+{
+	if (d->state.half.active && ts > d->state.half.ts && ts - d->state.half.ts > d->coalesce_timeout) {
+		d->ts = ts;
+		d->shdr = d->hdr = NULL;
+		half_flush(d);
+	}
+}
+
+uint64_t rt2x00usb_due(struct rt2x00usb *d, uint64_t ts)
+{
+	const uint64_t due = d->state.half.ts + d->coalesce_timeout;
+
+	if (!d->state.half.active)
+		return UINT64_MAX;
+	return due > ts ? due - ts : 0;
+}
+
+void rt2x00usb_bulk_mode(struct rt2x00usb *d, int mode, unsigned int sample)
+{
+	d->bulk_mode = mode;
+	d->bulk_sample = sample ? sample : 1;
+}
+
+// URB address reused while still pending, its completion was lost
+static void drop_pending(struct rt2x00usb *d, uint64_t id)
+{
+	std::map<uint64_t, char *>::iterator it = d->pkts_map.find(id);
+
+	if (it == d->pkts_map.end())
+		return;
+	d->inflight[reinterpret_cast<struct usbmon_packet *>(it->second)->epnum]--;
+	delete[] it->second;
+	d->pkts_map.erase(it);
+}
+
+void rt2x00usb_add_pending(struct rt2x00usb *d, struct usbmon_packet *hdr)
+{
+	const int len = sizeof(struct usbmon_packet) + hdr->len_cap;
+	char *tmp = new char[len];
+
+	drop_pending(d, hdr->id);
+	memcpy(tmp, hdr, len);
+	d->pkts_map[hdr->id] = tmp;
+	d->inflight[hdr->epnum]++;
+}
+
+// Submission kept without its payload, only to be counted on completion
+static void add_pending_header(struct rt2x00usb *d, struct usbmon_packet *hdr)
+{
+	struct usbmon_packet *tmp = reinterpret_cast<struct usbmon_packet *>(new char[sizeof(*hdr)]);
+
+	drop_pending(d, hdr->id);
+	*tmp = *hdr;
+	tmp->len_cap = 0;
+	tmp->flag_data = FLAG_DATA_DROPPED;
+	d->pkts_map[hdr->id] = reinterpret_cast<char *>(tmp);
+	d->inflight[hdr->epnum]++;
+}
+
+static bool bulk_decoded(struct rt2x00usb *d, struct usbmon_packet *shdr)
+{
+	if (shdr->flag_data == FLAG_DATA_DROPPED)
+		return false;
+
+	switch (d->bulk_mode) {
+	case RT2X00USB_BULK_SAMPLE:
+		return d->bulk_seq[shdr->epnum]++ % d->bulk_sample == 0;
+	case RT2X00USB_BULK_COUNT:
+		return false;
+	}
+	return true;
+}
+
+void rt2x00usb_clear_pending(struct rt2x00usb *d)
+{
+	std::map<uint64_t, char *>::iterator it;
+
+	for (it = d->pkts_map.begin(); it != d->pkts_map.end(); ++it)
+		delete[] it->second;
+	d->pkts_map.clear();
+	memset(d->inflight, 0, sizeof(d->inflight));
+}
+
+unsigned int rt2x00usb_pending(struct rt2x00usb *d)
+{
+	return d->pkts_map.size();
+}
+
+unsigned int rt2x00usb_inflight(struct rt2x00usb *d, uint8_t ep)
+{
+	return d->inflight[ep];
+}
+
+void rt2x00usb_save_state(struct rt2x00usb *d, struct decoder_state *s)
+{
+	// Padding too, states are compared with memcmp()
+	memcpy(s, &d->state, sizeof(*s));
+}
+
+void rt2x00usb_restore_state(struct rt2x00usb *d, const struct decoder_state *s)
+{
+	memcpy(&d->state, s, sizeof(*s));
+}
+
+void rt2x00usb_reset_state(struct rt2x00usb *d)
+{
+	memset(&d->state, 0, sizeof(d->state));
+}
+
+struct shadow_regs *rt2x00usb_shadow(struct rt2x00usb *d)
+{
+	return &d->shadow;
+}
+
+void rt2x00usb_decode(struct rt2x00usb *d, struct usbmon_packet *hdr)
+{
+	d->ts = get_ts(hdr);
+	d->shdr = d->hdr = NULL;
+
+	if (d->state.half.active && (d->ts - d->state.half.ts > d->coalesce_timeout ||
+				     hdr->type == EVENT_DROP || hdr->type == EVENT_REENUM))
+		half_flush(d);
+
+	if (hdr->type == EVENT_DROP) {
+		// Indirect accesses in progress can't be followed anymore
+		rt2x00usb_reset_state(d);
+		emit_value(d, RT2X00USB_DROP, 0, hdr->length);
+		return;
+	}
+
+	if (hdr->type == EVENT_REENUM) {
+		// URBs of the old device are gone
+		rt2x00usb_reset_state(d);
+		rt2x00usb_clear_pending(d);
+		emit_value(d, RT2X00USB_REENUM, hdr->devnum, hdr->length, hdr->busnum);
+		return;
+	}
+
+	if (hdr->type == 'S') {
+		if (hdr->xfer_type == XFER_TYPE_BULK && d->bulk_mode == RT2X00USB_BULK_COUNT)
+			add_pending_header(d, hdr);
+		else
+			rt2x00usb_add_pending(d, hdr);
+		emit_submit(d, hdr);
+		return;
+	}
+
+	assert(hdr->type == 'C');
+
+	std::map<uint64_t, char *>::iterator it = d->pkts_map.find(hdr->id);
+	if (it == d->pkts_map.end()) // not yet mapped
+		return;
+	char *buf = it->second;
+	struct usbmon_packet *shdr = reinterpret_cast<struct usbmon_packet *>(buf);
+
+	assert(shdr->id == hdr->id);
+	assert(shdr->xfer_type == hdr->xfer_type);
+
+	d->shdr = shdr;
+	d->hdr = hdr;
+
+	if (shdr->epnum != hdr->epnum)
+		warn(d, __LINE__, "EP missmash shdr->epnum %02x hdr->epnum %02x", shdr->epnum, hdr->epnum);
+
+	if (shdr->xfer_type == XFER_TYPE_CONTROL)
+		process_control_packet(d, shdr, hdr);
+	else if (shdr->xfer_type == XFER_TYPE_BULK) {
+		if (bulk_decoded(d, shdr))
+			process_bulk_packet(d, shdr, hdr);
+	}
+	else
+		emit_value(d, RT2X00USB_URB, hdr->epnum, shdr->xfer_type);
+
+	const unsigned int inflight = --d->inflight[shdr->epnum];
+	struct half_write *h = &d->state.half;
+
+	if (h->active && h->hdr.id == hdr->id) {
+		h->complete = 1;
+		h->inflight = inflight;
+	} else {
+		emit_complete(d, shdr, hdr, inflight);
+	}
+
+	d->shdr = d->hdr = NULL;
+	delete[] buf;
+	d->pkts_map.erase(it);
+}
+
+void rt2x00usb_finish(struct rt2x00usb *d)
+{
+	if (d->state.half.active)
+		half_flush(d);
+	fw_finish(d);
+}
+
+void rt2x00usb_enable_maps(struct rt2x00usb *d)
+{
+	if (d->mac_map)
+		return;
+
+	d->mac_map = new std::list<uint16_t>[MAX_MAC_REG];
+	d->bbp_map = new std::list<uint8_t>[MAX_BBP_REG];
+	d->rf_map = new std::list<uint8_t>[MAX_RF_REG];
+}
+
+/* Print only last REG_PRINT_LIMIT registers */
+#define REG_PRINT_LIMIT 5
+
+static void create_mac_map(std::list<uint16_t> mac_regs_map[], FILE *fp)
+{
+	for (int i = 0; i < MAX_MAC_REG; i++) {
+		std::list<uint16_t> &l = mac_regs_map[i];
+		std::list<uint16_t>::iterator it;
+
+		const uint16_t addr = i*2;
+		struct reg *reg;
+		bool lower_half;
+
+		if (i & 1) {
+			lower_half = false;
+			reg = get_reg(addr - 2);
+		} else {
+			lower_half = true;
+			reg = get_reg(addr);
+		}
+
+		const char *name = reg ? reg->name : "UNKNOWN";
+		const char *half = lower_half ? "L" : "U";
+
+		fprintf(fp, "%04x %s %s ", addr, name, half);
+		int k;
+		for (k = l.size(), it = l.begin(); it != l.end(); ++it, k--)
+			if (k <= REG_PRINT_LIMIT)
+				fprintf(fp, " %04x", *it);
+		fprintf(fp, "\n");
+	}
+
+	fflush(fp);
+}
+
+template <typename T>
+static void create_map(T arr[], int N, FILE *fp)
+{
+	for (int i = 0; i < N; i++) {
+		typename T::iterator it;
+		T &l = arr[i];
+
+		fprintf(fp, "%d:\t", i);
+#if 0
+		int last_value = -1;
+		int repeats = 0;
+		for (it = l.begin(); it != l.end(); ++it) {
+			if (last_value == static_cast<int>(*it)) {
+				repeats++;
+			} else {
+				if (repeats > 0)
+					fprintf(fp, "(%d)", repeats);
+				fprintf(fp, " %02x", *it);
+				last_value = *it;
+				repeats = 0;
+			}
+		}
+#else
+		int k;
+		for (k = l.size(), it = l.begin(); it != l.end(); ++it, k--)
+			if (k <= REG_PRINT_LIMIT)
+				fprintf(fp, " %02x", *it);
+
+#endif
+		fprintf(fp, "\n");
+	}
+
+	fflush(fp);
+}
+
+// Write maps of registers to the files which are not NULL
+void rt2x00usb_write_maps(struct rt2x00usb *d, FILE *mac, FILE *bbp, FILE *rf)
+{
+	if (!d->mac_map)
+		return;
+
+	if (mac)
+		create_mac_map(d->mac_map, mac);
+	if (rf)
+		create_map(d->rf_map, MAX_RF_REG, rf);
+	if (bbp)
+		create_map(d->bbp_map, MAX_BBP_REG, bbp);
+}
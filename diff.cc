@@ -0,0 +1,459 @@
+/*
+ * Difference of register programming in two captures. Both are decoded
+ * into sequences of writes (MAC registers with halves merged, BBP, RF, MCU
+ * commands, memory areas), every write is a 64-bit key of type, address
+ * and value or hash of written data. Sequences are aligned with Myers'
+ * O(ND) algorithm in linear space, removed and inserted writes of the same
+ * register next to each other are reported as value changes. Like GNU diff,
+ * search for the middle snake gives up after a cost limit and splits at the
+ * furthest reaching diagonal, the script is then not always the shortest.
+ */
+
+#define DIFF_MIN_COST	256	// edits searched for the middle snake, at least
+
+struct diff_write {
+	uint64_t key;
+	uint64_t ts;
+	uint8_t type;
+	uint8_t size;		// of MAC register writes, 2 for halves
+	uint16_t addr;
+	uint32_t value;
+};
+
+struct diff_trace {
+	std::vector<struct diff_write> w;
+	std::vector<uint64_t> keys;	// copy of keys, to compare without cache misses
+	std::vector<char> changed;	// removed from or inserted to this trace
+};
+
+struct diff_reg_stats {
+	uint64_t removed;
+	uint64_t inserted;
+	uint64_t changed;
+	uint64_t fields[32];
+};
+
+static std::map<uint32_t, struct diff_reg_stats> diff_stats;
+static uint64_t diff_removed, diff_inserted, diff_changed;
+
+// FNV-1a
+static uint32_t diff_hash(const unsigned char *data, unsigned int len)
+{
+	uint32_t h = 2166136261U;
+
+	for (unsigned int i = 0; i < len; i++)
+		h = (h ^ data[i]) * 16777619U;
+	return h;
+}
+
+static void diff_collect(const struct rt2x00usb_event *ev, void *priv)
+{
+	struct diff_trace *t = static_cast<struct diff_trace *>(priv);
+	struct diff_write w;
+
+	w.value = ev->value;
+	w.size = 0;
+	switch (ev->type) {
+	case RT2X00USB_MAC_WRITE:
+		w.size = ev->arg[0];
+		break;
+	case RT2X00USB_BBP_WRITE:
+	case RT2X00USB_RF_WRITE:
+	case RT2X00USB_AREA_WRITE_VALUE:
+		break;
+	case RT2X00USB_MCU_COMMAND:
+		w.value = ev->value << 16 | ev->arg[1] << 8 | ev->arg[0];
+		break;
+	case RT2X00USB_MAC_DATA_WRITE:
+	case RT2X00USB_AREA_WRITE:
+		w.value = diff_hash(ev->data, ev->len);
+		break;
+	case RT2X00USB_FIRMWARE:
+		w.value = ev->arg[0];
+		break;
+	default:
+		return;
+	}
+
+	w.type = ev->type;
+	w.addr = ev->addr;
+	w.ts = ev->ts;
+	w.key = (uint64_t) w.type << 56 | (uint64_t) w.size << 48 | (uint64_t) w.addr << 32 | w.value;
+	t->w.push_back(w);
+}
+
+static int diff_load(const char *name, struct diff_trace *t)
+{
+	struct rt2x00usb *d;
+	struct capture cap;
+
+	if (capture_open(&cap, name))
+		return -1;
+
+	d = rt2x00usb_new();
+	rt2x00usb_coalesce(d, COALESCE_TIMEOUT);
+	rt2x00usb_add_callback(d, diff_collect, t);
+
+	for (size_t off = capture_first(&cap); off < cap.len; off = capture_next(&cap, off)) {
+		struct usbmon_packet *hdr = capture_event(&cap, off);
+
+		if (hdr->type == '@')
+			/* filler packet */
+			continue;
+		rt2x00usb_decode(d, hdr);
+	}
+	rt2x00usb_finish(d);
+	rt2x00usb_free(d);
+
+	if (cap.truncated)
+		fprintf(stderr, "%s: truncated capture at offset %zu\n", name, cap.truncated);
+	capture_close(&cap);
+
+	t->keys.resize(t->w.size());
+	for (size_t i = 0; i < t->w.size(); i++)
+		t->keys[i] = t->w[i].key;
+	t->changed.assign(t->w.size(), 0);
+	return 0;
+}
+
+struct diff_load_arg {
+	const char *name;
+	struct diff_trace *t;
+	int ret;
+};
+
+static void *diff_load_thread(void *p)
+{
+	struct diff_load_arg *arg = static_cast<struct diff_load_arg *>(p);
+
+	arg->ret = diff_load(arg->name, arg->t);
+	return NULL;
+}
+
+struct diff_ctx {
+	const uint64_t *a;
+	const uint64_t *b;
+	char *a_changed;
+	char *b_changed;
+	long *fd;	// furthest reaching x per diagonal, forward and backward
+	long *bd;
+	long too_expensive;	// edits searched before splitting at the best diagonal
+};
+
+/*
+ * Find the middle snake of the shortest edit script of a[xoff, xlim) and
+ * b[yoff, ylim) and return its start in @xmid, @ymid. Diagonal d = x - y.
+ */
+static void diff_split(struct diff_ctx *c, long xoff, long xlim, long yoff, long ylim, long *xmid, long *ymid)
+{
+	long *const fd = c->fd;
+	long *const bd = c->bd;
+	const long dmin = xoff - ylim;
+	const long dmax = xlim - yoff;
+	const long fmid = xoff - yoff;
+	const long bmid = xlim - ylim;
+	const bool odd = (fmid - bmid) & 1;
+	long fmin = fmid, fmax = fmid;
+	long bmin = bmid, bmax = bmid;
+
+	fd[fmid] = xoff;
+	bd[bmid] = xlim;
+
+	for (long cost = 1; ; cost++) {
+		long d;
+
+		// Forward search, one more edit on every diagonal
+		if (fmin > dmin)
+			fd[--fmin - 1] = -1;
+		else
+			++fmin;
+		if (fmax < dmax)
+			fd[++fmax + 1] = -1;
+		else
+			--fmax;
+		for (d = fmax; d >= fmin; d -= 2) {
+			const long tlo = fd[d - 1], thi = fd[d + 1];
+			long x = tlo < thi ? thi : tlo + 1;
+			long y = x - d;
+
+			while (x < xlim && y < ylim && c->a[x] == c->b[y])
+				x++, y++;
+			if (odd && bmin <= d && d <= bmax && bd[d] <= x) {
+				*xmid = x;
+				*ymid = y;
+				return;
+			}
+			fd[d] = x;
+		}
+
+		// Backward search
+		if (bmin > dmin)
+			bd[--bmin - 1] = LONG_MAX;
+		else
+			++bmin;
+		if (bmax < dmax)
+			bd[++bmax + 1] = LONG_MAX;
+		else
+			--bmax;
+		for (d = bmax; d >= bmin; d -= 2) {
+			const long tlo = bd[d - 1], thi = bd[d + 1];
+			long x = tlo < thi ? tlo : thi - 1;
+			long y = x - d;
+
+			while (x > xoff && y > yoff && c->a[x - 1] == c->b[y - 1])
+				x--, y--;
+			if (!odd && fmin <= d && d <= fmax && x <= fd[d]) {
+				*xmid = x;
+				*ymid = y;
+				return;
+			}
+			bd[d] = x;
+		}
+
+		if (cost < c->too_expensive)
+			continue;
+
+		// Too expensive, split where either search got furthest
+		long fxbest = 0, fxybest = -1, bxbest = 0, bxybest = LONG_MAX;
+
+		for (d = fmax; d >= fmin; d -= 2) {
+			long x = fd[d] < xlim ? fd[d] : xlim;
+			long y = x - d;
+
+			if (y > ylim)
+				x = ylim + d, y = ylim;
+			if (x + y > fxybest)
+				fxybest = x + y, fxbest = x;
+		}
+		for (d = bmax; d >= bmin; d -= 2) {
+			long x = bd[d] > xoff ? bd[d] : xoff;
+			long y = x - d;
+
+			if (y < yoff)
+				x = yoff + d, y = yoff;
+			if (x + y < bxybest)
+				bxybest = x + y, bxbest = x;
+		}
+		if (xlim + ylim - bxybest < fxybest - (xoff + yoff)) {
+			*xmid = fxbest;
+			*ymid = fxybest - fxbest;
+		} else {
+			*xmid = bxbest;
+			*ymid = bxybest - bxbest;
+		}
+		return;
+	}
+}
+
+static void diff_compare(struct diff_ctx *c, long xoff, long xlim, long yoff, long ylim)
+{
+	// Common prefix and suffix
+	while (xoff < xlim && yoff < ylim && c->a[xoff] == c->b[yoff])
+		xoff++, yoff++;
+	while (xlim > xoff && ylim > yoff && c->a[xlim - 1] == c->b[ylim - 1])
+		xlim--, ylim--;
+
+	if (xoff == xlim) {
+		while (yoff < ylim)
+			c->b_changed[yoff++] = 1;
+	} else if (yoff == ylim) {
+		while (xoff < xlim)
+			c->a_changed[xoff++] = 1;
+	} else {
+		long xmid, ymid;
+
+		diff_split(c, xoff, xlim, yoff, ylim, &xmid, &ymid);
+		diff_compare(c, xoff, xmid, yoff, ymid);
+		diff_compare(c, xmid, xlim, ymid, ylim);
+	}
+}
+
+static void diff_name(const struct diff_write *w, char *buf, size_t len)
+{
+	struct reg *reg;
+	struct area *area;
+
+	switch (w->type) {
+	case RT2X00USB_MAC_WRITE:
+	case RT2X00USB_MAC_DATA_WRITE:
+		if ((reg = get_reg(w->addr)))
+			snprintf(buf, len, "%s", reg->name);
+		else
+			snprintf(buf, len, "REG 0x%04x", w->addr);
+		break;
+	case RT2X00USB_BBP_WRITE:
+		snprintf(buf, len, "BBP REG%u", w->addr);
+		break;
+	case RT2X00USB_RF_WRITE:
+		snprintf(buf, len, "RF REG%u", w->addr);
+		break;
+	case RT2X00USB_MCU_COMMAND:
+		snprintf(buf, len, "MCU COMMAND %02x", w->addr);
+		break;
+	case RT2X00USB_FIRMWARE:
+		snprintf(buf, len, "FIRMWARE");
+		break;
+	default:
+		area = get_area(w->addr);
+		snprintf(buf, len, "0x%04x (%s)", w->addr, area ? area->name : "Unknown area");
+		break;
+	}
+}
+
+static void diff_print(char op, long ia, long ib, const struct diff_write *w)
+{
+	char name[64];
+
+	diff_name(w, name, sizeof(name));
+	printf("DIFF A %ld B %ld: %c %s 0x%08x\n", ia, ib, op, name, w->value);
+}
+
+static void diff_change(long ia, long ib, const struct diff_write *a, const struct diff_write *b)
+{
+	struct diff_reg_stats *st = &diff_stats[a->type << 16 | a->addr];
+	// Fields of a half can't be told apart from the other half
+	struct reg *reg = a->size == 4 && b->size == 4 ? get_reg(a->addr) : NULL;
+	char name[64];
+
+	st->changed++;
+	diff_changed++;
+	diff_name(a, name, sizeof(name));
+	printf("DIFF A %ld B %ld: ~ %s 0x%08x -> 0x%08x", ia, ib, name, a->value, b->value);
+
+	for (int i = 0; reg && i < reg->n_fields; i++) {
+		const struct field *f = &reg->fields[i];
+		const int bits = f->last - f->first + 1;
+		const uint32_t mask = (bits == 32 ? 0xffffffff : (1U << bits) - 1) << f->first;
+
+		if ((a->value & mask) == (b->value & mask))
+			continue;
+		st->fields[i]++;
+		printf(" %s: 0x%x -> 0x%x", f->name, (a->value & mask) >> f->first, (b->value & mask) >> f->first);
+	}
+	printf("\n");
+}
+
+/*
+ * Removed and inserted writes between two common parts. Writes to the same
+ * register, in order, are changes of value.
+ */
+static void diff_hunk(struct diff_trace *ta, long a0, long a1, struct diff_trace *tb, long b0, long b1)
+{
+	std::map<uint32_t, std::vector<long> > inserted;
+	std::map<uint32_t, std::vector<long> >::iterator it;
+	std::map<uint32_t, size_t> next;
+	std::vector<char> paired(b1 - b0, 0);
+
+	for (long j = b0; j < b1; j++)
+		inserted[tb->w[j].type << 16 | tb->w[j].addr].push_back(j);
+
+	for (long i = a0; i < a1; i++) {
+		const struct diff_write *a = &ta->w[i];
+		const uint32_t reg = a->type << 16 | a->addr;
+
+		it = inserted.find(reg);
+		if (it != inserted.end() && next[reg] < it->second.size()) {
+			const long j = it->second[next[reg]++];
+
+			paired[j - b0] = 1;
+			diff_change(i, j, a, &tb->w[j]);
+		} else {
+			diff_stats[reg].removed++;
+			diff_removed++;
+			diff_print('-', i, b0, a);
+		}
+	}
+
+	for (long j = b0; j < b1; j++) {
+		if (paired[j - b0])
+			continue;
+		diff_stats[tb->w[j].type << 16 | tb->w[j].addr].inserted++;
+		diff_inserted++;
+		diff_print('+', a1, j, &tb->w[j]);
+	}
+}
+
+static void diff_report(void)
+{
+	std::map<uint32_t, struct diff_reg_stats>::iterator it;
+
+	for (it = diff_stats.begin(); it != diff_stats.end(); ++it) {
+		struct diff_reg_stats *st = &it->second;
+		struct diff_write w;
+		char name[64];
+		struct reg *reg;
+
+		w.type = it->first >> 16;
+		w.addr = it->first & 0xffff;
+		diff_name(&w, name, sizeof(name));
+
+		printf("DIFF %s: %" PRIu64 " removed %" PRIu64 " inserted %" PRIu64 " changed",
+		       name, st->removed, st->inserted, st->changed);
+
+		reg = w.type == RT2X00USB_MAC_WRITE ? get_reg(w.addr) : NULL;
+		for (int i = 0; reg && i < reg->n_fields; i++)
+			if (st->fields[i])
+				printf(" %s:%" PRIu64, reg->fields[i].name, st->fields[i]);
+		printf("\n");
+	}
+}
+
+int diff_captures(const char *name_a, const char *name_b)
+{
+	struct diff_trace ta, tb;
+	struct diff_load_arg arg = { name_b, &tb, -1 };
+	struct diff_ctx c;
+	pthread_t thread;
+
+	// Decoders are independent, both captures are decoded at once
+	const bool threaded = pthread_create(&thread, NULL, diff_load_thread, &arg) == 0;
+
+	if (!threaded)
+		diff_load_thread(&arg);
+	const int ret = diff_load(name_a, &ta);
+	if (threaded)
+		pthread_join(thread, NULL);
+	if (ret || arg.ret)
+		return -1;
+
+	const long n = ta.w.size(), m = tb.w.size();
+	std::vector<long> fd(n + m + 3), bd(n + m + 3);
+
+	c.a = ta.keys.data();
+	c.b = tb.keys.data();
+	c.a_changed = ta.changed.data();
+	c.b_changed = tb.changed.data();
+	// Diagonals are from -(m + 1) to n + 1
+	c.fd = fd.data() + m + 1;
+	c.bd = bd.data() + m + 1;
+	// About square root of the number of diagonals, as GNU diff
+	c.too_expensive = 1;
+	for (long diags = n + m + 3; diags; diags >>= 2)
+		c.too_expensive <<= 1;
+	if (c.too_expensive < DIFF_MIN_COST)
+		c.too_expensive = DIFF_MIN_COST;
+	diff_compare(&c, 0, n, 0, m);
+
+	// Walk both traces, common writes advance together
+	for (long i = 0, j = 0; i < n || j < m; ) {
+		if (i < n && j < m && !ta.changed[i] && !tb.changed[j]) {
+			i++, j++;
+			continue;
+		}
+
+		long i1 = i, j1 = j;
+		while (i1 < n && ta.changed[i1])
+			i1++;
+		while (j1 < m && tb.changed[j1])
+			j1++;
+		diff_hunk(&ta, i, i1, &tb, j, j1);
+		i = i1;
+		j = j1;
+	}
+
+	diff_report();
+	printf("DIFF: %ld writes in %s, %ld writes in %s, %" PRIu64 " removed %" PRIu64 " inserted %" PRIu64
+	       " changed\n", n, name_a, m, name_b, diff_removed, diff_inserted, diff_changed);
+	fflush(stdout);
+	return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ * Firmware upload is reassembled from consecutive writes into the
+ * "Firmware" area and delivered as one RT2X00USB_FIRMWARE event instead of
+ * every written chunk. Upload ends with the first other control transfer.
+ */
+
+#define FIRMWARE_IMAGE_BASE	0x3000
+
+static uint32_t crc32(const unsigned char *buf, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+
+	for (size_t i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (int k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+static void fw_finish(struct rt2x00usb *d)
+{
+	struct fw_upload *fw = &d->state.fw;
+	struct rt2x00usb_event ev;
+
+	if (!fw->active)
+		return;
+
+	event_init(d, &ev, RT2X00USB_FIRMWARE);
+	ev.shdr = ev.hdr = NULL;
+	ev.data = fw->image;
+	ev.len = fw->size;
+	ev.value = fw->size;
+	ev.arg[0] = crc32(fw->image, fw->size);
+	ev.arg[1] = fw->transfers;
+	ev.arg[2] = fw->bytes;
+	ev.duration = fw->end - fw->start;
+	emit(d, &ev);
+
+	// Idle state is all zero, it is part of decoder state
+	memset(fw, 0, sizeof(*fw));
+}
+
+static bool fw_is_write(struct usb_ctrlrequest *cr, struct usbmon_packet *shdr)
+{
+	struct area *area = get_area(FIRMWARE_IMAGE_BASE);
+
+	return (cr->bRequestType & 0x40) && !is_read_cr(cr) && shdr->len_cap &&
+	       cr->wIndex >= area->begin && cr->wIndex + shdr->len_cap <= area->end + 1u;
+}
+
+// Called for every control transfer, upload ends with any other one
+static void fw_check_end(struct rt2x00usb *d, struct usb_ctrlrequest *cr, struct usbmon_packet *shdr)
+{
+	if (d->state.fw.active && !fw_is_write(cr, shdr))
+		fw_finish(d);
+}
+
+// Return true if the write was accounted as part of firmware upload
+static bool fw_write(struct rt2x00usb *d, struct usb_ctrlrequest *cr, struct usbmon_packet *shdr,
+		     struct usbmon_packet *hdr)
+{
+	struct fw_upload *fw = &d->state.fw;
+
+	if (!fw_is_write(cr, shdr))
+		return false;
+
+	const uint32_t off = cr->wIndex - FIRMWARE_IMAGE_BASE;
+	const unsigned int len = shdr->len_cap;
+
+	if (!fw->active) {
+		memset(fw, 0, sizeof(*fw));
+		fw->active = true;
+		fw->start = get_ts(shdr);
+	}
+
+	memcpy(fw->image + off, get_data(shdr), len);
+	if (off + len > fw->size)
+		fw->size = off + len;
+	fw->bytes += len;
+	fw->transfers++;
+	fw->end = get_ts(hdr);
+
+	return true;
+}
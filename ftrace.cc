@@ -0,0 +1,291 @@
+/*
+ * Control transfers attributed to driver functions of a function_graph
+ * trace recorded alongside the capture, trace-cmd report output or the
+ * ftrace trace file with funcgraph-abstime. Transfer belongs to every
+ * traced function of the task running the innermost function around its
+ * midpoint, self time only to that innermost function.
+ *
+ * usbmon uses wall clock, trace should be recorded with a clock close to it
+ * (trace-cmd record -C tai) and --ftrace-offset added to its timestamps.
+ */
+
+#include <string>
+#include <algorithm>
+
+#define FTRACE_LINE_LEN	1024
+
+struct ftrace_func {
+	uint64_t transfers;
+	uint64_t self;		// innermost traced function
+	uint64_t time;		// usec, submission to completion
+	uint64_t self_time;
+};
+
+struct ftrace_call {
+	uint64_t start;		// usec in trace clock
+	uint64_t end;
+	int task;		// pid, or -1 - cpu if the trace has no pids
+	struct ftrace_func *func;
+};
+
+// Call in progress while reading the trace
+struct ftrace_frame {
+	uint64_t start;
+	struct ftrace_func *func;
+};
+
+const char *ftrace_name;
+int64_t ftrace_offset;
+static std::map<std::string, struct ftrace_func> ftrace_funcs;
+static std::vector<struct ftrace_call> ftrace_calls;	// sorted by start
+static std::vector<size_t> ftrace_active;		// calls around current time
+static size_t ftrace_next;
+static uint64_t ftrace_transfers;
+static uint64_t ftrace_attributed;
+static uint64_t ftrace_time;
+static uint64_t ftrace_attributed_time;
+
+static inline bool ftrace_enabled(void)
+{
+	return ftrace_name != NULL;
+}
+
+static bool ftrace_less(const struct ftrace_call &a, const struct ftrace_call &b)
+{
+	return a.start < b.start || (a.start == b.start && a.end > b.end);
+}
+
+// Seconds with fraction to usec, without going through double
+static bool ftrace_parse_ts(const char *s, uint64_t *ts)
+{
+	char *end;
+	uint64_t sec = strtoull(s, &end, 10);
+	uint64_t usec = 0;
+	int digits = 0;
+
+	if (end == s || *end != '.')
+		return false;
+	for (s = end + 1; *s >= '0' && *s <= '9'; s++, digits++)
+		if (digits < 6)
+			usec = usec * 10 + *s - '0';
+	if (digits == 0)
+		return false;
+	for (; digits < 6; digits++)
+		usec *= 10;
+
+	*ts = sec * 1000000 + usec;
+	return true;
+}
+
+// Duration "1.234" in usec, fraction rounded
+static bool ftrace_parse_us(const char *s, uint64_t *us)
+{
+	char *end;
+	uint64_t val = strtoull(s, &end, 10);
+
+	if (end == s || (*end != '.' && *end != '\0'))
+		return false;
+	if (*end == '.') {
+		if (end[1] < '0' || end[1] > '9')
+			return false;
+		if (end[1] >= '5')
+			val++;
+	}
+
+	*us = val;
+	return true;
+}
+
+// "comm-pid", comm may contain dashes
+static bool ftrace_parse_pid(const char *s, int *pid)
+{
+	const char *dash = strrchr(s, '-');
+
+	if (dash == NULL || dash == s || dash[1] == '\0' || strspn(dash + 1, "0123456789") != strlen(dash + 1))
+		return false;
+	*pid = atoi(dash + 1);
+	return true;
+}
+
+/*
+ * Line of trace-cmd report:
+ *   kworker/u8:2-123   [001]  1234.567890: funcgraph_entry:   1.234 us   |    rt2800_bbp_read();
+ * or of the trace file with funcgraph-abstime (and funcgraph-proc):
+ *   1234.567890 |   1)  kworker-123   |   1.234 us   |    rt2800_bbp_read();
+ * Function part is after the last '|', duration is the number before "us".
+ */
+static void ftrace_parse_line(char *line, std::map<int, std::vector<struct ftrace_frame> > &stacks)
+{
+	char *body = strrchr(line, '|');
+	char *tok, *save, *prev = NULL;
+	uint64_t ts = 0, duration = 0;
+	bool has_ts = false, has_duration = false;
+	int pid = -1, cpu = -1;
+
+	if (body == NULL)
+		return;
+	*body++ = '\0';
+
+	for (tok = strtok_r(line, " \t|", &save); tok; prev = tok, tok = strtok_r(NULL, " \t|", &save)) {
+		const size_t len = strlen(tok);
+		uint64_t val, prev_ts;
+
+		if (strcmp(tok, "us") == 0 && prev && ftrace_parse_us(prev, &val)) {
+			// Parsed as timestamp when there was none yet
+			if (has_ts && !has_duration && strchr(prev, ':') == NULL &&
+			    ftrace_parse_ts(prev, &prev_ts) && ts == prev_ts)
+				has_ts = false;
+			duration = val;
+			has_duration = true;
+		} else if (tok[0] == '[' && tok[len - 1] == ']') {
+			cpu = atoi(tok + 1);
+		} else if (len > 1 && tok[len - 1] == ')' && strspn(tok, "0123456789") == len - 1) {
+			cpu = atoi(tok);
+		} else if (!has_ts && ftrace_parse_ts(tok, &val)) {
+			ts = val;
+			has_ts = true;
+		} else if (pid == -1 && !has_ts) {
+			ftrace_parse_pid(tok, &pid);
+		} else if (pid == -1 && cpu != -1) {
+			// funcgraph-proc column follows cpu column
+			ftrace_parse_pid(tok, &pid);
+		}
+	}
+
+	if (!has_ts)
+		return;
+
+	while (*body == ' ' || *body == '\t')
+		body++;
+	char *end = body + strlen(body);
+	while (end > body && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r'))
+		*--end = '\0';
+
+	const int task = pid != -1 ? pid : -1 - cpu;
+	std::vector<struct ftrace_frame> &stack = stacks[task];
+	const size_t len = end - body;
+
+	if (len > 3 && strcmp(end - 3, "();") == 0 && has_duration) {
+		end[-3] = '\0';
+		struct ftrace_call call = { ts, ts + duration, task, &ftrace_funcs[body] };
+		ftrace_calls.push_back(call);
+	} else if (len > 4 && strcmp(end - 4, "() {") == 0) {
+		end[-4] = '\0';
+		struct ftrace_frame frame = { ts, &ftrace_funcs[body] };
+		stack.push_back(frame);
+	} else if (body[0] == '}' && !stack.empty()) {
+		const struct ftrace_frame &frame = stack.back();
+		struct ftrace_call call = { frame.start, has_duration ? frame.start + duration : ts, task, frame.func };
+
+		ftrace_calls.push_back(call);
+		stack.pop_back();
+	}
+}
+
+int ftrace_load(const char *name)
+{
+	std::map<int, std::vector<struct ftrace_frame> > stacks;
+	char line[FTRACE_LINE_LEN];
+	FILE *fp;
+
+	if ((fp = fopen(name, "r")) == NULL)
+		return -1;
+
+	while (fgets(line, sizeof(line), fp))
+		ftrace_parse_line(line, stacks);
+	fclose(fp);
+
+	// Calls not returned before the end of the trace are ignored
+	std::sort(ftrace_calls.begin(), ftrace_calls.end(), ftrace_less);
+	ftrace_name = name;
+	return 0;
+}
+
+void ftrace_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	if (ev->type != RT2X00USB_COMPLETE || ev->value != XFER_TYPE_CONTROL)
+		return;
+
+	const uint64_t submit = get_ts(ev->shdr);
+	const uint64_t t = (submit + ev->ts) / 2 - ftrace_offset;
+	const struct ftrace_call *inner = NULL;
+	size_t i;
+
+	ftrace_transfers++;
+	ftrace_time += ev->duration;
+
+	while (ftrace_next < ftrace_calls.size() && ftrace_calls[ftrace_next].start <= t)
+		ftrace_active.push_back(ftrace_next++);
+
+	for (i = 0; i < ftrace_active.size(); ) {
+		const struct ftrace_call *call = &ftrace_calls[ftrace_active[i]];
+
+		if (call->end < t) {
+			ftrace_active[i] = ftrace_active.back();
+			ftrace_active.pop_back();
+			continue;
+		}
+		if (inner == NULL || call->end - call->start < inner->end - inner->start)
+			inner = call;
+		i++;
+	}
+
+	if (inner == NULL)
+		return;
+
+	ftrace_attributed++;
+	ftrace_attributed_time += ev->duration;
+	inner->func->self++;
+	inner->func->self_time += ev->duration;
+
+	// Recursive functions count once
+	std::vector<struct ftrace_func *> seen;
+	for (i = 0; i < ftrace_active.size(); i++) {
+		struct ftrace_func *func = ftrace_calls[ftrace_active[i]].func;
+
+		if (ftrace_calls[ftrace_active[i]].task != inner->task ||
+		    std::find(seen.begin(), seen.end(), func) != seen.end())
+			continue;
+		seen.push_back(func);
+		func->transfers++;
+		func->time += ev->duration;
+	}
+}
+
+static bool ftrace_by_time(const std::map<std::string, struct ftrace_func>::iterator &a,
+			   const std::map<std::string, struct ftrace_func>::iterator &b)
+{
+	return a->second.time > b->second.time;
+}
+
+void ftrace_report(void)
+{
+	std::vector<std::map<std::string, struct ftrace_func>::iterator> funcs;
+	std::map<std::string, struct ftrace_func>::iterator it;
+
+	if (!ftrace_enabled())
+		return;
+
+	for (it = ftrace_funcs.begin(); it != ftrace_funcs.end(); ++it)
+		if (it->second.transfers)
+			funcs.push_back(it);
+	std::sort(funcs.begin(), funcs.end(), ftrace_by_time);
+
+	for (size_t i = 0; i < funcs.size(); i++) {
+		const struct ftrace_func *f = &funcs[i]->second;
+
+		printf("FTRACE %s: %" PRIu64 " transfers time %.3f ms avg %.1f us, self %" PRIu64
+		       " transfers time %.3f ms\n",
+		       funcs[i]->first.c_str(), f->transfers, f->time / 1000.0, (double) f->time / f->transfers,
+		       f->self, f->self_time / 1000.0);
+	}
+
+	printf("FTRACE %" PRIu64 " of %" PRIu64 " control transfers attributed, %.3f of %.3f ms\n",
+	       ftrace_attributed, ftrace_transfers, ftrace_attributed_time / 1000.0, ftrace_time / 1000.0);
+	if (ftrace_transfers && ftrace_attributed == 0 && !ftrace_calls.empty())
+		printf("FTRACE no transfer within traced calls %" PRIu64 ".%06" PRIu64 " - %" PRIu64 ".%06" PRIu64
+		       ", check --ftrace-offset\n",
+		       ftrace_calls.front().start / 1000000, ftrace_calls.front().start % 1000000,
+		       ftrace_calls.back().start / 1000000, ftrace_calls.back().start % 1000000);
+	fflush(stdout);
+}
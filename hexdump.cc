@@ -0,0 +1,159 @@
+/*
+ * Hex dump of payload data as " xx" per byte. Bytes are encoded in blocks
+ * into a line buffer written with one fwrite(), using SSSE3 or AVX2 when
+ * the CPU has them, selected at first use.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HEX_SIMD
+#endif
+
+// Bytes encoded per block, output of a block fits in LINEBUF_LEN
+#define HEX_BLOCK	(LINEBUF_LEN / 3 / 32 * 32)
+
+// Per URB limit of dumped bytes, 0 means no limit
+unsigned int dump_payload_cap;
+
+typedef size_t (*hex_encode_fn)(char *dst, const unsigned char *src, size_t len);
+
+static size_t hex_encode_scalar(char *dst, const unsigned char *src, size_t len)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	for (size_t i = 0; i < len; i++) {
+		*dst++ = ' ';
+		*dst++ = digits[src[i] >> 4];
+		*dst++ = digits[src[i] & 0xf];
+	}
+	return 3 * len;
+}
+
+#ifdef HEX_SIMD
+/*
+ * 16 bytes give 32 hex digits in two registers A (bytes 0-7) and B (bytes
+ * 8-15) and 48 output bytes in three registers. Each output register is
+ * shuffled from A and/or B, space positions are zeroed and ORed in.
+ */
+static uint8_t hex_shuf[3][2][16] __attribute__((aligned(16)));
+static uint8_t hex_space[3][16] __attribute__((aligned(16)));
+
+static void hex_init_masks(void)
+{
+	for (int p = 0; p < 48; p++) {
+		const int i = p / 3, k = p % 3, out = p / 16, pos = p % 16;
+		const int src = 2 * (i % 8) + k - 1;
+
+		hex_shuf[out][0][pos] = (k && i < 8) ? src : 0x80;
+		hex_shuf[out][1][pos] = (k && i >= 8) ? src : 0x80;
+		hex_space[out][pos] = k ? 0 : ' ';
+	}
+}
+
+__attribute__((target("ssse3")))
+static size_t hex_encode_ssse3(char *dst, const unsigned char *src, size_t len)
+{
+	const __m128i digits = _mm_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+					     '8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m128i nibble = _mm_set1_epi8(0xf);
+	__m128i m[3][2], sp[3];
+	size_t i;
+
+	for (int o = 0; o < 3; o++) {
+		m[o][0] = _mm_load_si128(reinterpret_cast<const __m128i *>(hex_shuf[o][0]));
+		m[o][1] = _mm_load_si128(reinterpret_cast<const __m128i *>(hex_shuf[o][1]));
+		sp[o] = _mm_load_si128(reinterpret_cast<const __m128i *>(hex_space[o]));
+	}
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+		const __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+		const __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(x, nibble));
+		const __m128i a = _mm_unpacklo_epi8(hi, lo);
+		const __m128i b = _mm_unpackhi_epi8(hi, lo);
+		__m128i *d = reinterpret_cast<__m128i *>(dst + 3 * i);
+
+		for (int o = 0; o < 3; o++)
+			_mm_storeu_si128(d + o, _mm_or_si128(sp[o], _mm_or_si128(_mm_shuffle_epi8(a, m[o][0]),
+										  _mm_shuffle_epi8(b, m[o][1]))));
+	}
+
+	return 3 * i + hex_encode_scalar(dst + 3 * i, src + i, len - i);
+}
+
+// The same per 128-bit lane, 32 bytes at once
+__attribute__((target("avx2")))
+static size_t hex_encode_avx2(char *dst, const unsigned char *src, size_t len)
+{
+	const __m256i digits = _mm256_setr_epi8('0', '1', '2', '3', '4', '5', '6', '7',
+						'8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
+						'0', '1', '2', '3', '4', '5', '6', '7',
+						'8', '9', 'a', 'b', 'c', 'd', 'e', 'f');
+	const __m256i nibble = _mm256_set1_epi8(0xf);
+	__m256i m[3][2], sp[3];
+	size_t i;
+
+	for (int o = 0; o < 3; o++) {
+		m[o][0] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(hex_shuf[o][0])));
+		m[o][1] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(hex_shuf[o][1])));
+		sp[o] = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i *>(hex_space[o])));
+	}
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		const __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+		const __m256i hi = _mm256_shuffle_epi8(digits, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+		const __m256i lo = _mm256_shuffle_epi8(digits, _mm256_and_si256(x, nibble));
+		const __m256i a = _mm256_unpacklo_epi8(hi, lo);
+		const __m256i b = _mm256_unpackhi_epi8(hi, lo);
+		__m256i out[3];
+		__m256i *d = reinterpret_cast<__m256i *>(dst + 3 * i);
+
+		for (int o = 0; o < 3; o++)
+			out[o] = _mm256_or_si256(sp[o], _mm256_or_si256(_mm256_shuffle_epi8(a, m[o][0]),
+									 _mm256_shuffle_epi8(b, m[o][1])));
+
+		// Low lanes hold output of bytes 0-15, high lanes of bytes 16-31
+		_mm256_storeu_si256(d, _mm256_permute2x128_si256(out[0], out[1], 0x20));
+		_mm256_storeu_si256(d + 1, _mm256_permute2x128_si256(out[2], out[0], 0x30));
+		_mm256_storeu_si256(d + 2, _mm256_permute2x128_si256(out[1], out[2], 0x31));
+	}
+
+	return 3 * i + hex_encode_ssse3(dst + 3 * i, src + i, len - i);
+}
+#endif
+
+static hex_encode_fn hex_select(void)
+{
+#ifdef HEX_SIMD
+	__builtin_cpu_init();
+	hex_init_masks();
+	if (__builtin_cpu_supports("avx2"))
+		return hex_encode_avx2;
+	if (__builtin_cpu_supports("ssse3"))
+		return hex_encode_ssse3;
+#endif
+	return hex_encode_scalar;
+}
+
+// Print @len bytes as " xx xx ...", limited by dump_payload_cap
+void print_hex(const unsigned char *data, size_t len)
+{
+	static hex_encode_fn encode;
+	static char linebuf[LINEBUF_LEN + 1];
+	size_t total = len;
+
+	if (encode == NULL)
+		encode = hex_select();
+
+	if (dump_payload_cap && len > dump_payload_cap)
+		len = dump_payload_cap;
+
+	for (size_t i = 0; i < len; i += HEX_BLOCK) {
+		const size_t n = len - i < HEX_BLOCK ? len - i : HEX_BLOCK;
+
+		fwrite(linebuf, encode(linebuf, data + i, n), 1, stdout);
+	}
+
+	if (len < total)
+		printf(" ... (%zu more bytes)", total - len);
+}
@@ -0,0 +1,254 @@
+/*
+ * Time index of a capture file, written next to it as <capture>.idx.
+ *
+ * Every INDEX_EVENTS events or INDEX_USEC of capture time a checkpoint is
+ * stored: capture offset and timestamp of the next event together with the
+ * decoder state at that point, i.e. state machines, shadow registers and
+ * capture offsets of S events of URBs still pending. Decoding can then start
+ * from any checkpoint with the same context as when decoding from the start.
+ *
+ * When the index is closed, a table of checkpoint timestamps and offsets and
+ * a trailer pointing to it are appended, so a seek reads only the table and
+ * one checkpoint. Index of an interrupted capture has no table, checkpoints
+ * are scanned then.
+ */
+
+#define INDEX_MAGIC	"RT2XIDX1"
+#define INDEX_TABLE_MAGIC	"RT2XTBL1"
+#define INDEX_EVENTS	4096
+#define INDEX_USEC	1000000
+
+struct index_file_header {
+	char magic[8];
+	uint32_t entry_size;
+	uint32_t reserved;
+};
+
+struct index_entry {
+	uint64_t offset;
+	uint64_t ts;
+	uint32_t n_pending;	// followed by n_pending uint64_t offsets
+	uint32_t reserved;
+	struct decoder_state state;
+	struct shadow_regs shadow;
+};
+
+// Table entry of a checkpoint
+struct index_slot {
+	uint64_t ts;
+	uint64_t offset;	// in the capture
+	uint64_t entry;		// in the index
+};
+
+// Last bytes of a closed index
+struct index_trailer {
+	uint64_t table;		// offset of the table
+	uint64_t count;
+	char magic[8];
+};
+
+struct index_writer {
+	FILE *fp;
+	std::vector<struct index_slot> slots;
+	// Capture offsets of S events of not yet completed URBs
+	std::map<uint64_t, uint64_t> pending;
+	unsigned int events;
+	uint64_t last_ts;
+};
+
+void index_name(char *name, size_t len, const char *capture_name)
+{
+	snprintf(name, len, "%s.idx", capture_name);
+}
+
+int index_create(struct index_writer *iw, const char *capture_name)
+{
+	struct index_file_header fh;
+	char name[PATH_MAX];
+
+	index_name(name, sizeof(name), capture_name);
+	iw->fp = fopen(name, "w");
+	if (iw->fp == NULL)
+		return -1;
+
+	memcpy(fh.magic, INDEX_MAGIC, sizeof(fh.magic));
+	fh.entry_size = sizeof(struct index_entry);
+	fh.reserved = 0;
+	fwrite(&fh, sizeof(fh), 1, iw->fp);
+
+	iw->slots.clear();
+	iw->events = 0;
+	iw->last_ts = 0;
+	return 0;
+}
+
+static void index_checkpoint(struct index_writer *iw, uint64_t off, uint64_t ts)
+{
+	std::map<uint64_t, uint64_t>::iterator it;
+	struct index_slot slot = { ts, off, (uint64_t) ftell(iw->fp) };
+	struct index_entry e;
+
+	iw->slots.push_back(slot);
+	memset(&e, 0, sizeof(e));
+	e.offset = off;
+	e.ts = ts;
+	e.n_pending = iw->pending.size();
+	rt2x00usb_save_state(decoder, &e.state);
+	e.shadow = *rt2x00usb_shadow(decoder);
+
+	fwrite(&e, sizeof(e), 1, iw->fp);
+	for (it = iw->pending.begin(); it != iw->pending.end(); ++it)
+		fwrite(&it->second, sizeof(it->second), 1, iw->fp);
+}
+
+// Called for every event at capture offset @off, before it is decoded
+void index_event(struct index_writer *iw, struct usbmon_packet *hdr, uint64_t off)
+{
+	uint64_t ts = get_ts(hdr);
+
+	if (iw->events == 0 || iw->events >= INDEX_EVENTS || ts - iw->last_ts >= INDEX_USEC) {
+		index_checkpoint(iw, off, ts);
+		iw->events = 0;
+		iw->last_ts = ts;
+	}
+	iw->events++;
+
+	// Track URBs the same way the decoder does
+	if (hdr->type == 'S')
+		iw->pending[hdr->id] = off;
+	else if (hdr->type == 'C')
+		iw->pending.erase(hdr->id);
+	else if (hdr->type == EVENT_REENUM)
+		iw->pending.clear();
+}
+
+void index_close(struct index_writer *iw)
+{
+	struct index_trailer t;
+
+	if (iw->fp == NULL)
+		return;
+
+	t.table = ftell(iw->fp);
+	t.count = iw->slots.size();
+	memcpy(t.magic, INDEX_TABLE_MAGIC, sizeof(t.magic));
+	fwrite(iw->slots.data(), sizeof(struct index_slot), iw->slots.size(), iw->fp);
+	fwrite(&t, sizeof(t), 1, iw->fp);
+
+	fclose(iw->fp);
+	iw->fp = NULL;
+	iw->slots.clear();
+}
+
+static bool index_read_slot(FILE *fp, const struct index_trailer *t, uint64_t i, struct index_slot *slot)
+{
+	return fseek(fp, t->table + i * sizeof(*slot), SEEK_SET) == 0 && fread(slot, sizeof(*slot), 1, fp) == 1;
+}
+
+/*
+ * Binary search of the table for the last checkpoint at or before @ts.
+ * Return false if the index has no table.
+ */
+static bool index_search_table(FILE *fp, struct capture *cap, uint64_t ts, long *best)
+{
+	struct index_trailer t;
+	struct index_slot slot;
+	uint64_t lo = 0, hi;
+
+	if (fseek(fp, -(long) sizeof(t), SEEK_END) || fread(&t, sizeof(t), 1, fp) != 1 ||
+	    memcmp(t.magic, INDEX_TABLE_MAGIC, sizeof(t.magic)))
+		return false;
+
+	// First checkpoint after @ts
+	hi = t.count;
+	while (lo < hi) {
+		const uint64_t mid = lo + (hi - lo) / 2;
+
+		if (!index_read_slot(fp, &t, mid, &slot))
+			return false;
+		if (slot.ts <= ts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// Checkpoints beyond the end of a truncated capture are not usable
+	while (lo > 0) {
+		if (!index_read_slot(fp, &t, lo - 1, &slot))
+			return false;
+		if (slot.offset < cap->len) {
+			*best = slot.entry;
+			return true;
+		}
+		lo--;
+	}
+	*best = -1;
+	return true;
+}
+
+// Scan of checkpoints, state of those skipped is not read
+static long index_scan(FILE *fp, struct capture *cap, uint64_t ts)
+{
+	const size_t head = offsetof(struct index_entry, state);
+	struct index_entry e;
+	long best = -1;
+
+	fseek(fp, sizeof(struct index_file_header), SEEK_SET);
+	for (;;) {
+		long pos = ftell(fp);
+
+		if (fread(&e, head, 1, fp) != 1 || e.ts > ts || e.offset >= cap->len)
+			break;
+		best = pos;
+		fseek(fp, sizeof(e) - head + e.n_pending * sizeof(uint64_t), SEEK_CUR);
+	}
+	return best;
+}
+
+/*
+ * Find the last checkpoint at or before @ts and restore decoder state from
+ * it. Return capture offset to continue decoding from, or 0 if there is no
+ * usable index.
+ */
+uint64_t index_restore(struct capture *cap, const char *capture_name, uint64_t ts)
+{
+	struct index_file_header fh;
+	struct index_entry e;
+	char name[PATH_MAX];
+	long best = -1;
+	FILE *fp;
+
+	index_name(name, sizeof(name), capture_name);
+	if ((fp = fopen(name, "r")) == NULL)
+		return 0;
+
+	if (fread(&fh, sizeof(fh), 1, fp) != 1 ||
+	    memcmp(fh.magic, INDEX_MAGIC, sizeof(fh.magic)) ||
+	    fh.entry_size != sizeof(struct index_entry)) {
+		fprintf(stderr, "%s: not a valid index\n", name);
+		fclose(fp);
+		return 0;
+	}
+
+	if (!index_search_table(fp, cap, ts, &best))
+		best = index_scan(fp, cap, ts);
+
+	if (best < 0 || fseek(fp, best, SEEK_SET) || fread(&e, sizeof(e), 1, fp) != 1) {
+		fclose(fp);
+		return 0;
+	}
+
+	rt2x00usb_clear_pending(decoder);
+	for (unsigned int i = 0; i < e.n_pending; i++) {
+		uint64_t off;
+
+		if (fread(&off, sizeof(off), 1, fp) != 1 || off >= cap->len)
+			break;
+		rt2x00usb_add_pending(decoder, capture_event(cap, off));
+	}
+	rt2x00usb_restore_state(decoder, &e.state);
+	*rt2x00usb_shadow(decoder) = e.shadow;
+
+	fclose(fp);
+	return e.offset;
+}
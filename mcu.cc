@@ -0,0 +1,227 @@
+/*
+ * MCU command latency per opcode. Command is issued from the first
+ * H2M_MAILBOX_CSR busy check (or the mailbox write if the driver skips the
+ * check) to the HOST_CMD write. It is done with the first mailbox read with
+ * the owner bit clear, or with H2M_MAILBOX_CID containing its token or
+ * H2M_MAILBOX_STATUS read after it.
+ */
+
+#define H2M_MAILBOX_CSR		0x7010
+#define H2M_MAILBOX_CID		0x7014
+#define H2M_MAILBOX_STATUS	0x701c
+#define MCU_OWNER_BIT		0x00000001
+#define MCU_NO_TOKEN		0xff
+#define MCU_TIMEOUT		100000	// usec
+#define MCU_HIST		12	// bucket n is below 32 << n usec, last is the rest
+
+struct mcu_stats {
+	uint64_t commands;
+	uint64_t done;
+	uint64_t mismatch;
+	uint64_t timeout;
+	uint64_t issue_time;
+	uint64_t issue_max;
+	uint64_t done_time;
+	uint64_t done_max;
+	uint64_t issue_hist[MCU_HIST];
+	uint64_t done_hist[MCU_HIST];
+};
+
+struct mcu_cmd {
+	bool active;
+	uint8_t command;
+	uint8_t token;
+	uint64_t start;
+	uint64_t issued;
+};
+
+bool mcu_enabled;
+static struct mcu_stats mcu_stats[256];
+static struct mcu_cmd mcu_cmd;
+// Busy check run in progress and its first submission
+static bool mcu_checking;
+static uint64_t mcu_check_start;
+// First mailbox write of the command being written
+static uint64_t mcu_mailbox_start;
+
+static const char *mcu_name(uint8_t command)
+{
+	switch (command) {
+	case 0x30: return "SLEEP";
+	case 0x31: return "WAKEUP";
+	case 0x35: return "RADIO_OFF";
+	case 0x36: return "CURRENT";
+	case 0x50: return "LED";
+	case 0x51: return "LED_STRENGTH";
+	case 0x52: return "LED_AG_CONF";
+	case 0x53: return "LED_ACT_CONF";
+	case 0x54: return "LED_LED_POLARITY";
+	case 0x60: return "RADAR";
+	case 0x72: return "BOOT_SIGNAL";
+	case 0x73: return "ANT_SELECT";
+	case 0x74: return "FREQ_OFFSET";
+	case 0x80: return "BBP_SIGNAL";
+	case 0x83: return "POWER_SAVE";
+	case 0x91: return "BAND_SELECT";
+	}
+	return "UNKNOWN";
+}
+
+static int mcu_bucket(uint64_t us)
+{
+	int b = 0;
+
+	while (us >= (32ULL << b) && b < MCU_HIST - 1)
+		b++;
+	return b;
+}
+
+static void mcu_done(uint64_t ts)
+{
+	struct mcu_cmd *c = &mcu_cmd;
+	struct mcu_stats *st = &mcu_stats[c->command];
+	const uint64_t t = ts - c->issued;
+
+	st->done++;
+	st->done_time += t;
+	if (t > st->done_max)
+		st->done_max = t;
+	st->done_hist[mcu_bucket(t)]++;
+	c->active = false;
+}
+
+static void mcu_timeout(const char *why)
+{
+	struct mcu_cmd *c = &mcu_cmd;
+
+	mcu_stats[c->command].timeout++;
+	printf("MCU %02x %s token %02x: %s\n", c->command, mcu_name(c->command), c->token, why);
+	c->active = false;
+}
+
+static void mcu_command(const struct rt2x00usb_event *ev)
+{
+	struct mcu_cmd *c = &mcu_cmd;
+	struct mcu_stats *st = &mcu_stats[ev->addr];
+
+	if (c->active)
+		mcu_timeout("no completion before next command");
+
+	c->active = true;
+	c->command = ev->addr;
+	c->token = ev->value;
+	c->start = mcu_mailbox_start ? mcu_mailbox_start : get_ts(ev->shdr);
+	c->issued = ev->ts;
+	mcu_mailbox_start = 0;
+
+	const uint64_t t = c->issued - c->start;
+
+	st->commands++;
+	st->issue_time += t;
+	if (t > st->issue_max)
+		st->issue_max = t;
+	st->issue_hist[mcu_bucket(t)]++;
+}
+
+// Command is done if CID has its token
+static void mcu_cid(uint32_t val, uint64_t ts)
+{
+	struct mcu_cmd *c = &mcu_cmd;
+	bool other = false;
+
+	if (c->token == MCU_NO_TOKEN)
+		return;
+
+	for (int i = 0; i < 4; i++) {
+		const uint8_t cid = val >> (8 * i);
+
+		if (cid == c->token) {
+			mcu_done(ts);
+			return;
+		}
+		if (cid != MCU_NO_TOKEN)
+			other = true;
+	}
+
+	if (other) {
+		mcu_stats[c->command].mismatch++;
+		printf("MCU %02x %s token %02x: token mismatch, CID %08x\n", c->command, mcu_name(c->command),
+		       c->token, val);
+	}
+}
+
+// Follow mailbox accesses, command itself comes from RT2X00USB_MCU_COMMAND
+static void mcu_transfer(const struct rt2x00usb_event *ev)
+{
+	const struct usb_ctrlrequest *cr = reinterpret_cast<const struct usb_ctrlrequest *>(ev->shdr->s.setup);
+	const bool checking = mcu_checking;
+	const bool read = is_read_cr(cr) && ev->hdr->len_cap == 4;
+	const uint32_t val = read ? decode_reg_val(get_data(ev->hdr)) : 0;
+
+	mcu_checking = false;
+
+	if (!(cr->bRequestType & 0x40))
+		return;
+
+	if (cr->wIndex == H2M_MAILBOX_CSR && read) {
+		mcu_checking = true;
+		// New busy check, mailbox writes before it did not make a command
+		if (!checking) {
+			mcu_check_start = get_ts(ev->shdr);
+			mcu_mailbox_start = 0;
+		}
+		if (mcu_cmd.active && !(val & MCU_OWNER_BIT))
+			mcu_done(ev->ts);
+	} else if ((cr->wIndex == H2M_MAILBOX_CSR || cr->wIndex == H2M_MAILBOX_CSR + 2) && !is_read_cr(cr)) {
+		if (mcu_mailbox_start == 0)
+			mcu_mailbox_start = checking ? mcu_check_start : get_ts(ev->shdr);
+	} else if (cr->wIndex == H2M_MAILBOX_CID && read && mcu_cmd.active) {
+		mcu_cid(val, ev->ts);
+	} else if (cr->wIndex == H2M_MAILBOX_STATUS && read && mcu_cmd.active) {
+		mcu_done(ev->ts);
+	}
+}
+
+void mcu_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	if (mcu_cmd.active && ev->ts - mcu_cmd.issued > MCU_TIMEOUT)
+		mcu_timeout("timeout");
+
+	if (ev->type == RT2X00USB_MCU_COMMAND)
+		mcu_command(ev);
+	else if (ev->type == RT2X00USB_COMPLETE && ev->value == XFER_TYPE_CONTROL)
+		mcu_transfer(ev);
+}
+
+static void mcu_print_hist(uint8_t command, const char *what, const uint64_t *hist)
+{
+	printf("MCU %02x %s: %s", command, mcu_name(command), what);
+	for (int i = 0; i < MCU_HIST; i++)
+		if (hist[i])
+			printf(" %s%lluus:%" PRIu64, i == MCU_HIST - 1 ? ">=" : "<",
+			       i == MCU_HIST - 1 ? 16ULL << i : 32ULL << i, hist[i]);
+	printf("\n");
+}
+
+void mcu_report(void)
+{
+	if (!mcu_enabled)
+		return;
+
+	for (int i = 0; i < 256; i++) {
+		struct mcu_stats *st = &mcu_stats[i];
+
+		if (st->commands == 0)
+			continue;
+
+		printf("MCU %02x %s: %" PRIu64 " commands issue avg %.3f max %.3f ms,"
+		       " %" PRIu64 " done avg %.3f max %.3f ms, %" PRIu64 " token mismatches %" PRIu64 " timeouts\n",
+		       i, mcu_name(i), st->commands, st->issue_time / 1000.0 / st->commands, st->issue_max / 1000.0,
+		       st->done, st->done ? st->done_time / 1000.0 / st->done : 0.0, st->done_max / 1000.0,
+		       st->mismatch, st->timeout);
+		mcu_print_hist(i, "issue", st->issue_hist);
+		if (st->done)
+			mcu_print_hist(i, "done", st->done_hist);
+	}
+	fflush(stdout);
+}
@@ -0,0 +1,262 @@
+/*
+ * Metrics text file for node-exporter textfile collector. Its parser does
+ * not strip _total of counters, TYPE and HELP name the samples. Decoder only
+ * increments counters with relaxed atomics, a separate thread periodically
+ * writes them to a temporary file renamed over the metrics file, so the
+ * collector never reads a partial file.
+ */
+
+#define METRICS_INTERVAL	15	// seconds
+#define MET_MAX_EP		16
+
+struct metrics {
+	// Vendor requests per register, outside of registers per area, [read]
+	uint64_t ctrl[2][0x10000 / 4];
+	uint64_t ctrl_std;
+	uint64_t bbp[2][256];
+	uint64_t rf[2][256];
+	uint64_t mcu[256];
+	// [in][endpoint]
+	uint64_t bulk_urbs[2][MET_MAX_EP];
+	uint64_t bulk_bytes[2][MET_MAX_EP];
+	uint64_t bulk_frames[2][MET_MAX_EP];
+	uint64_t bulk_lat_count[2][MET_MAX_EP];
+	uint64_t bulk_lat_sum[2][MET_MAX_EP];
+	uint64_t ctrl_lat_count;
+	uint64_t ctrl_lat_sum;
+	uint64_t rx_crc_errors;
+	uint64_t rx_cipher_errors;
+	uint64_t dropped;
+	// Gauges
+	uint64_t lag;		// usec
+	uint64_t queued;
+};
+
+const char *metrics_name;
+uint64_t metrics_interval = METRICS_INTERVAL;
+static struct metrics met;
+static pthread_mutex_t met_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void met_inc(uint64_t *counter, uint64_t n = 1)
+{
+	__atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t met_get(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline bool metrics_enabled(void)
+{
+	return metrics_name != NULL;
+}
+
+// Wall clock time minus timestamp of the event just decoded
+void metrics_lag(uint64_t lag)
+{
+	if (metrics_enabled())
+		__atomic_store_n(&met.lag, lag, __ATOMIC_RELAXED);
+}
+
+// Events waiting in usbmon ring
+void metrics_queued(uint32_t queued)
+{
+	if (metrics_enabled())
+		__atomic_store_n(&met.queued, queued, __ATOMIC_RELAXED);
+}
+
+static void met_complete(const struct rt2x00usb_event *ev)
+{
+	const bool in = ev->addr & USB_DIR_IN;
+	const int ep = ev->addr & 0x7f;
+
+	if (ev->value == XFER_TYPE_CONTROL) {
+		const struct usb_ctrlrequest *cr = reinterpret_cast<const struct usb_ctrlrequest *>(ev->shdr->s.setup);
+
+		if (cr->bRequestType & 0x40) {
+			struct area *area = cr->wIndex > 0x17ff ? get_area(cr->wIndex) : NULL;
+			const uint16_t addr = area ? area->begin : cr->wIndex;
+
+			met_inc(&met.ctrl[is_read_cr(cr)][addr / 4]);
+		} else {
+			met_inc(&met.ctrl_std);
+		}
+		met_inc(&met.ctrl_lat_count);
+		met_inc(&met.ctrl_lat_sum, ev->duration);
+	} else if (ev->value == XFER_TYPE_BULK && ep < MET_MAX_EP) {
+		// Counted also when bulk URBs are not decoded under overload
+		met_inc(&met.bulk_urbs[in][ep]);
+		met_inc(&met.bulk_bytes[in][ep], ev->len);
+		met_inc(&met.bulk_lat_count[in][ep]);
+		met_inc(&met.bulk_lat_sum[in][ep], ev->duration);
+	}
+}
+
+void metrics_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	const int ep = ev->addr & 0x7f;
+	uint32_t rxd;
+
+	switch (ev->type) {
+	case RT2X00USB_COMPLETE:
+		met_complete(ev);
+		break;
+	case RT2X00USB_BBP_READ:
+	case RT2X00USB_BBP_WRITE:
+		met_inc(&met.bbp[ev->type == RT2X00USB_BBP_READ][ev->addr & 0xff]);
+		break;
+	case RT2X00USB_RF_READ:
+	case RT2X00USB_RF_WRITE:
+		met_inc(&met.rf[ev->type == RT2X00USB_RF_READ][ev->addr & 0xff]);
+		break;
+	case RT2X00USB_MCU_COMMAND:
+		met_inc(&met.mcu[ev->addr & 0xff]);
+		break;
+	case RT2X00USB_BULK_END:
+		if (ep >= MET_MAX_EP)
+			break;
+		met_inc(&met.bulk_frames[!!(ev->addr & USB_DIR_IN)][ep], ev->arg[0]);
+		break;
+	case RT2X00USB_RX_FRAME:
+		rxd = decode_reg_val(ev->data + ev->len - 4);
+		if (rxd & 0x00000100)	// CRC_ERROR
+			met_inc(&met.rx_crc_errors);
+		if (rxd & 0x00000600)	// CIPHER_ERROR
+			met_inc(&met.rx_cipher_errors);
+		break;
+	case RT2X00USB_DROP:
+		met_inc(&met.dropped, ev->value);
+		break;
+	}
+}
+
+static void met_family(FILE *fp, const char *name, const char *type, const char *help)
+{
+	fprintf(fp, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void met_regs(FILE *fp, const char *name, uint64_t (*counters)[256])
+{
+	for (int read = 0; read < 2; read++)
+		for (int i = 0; i < 256; i++)
+			if (met_get(&counters[read][i]))
+				fprintf(fp, "%s_total{reg=\"%d\",dir=\"%s\"} %" PRIu64 "\n", name, i,
+					read ? "read" : "write", met_get(&counters[read][i]));
+}
+
+// Samples of endpoints that completed URBs, values divided by @scale
+static void met_bulk(FILE *fp, const char *name, uint64_t (*counters)[MET_MAX_EP], double scale)
+{
+	for (int in = 1; in >= 0; in--)
+		for (int ep = 0; ep < MET_MAX_EP; ep++)
+			if (met_get(&met.bulk_lat_count[in][ep]))
+				fprintf(fp, "%s{endpoint=\"%d\",dir=\"%s\"} %.*f\n", name, ep, in ? "in" : "out",
+					scale == 1 ? 0 : 6, met_get(&counters[in][ep]) / scale);
+}
+
+static void met_write(FILE *fp)
+{
+	met_family(fp, "rt2x00usb_control_transfers_total", "counter", "Vendor control transfers per register");
+	for (int read = 0; read < 2; read++) {
+		for (unsigned int i = 0; i < ARRAY_SIZE(met.ctrl[0]); i++) {
+			const uint64_t n = met_get(&met.ctrl[read][i]);
+			struct reg *reg = get_reg(i * 4);
+			struct area *area = get_area(i * 4);
+
+			if (n == 0)
+				continue;
+			fprintf(fp, "rt2x00usb_control_transfers_total{register=\"%s\",area=\"%s\",addr=\"0x%04x\",dir=\"%s\"}"
+				" %" PRIu64 "\n", reg ? reg->name : "", area ? area->name : "", i * 4,
+				read ? "read" : "write", n);
+		}
+	}
+	fprintf(fp, "rt2x00usb_control_transfers_total{register=\"\",area=\"standard request\",addr=\"\",dir=\"\"}"
+		" %" PRIu64 "\n", met_get(&met.ctrl_std));
+
+	met_family(fp, "rt2x00usb_bbp_accesses_total", "counter", "BBP register accesses");
+	met_regs(fp, "rt2x00usb_bbp_accesses", met.bbp);
+	met_family(fp, "rt2x00usb_rf_accesses_total", "counter", "RF register accesses");
+	met_regs(fp, "rt2x00usb_rf_accesses", met.rf);
+
+	met_family(fp, "rt2x00usb_mcu_commands_total", "counter", "MCU commands per opcode");
+	for (int i = 0; i < 256; i++)
+		if (met_get(&met.mcu[i]))
+			fprintf(fp, "rt2x00usb_mcu_commands_total{opcode=\"0x%02x\"} %" PRIu64 "\n", i,
+				met_get(&met.mcu[i]));
+
+	met_family(fp, "rt2x00usb_bulk_urbs_total", "counter", "Completed bulk URBs");
+	met_bulk(fp, "rt2x00usb_bulk_urbs_total", met.bulk_urbs, 1);
+	met_family(fp, "rt2x00usb_bulk_bytes_total", "counter", "Bytes transferred by bulk URBs");
+	met_bulk(fp, "rt2x00usb_bulk_bytes_total", met.bulk_bytes, 1);
+	met_family(fp, "rt2x00usb_bulk_frames_total", "counter", "Frames in bulk URBs");
+	met_bulk(fp, "rt2x00usb_bulk_frames_total", met.bulk_frames, 1);
+	met_family(fp, "rt2x00usb_bulk_latency_seconds", "summary", "Bulk URB submission to completion");
+	met_bulk(fp, "rt2x00usb_bulk_latency_seconds_count", met.bulk_lat_count, 1);
+	met_bulk(fp, "rt2x00usb_bulk_latency_seconds_sum", met.bulk_lat_sum, 1e6);
+
+	met_family(fp, "rt2x00usb_control_latency_seconds", "summary", "Control transfer submission to completion");
+	fprintf(fp, "rt2x00usb_control_latency_seconds_count %" PRIu64 "\n", met_get(&met.ctrl_lat_count));
+	fprintf(fp, "rt2x00usb_control_latency_seconds_sum %.6f\n", met_get(&met.ctrl_lat_sum) / 1e6);
+
+	met_family(fp, "rt2x00usb_rx_crc_errors_total", "counter", "Received frames with RXD CRC_ERROR");
+	fprintf(fp, "rt2x00usb_rx_crc_errors_total %" PRIu64 "\n", met_get(&met.rx_crc_errors));
+	met_family(fp, "rt2x00usb_rx_cipher_errors_total", "counter", "Received frames with RXD CIPHER_ERROR");
+	fprintf(fp, "rt2x00usb_rx_cipher_errors_total %" PRIu64 "\n", met_get(&met.rx_cipher_errors));
+	met_family(fp, "rt2x00usb_usbmon_dropped_events_total", "counter", "Events lost by usbmon");
+	fprintf(fp, "rt2x00usb_usbmon_dropped_events_total %" PRIu64 "\n", met_get(&met.dropped));
+	met_family(fp, "rt2x00usb_usbmon_queued_events", "gauge", "Events waiting in usbmon ring");
+	fprintf(fp, "rt2x00usb_usbmon_queued_events %" PRIu64 "\n", met_get(&met.queued));
+	met_family(fp, "rt2x00usb_decoder_lag_seconds", "gauge", "Wall clock time minus time of last decoded event");
+	fprintf(fp, "rt2x00usb_decoder_lag_seconds %.6f\n", met_get(&met.lag) / 1e6);
+	fprintf(fp, "# EOF\n");
+}
+
+void metrics_write(void)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (!metrics_enabled())
+		return;
+
+	pthread_mutex_lock(&met_lock);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_name);
+	if ((fp = fopen(tmp, "w")) == NULL) {
+		fprintf(stderr, "fail to open file %s\n", tmp);
+	} else {
+		met_write(fp);
+		if (fclose(fp) == 0)
+			rename(tmp, metrics_name);
+		else
+			unlink(tmp);
+	}
+	pthread_mutex_unlock(&met_lock);
+}
+
+static void *metrics_thread(void *arg)
+{
+	for (;;) {
+		sleep(metrics_interval);
+		metrics_write();
+	}
+	return NULL;
+}
+
+int metrics_start(void)
+{
+	sigset_t set, old;
+	pthread_t thread;
+	int ret;
+
+	// Signals are handled by the decoding thread
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	ret = pthread_create(&thread, NULL, metrics_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
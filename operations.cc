@@ -0,0 +1,234 @@
+/*
+ * Driver operations recognized from characteristic register accesses, like
+ * RF and BBP programming of channel switch or key table writes of key
+ * installation. Operation starts with an access matching one of its START
+ * rules and lasts while accesses matching its rules follow within OP_GAP.
+ * Control transfers up to the last matching access are accounted to it.
+ */
+
+#define OP_GAP		5000	// usec
+#define OP_ANY		0xffff
+
+enum OpType {
+	OP_NONE,
+	OP_CHANNEL,
+	OP_CALIBRATION,
+	OP_BEACON,
+	OP_KEY,
+	OP_RADIO,
+	OP_LINK_TUNING,
+	OP_TYPES
+};
+
+static const char *op_name[OP_TYPES] = {
+	"none",
+	"channel-switch",
+	"rf-calibration",
+	"beacon-update",
+	"key-install",
+	"radio-on-off",
+	"link-tuning",
+};
+
+#define OP_START	1
+#define OP_BCN		2	// address in a beacon slot, see bcn_slot()
+#define OP_NOT_BCN	4	// address outside of beacon slots
+
+struct op_rule {
+	int op;
+	int type;	// rt2x00usb_event_type
+	uint16_t begin;
+	uint16_t end;
+	int flags;
+};
+
+// Start rules of an operation are checked in order, more specific first
+static const struct op_rule op_rules[] = {
+	// RFCSR30 calibration, outside of channel switch
+	{ OP_CALIBRATION,	RT2X00USB_RF_WRITE,	30, 30,		OP_START },
+	{ OP_CALIBRATION,	RT2X00USB_RF_WRITE,	0, OP_ANY,	0 },
+	{ OP_CALIBRATION,	RT2X00USB_RF_READ,	0, OP_ANY,	0 },
+	{ OP_CALIBRATION,	RT2X00USB_BBP_WRITE,	0, OP_ANY,	0 },
+	{ OP_CALIBRATION,	RT2X00USB_BBP_READ,	0, OP_ANY,	0 },
+
+	// RF through RF_CSR_CFG or RF_CSR_CFG0..2, BBP, band and PA/LNA pins
+	{ OP_CHANNEL,		RT2X00USB_RF_WRITE,	0, OP_ANY,	OP_START },
+	{ OP_CHANNEL,		RT2X00USB_MAC_WRITE,	0x1020, 0x1028,	OP_START },
+	{ OP_CHANNEL,		RT2X00USB_RF_READ,	0, OP_ANY,	0 },
+	{ OP_CHANNEL,		RT2X00USB_BBP_WRITE,	0, OP_ANY,	0 },
+	{ OP_CHANNEL,		RT2X00USB_BBP_READ,	0, OP_ANY,	0 },
+	{ OP_CHANNEL,		RT2X00USB_MAC_WRITE,	0x1004, 0x1004,	0 },	// MAC_SYS_CTRL
+	{ OP_CHANNEL,		RT2X00USB_MAC_READ,	0x1004, 0x1004,	0 },
+	{ OP_CHANNEL,		RT2X00USB_MAC_WRITE,	0x1328, 0x132c,	0 },	// TX_PIN_CFG, TX_BAND_CFG
+	{ OP_CHANNEL,		RT2X00USB_MAC_READ,	0x1328, 0x132c,	0 },
+
+	// Beacon templates in slots set by BCN_OFFSET0/1, slots and beacon timing
+	{ OP_BEACON,		RT2X00USB_AREA_WRITE,	0x4000, OP_ANY,	OP_START | OP_BCN },
+	{ OP_BEACON,		RT2X00USB_AREA_WRITE_VALUE, 0x4000, OP_ANY, OP_START | OP_BCN },
+	{ OP_BEACON,		RT2X00USB_MAC_WRITE,	0x042c, 0x0430,	0 },	// BCN_OFFSET0/1
+	{ OP_BEACON,		RT2X00USB_MAC_WRITE,	0x1114, 0x1114,	0 },	// BCN_TIME_CFG
+	{ OP_BEACON,		RT2X00USB_MAC_READ,	0x1114, 0x1114,	0 },
+
+	// Pairwise key table, IV/EIV, WCID attribute, shared key table and mode, WCID search table
+	{ OP_KEY,		RT2X00USB_AREA_WRITE,	0x4000, 0x700f,	OP_START | OP_NOT_BCN },
+	{ OP_KEY,		RT2X00USB_AREA_WRITE_VALUE, 0x4000, 0x700f, OP_START | OP_NOT_BCN },
+	{ OP_KEY,		RT2X00USB_AREA_READ,	0x4000, 0x700f,	OP_NOT_BCN },
+	{ OP_KEY,		RT2X00USB_AREA_WRITE,	0x1800, 0x1fff,	0 },
+	{ OP_KEY,		RT2X00USB_AREA_WRITE_VALUE, 0x1800, 0x1fff, 0 },
+
+	// MCU sleep, wakeup and radio off, DMA and PBF setup
+	{ OP_RADIO,		RT2X00USB_MCU_COMMAND,	0x30, 0x31,	OP_START },
+	{ OP_RADIO,		RT2X00USB_MCU_COMMAND,	0x35, 0x35,	OP_START },
+	{ OP_RADIO,		RT2X00USB_MAC_WRITE,	0x0208, 0x0208,	OP_START },	// WPDMA_GLO_CFG
+	{ OP_RADIO,		RT2X00USB_MAC_WRITE,	0x02a0, 0x02a0,	OP_START },	// USB_DMA_CFG
+	{ OP_RADIO,		RT2X00USB_MCU_COMMAND,	0, OP_ANY,	0 },
+	{ OP_RADIO,		RT2X00USB_MAC_WRITE,	0x0200, 0x04ff,	0 },
+	{ OP_RADIO,		RT2X00USB_MAC_READ,	0x0200, 0x04ff,	0 },
+	{ OP_RADIO,		RT2X00USB_MAC_WRITE,	0x1004, 0x1004,	0 },
+	{ OP_RADIO,		RT2X00USB_MAC_READ,	0x1004, 0x1004,	0 },
+	{ OP_RADIO,		RT2X00USB_BBP_WRITE,	0, OP_ANY,	0 },
+	{ OP_RADIO,		RT2X00USB_BBP_READ,	0, OP_ANY,	0 },
+	{ OP_RADIO,		RT2X00USB_RF_WRITE,	0, OP_ANY,	0 },
+	{ OP_RADIO,		RT2X00USB_RF_READ,	0, OP_ANY,	0 },
+
+	// Statistic counters and VGC in BBP R66
+	{ OP_LINK_TUNING,	RT2X00USB_MAC_READ,	0x1700, 0x1714,	OP_START },	// RX/TX_STA_CNT
+	{ OP_LINK_TUNING,	RT2X00USB_BBP_WRITE,	66, 66,		OP_START },
+	{ OP_LINK_TUNING,	RT2X00USB_BBP_READ,	0, OP_ANY,	0 },
+};
+
+struct op_current {
+	int op;
+	uint64_t start;
+	uint64_t end;		// last matching access
+	uint32_t transfers;
+	uint32_t bytes;
+	// Control transfers after the last matching access
+	uint32_t tail_transfers;
+	uint32_t tail_bytes;
+};
+
+struct op_stats {
+	uint64_t count;
+	uint64_t time;
+	uint64_t min;
+	uint64_t max;
+	uint64_t transfers;
+	uint64_t bytes;
+};
+
+bool op_enabled;
+static struct op_current op_cur;
+static struct op_stats op_stats[OP_TYPES];
+
+static bool op_match(const struct op_rule *r, const struct rt2x00usb_event *ev)
+{
+	if (r->type != ev->type || ev->addr < r->begin || (ev->addr > r->end && r->end != OP_ANY))
+		return false;
+	if (r->flags & (OP_BCN | OP_NOT_BCN))
+		return (bcn_slot(ev->addr) >= 0) == !!(r->flags & OP_BCN);
+	return true;
+}
+
+static void op_end(void)
+{
+	struct op_current *c = &op_cur;
+	struct op_stats *st = &op_stats[c->op];
+	const uint64_t duration = c->end - c->start;
+
+	if (c->op == OP_NONE)
+		return;
+
+	printf("OP %s %" PRIu64 ".%06" PRIu64 " - %" PRIu64 ".%06" PRIu64 ": %.3f ms %u transfers %u bytes\n",
+	       op_name[c->op], c->start / 1000000, c->start % 1000000, c->end / 1000000, c->end % 1000000,
+	       duration / 1000.0, c->transfers, c->bytes);
+
+	if (st->count == 0 || duration < st->min)
+		st->min = duration;
+	if (duration > st->max)
+		st->max = duration;
+	st->count++;
+	st->time += duration;
+	st->transfers += c->transfers;
+	st->bytes += c->bytes;
+
+	memset(c, 0, sizeof(*c));
+}
+
+static void op_start(int op, const struct rt2x00usb_event *ev)
+{
+	op_end();
+
+	op_cur.op = op;
+	// Operation begins with submission of the first transfer
+	op_cur.start = ev->shdr ? get_ts(ev->shdr) : ev->ts;
+	op_cur.end = ev->ts;
+}
+
+void op_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	struct op_current *c = &op_cur;
+	unsigned int i;
+
+	if (c->op != OP_NONE && ev->ts - c->end > OP_GAP)
+		op_end();
+
+	if (ev->type == RT2X00USB_COMPLETE) {
+		if (c->op == OP_NONE || ev->value != XFER_TYPE_CONTROL)
+			return;
+
+		c->tail_transfers++;
+		c->tail_bytes += SETUP_LEN + ev->len;
+		// Completion of the last matching access
+		if (ev->ts == c->end) {
+			c->transfers += c->tail_transfers;
+			c->bytes += c->tail_bytes;
+			c->tail_transfers = c->tail_bytes = 0;
+		}
+		return;
+	}
+
+	if (c->op != OP_NONE) {
+		for (i = 0; i < ARRAY_SIZE(op_rules); i++) {
+			if (op_rules[i].op == c->op && op_match(&op_rules[i], ev)) {
+				c->end = ev->ts;
+				return;
+			}
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(op_rules); i++) {
+		if ((op_rules[i].flags & OP_START) && op_match(&op_rules[i], ev)) {
+			op_start(op_rules[i].op, ev);
+			return;
+		}
+	}
+}
+
+// Operation in progress is not accounted
+void op_report(void)
+{
+	if (!op_enabled)
+		return;
+
+	for (int i = OP_NONE + 1; i < OP_TYPES; i++) {
+		struct op_stats *st = &op_stats[i];
+
+		if (st->count == 0)
+			continue;
+
+		const double n = st->count;
+
+		printf("OP %s: %" PRIu64 " times total %.3f ms avg %.3f min %.3f max %.3f ms"
+		       " avg %.1f transfers %.1f bytes\n",
+		       op_name[i], st->count, st->time / 1000.0, st->time / n / 1000.0,
+		       st->min / 1000.0, st->max / 1000.0, st->transfers / n, st->bytes / n);
+	}
+	fflush(stdout);
+}
+
+void op_finish(void)
+{
+	if (op_enabled)
+		op_end();
+}
@@ -0,0 +1,112 @@
+/*
+ * Degraded decoding when the decoder falls behind usbmon while sniffing.
+ * Lag is wall clock time minus timestamp of the last decoded event, checked
+ * after every fetched batch. Above the sample threshold only 1 in N bulk
+ * URBs are decoded, above the count threshold bulk URBs are only counted.
+ * Control transfers are always decoded. Decoding steps back when lag stays
+ * below half of the threshold for OVERLOAD_HOLD.
+ */
+
+#define OVERLOAD_SAMPLE_LAG	200000	// usec
+#define OVERLOAD_COUNT_LAG	1000000
+#define OVERLOAD_SAMPLE		10
+#define OVERLOAD_HOLD		1000000
+
+static const char *overload_name[] = { "full", "sample", "count" };
+
+bool overload_enabled;
+uint64_t overload_sample_lag = OVERLOAD_SAMPLE_LAG;
+uint64_t overload_count_lag = OVERLOAD_COUNT_LAG;
+unsigned int overload_sample = OVERLOAD_SAMPLE;
+// Current mode and lag, read by the control socket snapshot
+static int overload_mode = RT2X00USB_BULK_FULL;
+static uint64_t overload_lag;
+// Since when lag allows a step back, 0 if it does not
+static uint64_t overload_low_since;
+static uint64_t overload_mode_start;
+static uint64_t overload_last;
+static uint64_t overload_time[ARRAY_SIZE(overload_name)];
+static uint64_t overload_changes;
+
+// "sample_ms[,count_ms]"
+int overload_parse(const char *arg)
+{
+	char *end;
+
+	overload_enabled = true;
+	if (arg == NULL)
+		return 0;
+
+	overload_sample_lag = strtod(arg, &end) * 1000;
+	if (*end == ',')
+		overload_count_lag = strtod(end + 1, &end) * 1000;
+	else if (overload_count_lag <= overload_sample_lag)
+		overload_count_lag = 5 * overload_sample_lag;
+	if (*end != '\0' || overload_sample_lag == 0 || overload_count_lag <= overload_sample_lag)
+		return -1;
+	return 0;
+}
+
+static void overload_set(int mode, uint64_t now)
+{
+	if (overload_mode_start)
+		overload_time[overload_mode] += now - overload_mode_start;
+	overload_mode_start = now;
+	overload_mode = mode;
+	overload_low_since = 0;
+	overload_changes++;
+
+	rt2x00usb_bulk_mode(decoder, mode, overload_sample);
+	if (mode == RT2X00USB_BULK_SAMPLE)
+		printf("OVERLOAD bulk decoding sample 1/%u, lag %.3f ms\n", overload_sample, overload_lag / 1000.0);
+	else
+		printf("OVERLOAD bulk decoding %s, lag %.3f ms\n", overload_name[mode], overload_lag / 1000.0);
+}
+
+// @now monotonic, @lag of the last decoded event
+void overload_check(uint64_t now, uint64_t lag)
+{
+	const uint64_t threshold = overload_mode == RT2X00USB_BULK_COUNT ? overload_count_lag : overload_sample_lag;
+
+	if (!overload_enabled)
+		return;
+
+	overload_lag = lag;
+	overload_last = now;
+	if (overload_mode_start == 0)
+		overload_mode_start = now;
+
+	if (overload_mode < RT2X00USB_BULK_COUNT) {
+		const uint64_t up = overload_mode == RT2X00USB_BULK_FULL ? overload_sample_lag : overload_count_lag;
+
+		if (lag > up) {
+			overload_set(lag > overload_count_lag ? RT2X00USB_BULK_COUNT : overload_mode + 1, now);
+			return;
+		}
+	}
+
+	if (overload_mode == RT2X00USB_BULK_FULL || lag >= threshold / 2) {
+		overload_low_since = 0;
+		return;
+	}
+	if (overload_low_since == 0)
+		overload_low_since = now;
+	else if (now - overload_low_since >= OVERLOAD_HOLD)
+		overload_set(overload_mode - 1, now);
+}
+
+void overload_report(void)
+{
+	uint64_t time[ARRAY_SIZE(overload_name)];
+
+	if (!overload_enabled || overload_mode_start == 0)
+		return;
+
+	memcpy(time, overload_time, sizeof(time));
+	time[overload_mode] += overload_last - overload_mode_start;
+
+	printf("OVERLOAD mode %s lag %.3f ms, %" PRIu64 " changes, full %.1f s sample %.1f s count %.1f s\n",
+	       overload_name[overload_mode], overload_lag / 1000.0, overload_changes,
+	       time[RT2X00USB_BULK_FULL] / 1e6, time[RT2X00USB_BULK_SAMPLE] / 1e6, time[RT2X00USB_BULK_COUNT] / 1e6);
+	fflush(stdout);
+}
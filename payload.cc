@@ -0,0 +1,110 @@
+/*
+ * Bulk payloads written to a separate binary file instead of the decoded
+ * output, which only references them by URB id, file offset and length.
+ * Data is moved to the file with vmsplice()/splice() through a pipe, without
+ * copying it via stdio. When the file does not support splicing (or the
+ * pipe can't be created) plain write() is used.
+ */
+
+#include <sys/uio.h>
+
+struct payload_file {
+	int fd;
+	int pipe[2];
+	bool splice;
+	uint64_t offset;
+};
+
+static struct payload_file payload = { -1, { -1, -1 }, false, 0 };
+
+static inline bool payload_enabled(void)
+{
+	return payload.fd != -1;
+}
+
+int payload_open(const char *name)
+{
+	if ((payload.fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+		return -1;
+
+	payload.splice = pipe(payload.pipe) == 0;
+	payload.offset = 0;
+	return 0;
+}
+
+// Return number of bytes moved to the file
+static size_t payload_splice(const unsigned char *data, size_t len)
+{
+	struct iovec iov;
+	size_t done = 0;
+
+	while (done < len) {
+		iov.iov_base = const_cast<unsigned char *>(data + done);
+		iov.iov_len = len - done;
+
+		ssize_t n = vmsplice(payload.pipe[1], &iov, 1, 0);
+		if (n <= 0)
+			break;
+
+		// Pages are only referenced by the pipe, drain it before returning
+		for (ssize_t left = n; left > 0; ) {
+			ssize_t m = splice(payload.pipe[0], NULL, payload.fd, NULL, left, SPLICE_F_MOVE);
+			if (m <= 0)
+				return done + n - left;
+			left -= m;
+		}
+		done += n;
+	}
+	return done;
+}
+
+static void payload_write_all(const unsigned char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(payload.fd, data, len);
+		if (n <= 0) {
+			fprintf(stderr, "payload file write failed: %s\n", strerror(errno));
+			return;
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+// Store payload of URB @id and print reference to it
+static void payload_write(uint64_t id, const unsigned char *data, size_t len)
+{
+	const size_t n = payload.splice ? payload_splice(data, len) : 0;
+
+	if (n != len) {
+		// Not supported by the file or pipe is stuck, fall back for good
+		if (payload.splice) {
+			close(payload.pipe[0]);
+			close(payload.pipe[1]);
+			payload.splice = false;
+		}
+		payload_write_all(data + n, len - n);
+	}
+
+	printf(" [PAYLOAD: URB %016" PRIx64 " OFFSET %" PRIu64 " LENGTH %zu]\n", id, payload.offset, len);
+	payload.offset += len;
+}
+
+void payload_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	if (ev->type == RT2X00USB_BULK)
+		payload_write(ev->hdr->id, ev->data, ev->len);
+}
+
+void payload_close(void)
+{
+	if (payload.fd == -1)
+		return;
+
+	close(payload.fd);
+	if (payload.splice) {
+		close(payload.pipe[0]);
+		close(payload.pipe[1]);
+	}
+	payload.fd = -1;
+}
@@ -0,0 +1,135 @@
+/*
+ * Busy-wait loops of the driver, like H2M_MAILBOX_CSR owner bit, BBP/RF
+ * KICK_BIT or EFUSE_CTRL checks. Loop is a run of consecutive control reads
+ * of the same register returning the same value, it ends when the value
+ * changes or with any other control transfer (driver gave up). Every read is
+ * a USB round trip, cost is compared with all control transfers.
+ */
+
+#define POLL_HIST	8	// iterations per loop, bucket n is up to 2^(n+1)
+
+struct poll_site {
+	uint64_t loops;
+	uint64_t gave_up;	// value did not change
+	uint64_t iterations;
+	uint64_t max;
+	uint64_t time;		// usec, first submission to last completion
+	uint64_t hist[POLL_HIST];
+};
+
+struct poll_run {
+	bool active;
+	uint16_t addr;
+	uint32_t value;
+	uint64_t reads;
+	uint64_t start;
+	uint64_t end;
+};
+
+bool poll_enabled;
+static std::map<uint16_t, struct poll_site> poll_sites;
+static struct poll_run poll_run;
+// All control transfers
+static uint64_t poll_ctrl_transfers;
+static uint64_t poll_ctrl_time;
+
+static int poll_bucket(uint64_t n)
+{
+	int b = 0;
+
+	while (n > (2ULL << b) && b < POLL_HIST - 1)
+		b++;
+	return b;
+}
+
+static void poll_end(bool changed)
+{
+	struct poll_run *r = &poll_run;
+
+	if (r->active && r->reads > 1) {
+		struct poll_site *s = &poll_sites[r->addr];
+
+		s->loops++;
+		if (!changed)
+			s->gave_up++;
+		s->iterations += r->reads;
+		if (r->reads > s->max)
+			s->max = r->reads;
+		s->time += r->end - r->start;
+		s->hist[poll_bucket(r->reads)]++;
+	}
+	r->active = false;
+}
+
+void poll_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	struct poll_run *r = &poll_run;
+
+	if (ev->type != RT2X00USB_COMPLETE || ev->value != XFER_TYPE_CONTROL)
+		return;
+
+	const struct usb_ctrlrequest *cr = reinterpret_cast<const struct usb_ctrlrequest *>(ev->shdr->s.setup);
+
+	poll_ctrl_transfers++;
+	poll_ctrl_time += ev->duration;
+
+	if (!(cr->bRequestType & 0x40) || !is_read_cr(cr) || ev->hdr->len_cap != 4) {
+		poll_end(false);
+		return;
+	}
+
+	const uint32_t val = decode_reg_val(get_data(ev->hdr));
+
+	if (r->active && r->addr == cr->wIndex) {
+		r->reads++;
+		r->end = ev->ts;
+		// Last read saw the change
+		if (val != r->value)
+			poll_end(true);
+		return;
+	}
+
+	poll_end(false);
+	r->active = true;
+	r->addr = cr->wIndex;
+	r->value = val;
+	r->reads = 1;
+	r->start = get_ts(ev->shdr);
+	r->end = ev->ts;
+}
+
+void poll_report(void)
+{
+	std::map<uint16_t, struct poll_site>::iterator it;
+
+	if (!poll_enabled)
+		return;
+
+	const double transfers = poll_ctrl_transfers ? poll_ctrl_transfers : 1;
+	const double time = poll_ctrl_time ? poll_ctrl_time : 1;
+
+	for (it = poll_sites.begin(); it != poll_sites.end(); ++it) {
+		struct poll_site *s = &it->second;
+		struct reg *reg = get_reg(it->first);
+		struct area *area = get_area(it->first);
+		char name[64];
+
+		if (reg)
+			snprintf(name, sizeof(name), "%s", reg->name);
+		else
+			snprintf(name, sizeof(name), "REG 0x%04x (%s)", it->first, area ? area->name : "Unknown area");
+
+		printf("POLL %s: %" PRIu64 " loops (%" PRIu64 " gave up) %.1f reads/loop max %" PRIu64
+		       " time %.3f ms, %.1f%% of control transfers %.1f%% of control time\n",
+		       name, s->loops, s->gave_up, (double) s->iterations / s->loops, s->max,
+		       s->time / 1000.0, 100.0 * s->iterations / transfers, 100.0 * s->time / time);
+
+		printf("POLL %s: reads/loop", name);
+		for (int i = 0; i < POLL_HIST; i++)
+			if (s->hist[i])
+				printf(" %s%llu:%" PRIu64, i == POLL_HIST - 1 ? ">" : "<=",
+				       i == POLL_HIST - 1 ? 1ULL << i : 2ULL << i, s->hist[i]);
+		printf("\n");
+	}
+	fflush(stdout);
+}
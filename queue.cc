@@ -0,0 +1,189 @@
+/*
+ * Bulk URBs in flight per endpoint, from the pending URB table of the
+ * decoder. Queue depth is weighted by the time it lasts, latency is from
+ * submission to completion. RX endpoint left without URBs is starved, the
+ * device has nowhere to put received frames. URBs submitted before the
+ * capture started are not known, depth is low until they are resubmitted.
+ */
+
+#define QUEUE_DEPTHS	9	// bucket 0 is empty, n is below 1 << n URBs, last is the rest
+#define QUEUE_HIST	14	// bucket n is below 32 << n usec, last is the rest
+#define QUEUE_STARVE	1000	// usec, shorter starvation is only counted
+
+struct queue_ep {
+	bool seen;
+	unsigned int depth;
+	unsigned int max;
+	uint64_t first;
+	uint64_t since;		// of the current depth
+	uint64_t area;		// depth * usec
+	uint64_t depth_time[QUEUE_DEPTHS];
+	// Latency of completed URBs
+	uint64_t urbs;
+	uint64_t errors;
+	uint64_t latency;
+	uint64_t latency_max;
+	uint64_t hist[QUEUE_HIST];
+	// Time without URBs on RX endpoint
+	bool starving;
+	uint64_t starved_since;
+	uint64_t starvations;
+	uint64_t starved_time;
+	uint64_t starved_max;
+};
+
+bool queue_enabled;
+uint64_t queue_starve = QUEUE_STARVE;
+static struct queue_ep queue_eps[256];
+static uint64_t queue_last_ts;
+
+static int queue_depth_bucket(unsigned int depth)
+{
+	int b = 0;
+
+	while (depth >= (1U << b) && b < QUEUE_DEPTHS - 1)
+		b++;
+	return b;
+}
+
+static int queue_bucket(uint64_t us)
+{
+	int b = 0;
+
+	while (us >= (32ULL << b) && b < QUEUE_HIST - 1)
+		b++;
+	return b;
+}
+
+static void queue_starved(uint8_t ep, struct queue_ep *q, uint64_t ts)
+{
+	const uint64_t t = ts - q->starved_since;
+
+	q->starving = false;
+	q->starvations++;
+	q->starved_time += t;
+	if (t > q->starved_max)
+		q->starved_max = t;
+	if (t >= queue_starve)
+		printf("QUEUE %" PRIu64 ".%06" PRIu64 ": BULK%d RX starved for %.3f ms\n",
+		       q->starved_since / 1000000, q->starved_since % 1000000, ep & 0x7f, t / 1000.0);
+}
+
+// Depth of @ep changes to @depth at @ts
+static void queue_set(uint8_t ep, uint64_t ts, unsigned int depth)
+{
+	struct queue_ep *q = &queue_eps[ep];
+
+	if (q->seen) {
+		const uint64_t dt = ts - q->since;
+
+		q->area += q->depth * dt;
+		q->depth_time[queue_depth_bucket(q->depth)] += dt;
+	} else {
+		q->seen = true;
+		q->first = ts;
+	}
+
+	if (ep & USB_DIR_IN) {
+		if (q->depth && depth == 0) {
+			q->starving = true;
+			q->starved_since = ts;
+		} else if (q->starving && depth) {
+			queue_starved(ep, q, ts);
+		}
+	}
+
+	q->since = ts;
+	q->depth = depth;
+	if (depth > q->max)
+		q->max = depth;
+}
+
+void queue_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	struct queue_ep *q;
+
+	queue_last_ts = ev->ts;
+
+	switch (ev->type) {
+	case RT2X00USB_SUBMIT:
+		if (ev->value == XFER_TYPE_BULK)
+			queue_set(ev->addr, ev->ts, ev->arg[0]);
+		break;
+	case RT2X00USB_COMPLETE:
+		if (ev->value != XFER_TYPE_BULK)
+			break;
+		queue_set(ev->addr, ev->ts, ev->arg[1]);
+
+		q = &queue_eps[ev->addr];
+		q->urbs++;
+		if (ev->arg[0])
+			q->errors++;
+		q->latency += ev->duration;
+		if (ev->duration > q->latency_max)
+			q->latency_max = ev->duration;
+		q->hist[queue_bucket(ev->duration)]++;
+		break;
+	case RT2X00USB_REENUM:
+		// Pending URBs are gone with the device, not a starvation
+		for (int ep = 0; ep < 256; ep++) {
+			if (!queue_eps[ep].seen)
+				continue;
+			queue_set(ep, ev->ts, 0);
+			queue_eps[ep].starving = false;
+		}
+		break;
+	}
+}
+
+void queue_report(void)
+{
+	if (!queue_enabled)
+		return;
+
+	for (int ep = 0; ep < 256; ep++) {
+		struct queue_ep *q = &queue_eps[ep];
+		const bool in = ep & USB_DIR_IN;
+
+		if (!q->seen)
+			continue;
+
+		// Up to the end of the capture
+		queue_set(ep, queue_last_ts, q->depth);
+		const uint64_t span = q->since - q->first;
+
+		printf("QUEUE BULK%d %s: %" PRIu64 " URBs %" PRIu64 " errors, depth avg %.2f max %u,"
+		       " latency avg %.3f max %.3f ms\n",
+		       ep & 0x7f, in ? "IN" : "OUT", q->urbs, q->errors, span ? (double) q->area / span : 0.0,
+		       q->max, q->urbs ? q->latency / 1000.0 / q->urbs : 0.0, q->latency_max / 1000.0);
+
+		printf("QUEUE BULK%d %s: depth", ep & 0x7f, in ? "IN" : "OUT");
+		for (int i = 0; i < QUEUE_DEPTHS; i++) {
+			if (q->depth_time[i] == 0)
+				continue;
+			if (i == 0)
+				printf(" 0");
+			else if (i == QUEUE_DEPTHS - 1)
+				printf(" >=%u", 1U << (i - 1));
+			else if (i == 1)
+				printf(" 1");
+			else
+				printf(" %u-%u", 1U << (i - 1), (1U << i) - 1);
+			printf(":%.1f%%", span ? 100.0 * q->depth_time[i] / span : 0.0);
+		}
+		printf("\n");
+
+		printf("QUEUE BULK%d %s: latency", ep & 0x7f, in ? "IN" : "OUT");
+		for (int i = 0; i < QUEUE_HIST; i++)
+			if (q->hist[i])
+				printf(" %s%lluus:%" PRIu64, i == QUEUE_HIST - 1 ? ">=" : "<",
+				       i == QUEUE_HIST - 1 ? 16ULL << i : 32ULL << i, q->hist[i]);
+		printf("\n");
+
+		if (in && (q->starvations || q->starving))
+			printf("QUEUE BULK%d IN: starved %" PRIu64 " times %.3f ms max %.3f ms%s\n",
+			       ep & 0x7f, q->starvations, q->starved_time / 1000.0, q->starved_max / 1000.0,
+			       q->starving ? ", starved at the end" : "");
+	}
+	fflush(stdout);
+}
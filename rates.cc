@@ -0,0 +1,115 @@
+/*
+ * Rate adaptation timeline: PHYMODE/MCS/BW/SHORT_GI/STBC used per WCID and
+ * direction, recorded only when it changes. TXWI_W0 and RXWI_W1 have these
+ * fields at the same bit positions.
+ */
+
+#define RATE_MAGIC	"RT2XRATE"
+#define RATE_MASK	0xc7ff0000
+
+struct rate_state {
+	bool valid;
+	uint32_t word;		// TXWI_W0/RXWI_W1 masked by RATE_MASK
+	uint32_t frames;	// sent or received with this rate
+};
+
+// Binary export record, host endian
+struct rate_record {
+	uint64_t ts;
+	uint32_t frames;	// with previous rate
+	uint8_t wcid;
+	uint8_t rx;
+	uint8_t phymode;
+	uint8_t mcs;
+	uint8_t bw;
+	uint8_t sgi;
+	uint8_t stbc;
+	uint8_t reserved;
+};
+
+bool rate_print;
+FILE *f_rate_csv;
+FILE *f_rate_bin;
+static struct rate_state rate_state[2][MAX_WCID];
+
+static inline bool rate_enabled(void)
+{
+	return rate_print || f_rate_csv || f_rate_bin;
+}
+
+int rate_open_csv(const char *name)
+{
+	if ((f_rate_csv = fopen(name, "w")) == NULL)
+		return -1;
+	fprintf(f_rate_csv, "ts,wcid,dir,phymode,mcs,bw,sgi,stbc,prev_frames\n");
+	return 0;
+}
+
+int rate_open_bin(const char *name)
+{
+	uint32_t size = sizeof(struct rate_record);
+
+	if ((f_rate_bin = fopen(name, "w")) == NULL)
+		return -1;
+	fwrite(RATE_MAGIC, 8, 1, f_rate_bin);
+	fwrite(&size, sizeof(size), 1, f_rate_bin);
+	return 0;
+}
+
+static void rate_transition(uint64_t ts, int wcid, bool rx, uint32_t word, uint32_t frames)
+{
+	static const char *phymode_name[] = { "CCK", "OFDM", "HT_MIX", "HT_GF" };
+	struct rate_record r;
+
+	r.ts = ts;
+	r.frames = frames;
+	r.wcid = wcid;
+	r.rx = rx;
+	r.phymode = word >> 30;
+	r.stbc = (word >> 25) & 0x3;
+	r.sgi = (word >> 24) & 0x1;
+	r.bw = (word >> 23) & 0x1;
+	r.mcs = (word >> 16) & 0x7f;
+	r.reserved = 0;
+
+	if (rate_print)
+		printf("RATE %" PRIu64 ".%06" PRIu64 " WCID %d %s: %s MCS %u BW %u SHORT_GI %u STBC %u (after %u frames)\n",
+		       ts / 1000000, ts % 1000000, wcid, rx ? "RX" : "TX", phymode_name[r.phymode],
+		       r.mcs, r.bw, r.sgi, r.stbc, frames);
+	if (f_rate_csv)
+		fprintf(f_rate_csv, "%" PRIu64 ".%06" PRIu64 ",%d,%s,%s,%u,%u,%u,%u,%u\n",
+			ts / 1000000, ts % 1000000, wcid, rx ? "rx" : "tx", phymode_name[r.phymode],
+			r.mcs, r.bw, r.sgi, r.stbc, frames);
+	if (f_rate_bin)
+		fwrite(&r, sizeof(r), 1, f_rate_bin);
+}
+
+// @word is TXWI_W0 or RXWI_W1
+static void rate_frame(uint64_t ts, int wcid, bool rx, uint32_t word)
+{
+	struct rate_state *st = &rate_state[rx][wcid];
+
+	word &= RATE_MASK;
+	if (!st->valid || st->word != word) {
+		rate_transition(ts, wcid, rx, word, st->frames);
+		st->valid = true;
+		st->word = word;
+		st->frames = 0;
+	}
+	st->frames++;
+}
+
+void rate_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	if (ev->type == RT2X00USB_TX_FRAME || ev->type == RT2X00USB_RX_FRAME)
+		rate_frame(ev->ts, ev->addr, ev->type == RT2X00USB_RX_FRAME, ev->value);
+}
+
+void rate_close(void)
+{
+	if (f_rate_csv)
+		fclose(f_rate_csv);
+	if (f_rate_bin)
+		fclose(f_rate_bin);
+	f_rate_csv = f_rate_bin = NULL;
+}
@@ -0,0 +1,379 @@
+/*
+ * Flight recorder. Raw events are kept in a preallocated ring limited by
+ * memory, number of events and age, nothing is printed. When a trigger
+ * fires, the ring (pre-trigger window) is written to a new capture file,
+ * followed by events of the post-trigger window. Captures are decoded later
+ * with -f. Triggers are register field values, decoder warnings, URB errors,
+ * bursts of RXD CRC errors and SIGUSR2.
+ */
+
+#include <stdarg.h>
+
+#define REC_SIZE		(64 << 20)	// bytes
+#define REC_WINDOW		10000000	// usec
+#define REC_POST		2000000
+#define REC_CRC_COUNT		5
+#define REC_CRC_WINDOW		100000
+#define REC_MAX_TRIGGERS	16
+#define REC_MAX_CRC		64
+
+enum RecTrigger {
+	REC_FIELD,
+	REC_WARN,
+	REC_STATUS,
+	REC_CRC,
+};
+
+struct rec_trigger {
+	int type;
+	struct reg *reg;
+	const struct field *field;	// NULL for whole register
+	uint32_t value;
+	bool known;			// last value seen
+	uint32_t last;
+	// CRC errors: count within window usec
+	unsigned int count;
+	uint64_t window;
+	uint64_t crc_ts[REC_MAX_CRC];	// ring of last errors
+	unsigned int crc_n;
+};
+
+// Record is the length aligned to 8 bytes, followed by the usbmon event
+struct rec_ring {
+	char *buf;
+	size_t size;
+	size_t head;		// next record, wraps before tail if below it
+	size_t tail;		// oldest record
+	size_t end;		// end of records before wrapping
+	uint64_t events;
+};
+
+const char *rec_name;
+uint64_t rec_size = REC_SIZE;
+uint64_t rec_max_events;	// 0 is no limit
+uint64_t rec_window = REC_WINDOW;
+uint64_t rec_post = REC_POST;
+static struct rec_ring rec_ring;
+static struct rec_trigger rec_triggers[REC_MAX_TRIGGERS];
+static int rec_n_triggers;
+// Trigger fired by the event being decoded
+static char rec_reason[128];
+static volatile sig_atomic_t rec_signal;
+// Capture of the post-trigger window being written
+static FILE *rec_fp;
+static uint64_t rec_post_end;
+static unsigned int rec_files;
+
+static inline bool rec_enabled(void)
+{
+	return rec_name != NULL;
+}
+
+// "10s" is ten seconds, "1000" is a thousand events
+int rec_parse_window(const char *arg)
+{
+	char *end;
+	double n = strtod(arg, &end);
+
+	if (n <= 0)
+		return -1;
+	if (*end == 's' && end[1] == '\0') {
+		rec_window = n * 1000000;
+		rec_max_events = 0;
+	} else if (*end == '\0') {
+		rec_max_events = n;
+		rec_window = 0;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+// "warn", "status", "crc[=count[/ms]]" or "REG[.FIELD]=value"
+int rec_parse_trigger(const char *arg)
+{
+	struct rec_trigger *t = &rec_triggers[rec_n_triggers];
+	char name[64], *dot, *end;
+	const char *eq;
+
+	if (rec_n_triggers == REC_MAX_TRIGGERS)
+		return -1;
+	memset(t, 0, sizeof(*t));
+
+	if (!strcmp(arg, "warn")) {
+		t->type = REC_WARN;
+	} else if (!strcmp(arg, "status")) {
+		t->type = REC_STATUS;
+	} else if (!strncmp(arg, "crc", 3) && (arg[3] == '\0' || arg[3] == '=')) {
+		t->type = REC_CRC;
+		t->count = REC_CRC_COUNT;
+		t->window = REC_CRC_WINDOW;
+		if (arg[3] == '=') {
+			t->count = strtoul(arg + 4, &end, 0);
+			if (*end == '/')
+				t->window = strtod(end + 1, &end) * 1000;
+			if (*end != '\0' || t->count == 0 || t->count > REC_MAX_CRC || t->window == 0)
+				return -1;
+		}
+	} else {
+		if ((eq = strchr(arg, '=')) == NULL || eq - arg >= (int) sizeof(name))
+			return -1;
+		snprintf(name, sizeof(name), "%.*s", (int) (eq - arg), arg);
+		if ((dot = strchr(name, '.')))
+			*dot++ = '\0';
+
+		t->type = REC_FIELD;
+		if ((t->reg = find_reg(name)) == NULL)
+			return -1;
+		for (int i = 0; dot && i < t->reg->n_fields; i++)
+			if (!strcmp(t->reg->fields[i].name, dot))
+				t->field = &t->reg->fields[i];
+		if (dot && t->field == NULL)
+			return -1;
+		t->value = strtoul(eq + 1, &end, 0);
+		if (*end != '\0')
+			return -1;
+	}
+
+	rec_n_triggers++;
+	return 0;
+}
+
+static void rec_sigusr2(int sig)
+{
+	rec_signal = 1;
+}
+
+int rec_start(void)
+{
+	rec_ring.buf = static_cast<char *>(malloc(rec_size));
+	if (rec_ring.buf == NULL)
+		return -1;
+	// Fault the pages in now, not while events are coming
+	memset(rec_ring.buf, 0, rec_size);
+	rec_ring.size = rec_size;
+	signal(SIGUSR2, rec_sigusr2);
+	return 0;
+}
+
+static inline uint32_t rec_len(size_t pos)
+{
+	return *reinterpret_cast<uint32_t *>(rec_ring.buf + pos);
+}
+
+static inline struct usbmon_packet *rec_event(size_t pos)
+{
+	return reinterpret_cast<struct usbmon_packet *>(rec_ring.buf + pos + 8);
+}
+
+static void rec_pop(void)
+{
+	struct rec_ring *r = &rec_ring;
+	const bool wrapped = r->head < r->tail;
+
+	r->tail += rec_len(r->tail);
+	if (wrapped && r->tail == r->end)
+		r->tail = 0;
+	if (--r->events == 0)
+		r->head = r->tail = 0;
+}
+
+static void rec_reset(void)
+{
+	rec_ring.head = rec_ring.tail = 0;
+	rec_ring.events = 0;
+}
+
+// Store event, oldest are dropped for space, number and age limits
+static void rec_push(const struct usbmon_packet *hdr)
+{
+	struct rec_ring *r = &rec_ring;
+	const size_t len = sizeof(*hdr) + hdr->len_cap;
+	const size_t need = (8 + len + 7) & ~7UL;
+	const uint64_t ts = get_ts(hdr);
+	size_t pos;
+
+	if (need > r->size / 2)
+		return;
+
+	while (r->events && ((rec_max_events && r->events >= rec_max_events) ||
+			     (rec_window && ts - get_ts(rec_event(r->tail)) > rec_window)))
+		rec_pop();
+
+	for (;;) {
+		if (r->events == 0)
+			r->head = r->tail = 0;
+		if (r->head >= r->tail && r->head + need <= r->size) {
+			pos = r->head;
+			break;
+		}
+		if (r->head >= r->tail && need < r->tail) {
+			r->end = r->head;
+			pos = 0;
+			break;
+		}
+		if (r->head < r->tail && r->head + need < r->tail) {
+			pos = r->head;
+			break;
+		}
+		rec_pop();
+	}
+
+	*reinterpret_cast<uint32_t *>(r->buf + pos) = need;
+	memcpy(r->buf + pos + 8, hdr, len);
+	r->head = pos + need;
+	r->events++;
+}
+
+static void rec_fire(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+static void rec_fire(const char *fmt, ...)
+{
+	va_list ap;
+
+	// First trigger of the event wins
+	if (rec_reason[0])
+		return;
+	va_start(ap, fmt);
+	vsnprintf(rec_reason, sizeof(rec_reason), fmt, ap);
+	va_end(ap);
+}
+
+static uint32_t rec_field(const struct rec_trigger *t, uint32_t val)
+{
+	const struct field *f = t->field;
+
+	if (f == NULL)
+		return val;
+	return (val >> f->first) & (0xffffffffU >> (31 - f->last + f->first));
+}
+
+// 32-bit value of the register after the event, if known
+static bool rec_mac_value(const struct rt2x00usb_event *ev, uint16_t offset, uint32_t *val)
+{
+	const struct shadow_regs *s = rt2x00usb_shadow(decoder);
+
+	if (ev->arg[0] == 4) {
+		*val = ev->value;
+		return ev->addr == offset;
+	}
+	// 16-bit write, the other half from the shadow
+	if ((ev->addr != offset && ev->addr != offset + 2) || offset / 2 + 1 >= MAX_MAC_SHADOW ||
+	    !is_known(s->mac_known, offset / 2) || !is_known(s->mac_known, offset / 2 + 1))
+		return false;
+	*val = s->mac[offset / 2] | s->mac[offset / 2 + 1] << 16;
+	return true;
+}
+
+static void rec_check(struct rec_trigger *t, const struct rt2x00usb_event *ev)
+{
+	uint32_t val, rxd;
+
+	switch (t->type) {
+	case REC_FIELD:
+		if ((ev->type != RT2X00USB_MAC_READ && ev->type != RT2X00USB_MAC_WRITE) ||
+		    !rec_mac_value(ev, t->reg->offset, &val))
+			return;
+		val = rec_field(t, val);
+		if (val == t->value && (!t->known || t->last != val))
+			rec_fire("%s%s%s = 0x%x", t->reg->name, t->field ? "." : "", t->field ? t->field->name : "", val);
+		t->known = true;
+		t->last = val;
+		break;
+	case REC_WARN:
+		if (ev->type == RT2X00USB_WARN)
+			rec_fire("WARN %u: %s", ev->value, ev->msg);
+		break;
+	case REC_STATUS:
+		if (ev->type == RT2X00USB_COMPLETE && ev->arg[0])
+			rec_fire("URB status %d on endpoint %02x", (int) ev->arg[0], ev->addr);
+		break;
+	case REC_CRC:
+		if (ev->type != RT2X00USB_RX_FRAME)
+			return;
+		rxd = decode_reg_val(ev->data + ev->len - 4);
+		if (!(rxd & 0x00000100))	// CRC_ERROR
+			return;
+		t->crc_ts[t->crc_n++ % REC_MAX_CRC] = ev->ts;
+		if (t->crc_n < t->count)
+			return;
+		val = ev->ts - t->crc_ts[(t->crc_n - t->count) % REC_MAX_CRC];
+		if (val <= t->window)
+			rec_fire("%u CRC errors in %.3f ms", t->count, val / 1000.0);
+		break;
+	}
+}
+
+void rec_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	for (int i = 0; i < rec_n_triggers; i++)
+		rec_check(&rec_triggers[i], ev);
+}
+
+static void rec_close(void)
+{
+	fclose(rec_fp);
+	rec_fp = NULL;
+	// Written out already, next capture starts after it
+	rec_reset();
+}
+
+// Write the ring to a new capture, post-trigger window follows
+static void rec_dump(const struct usbmon_packet *hdr)
+{
+	struct rec_ring *r = &rec_ring;
+	char name[PATH_MAX];
+	size_t pos = r->tail;
+
+	snprintf(name, sizeof(name), "%s.%u", rec_name, rec_files++);
+	if ((rec_fp = capture_create(name)) == NULL) {
+		fprintf(stderr, "fail to open file %s\n", name);
+		return;
+	}
+
+	printf("RECORD %" PRIu64 ".%06" PRIu64 " %s: %s with %" PRIu64 " events before\n",
+	       get_ts(hdr) / 1000000, get_ts(hdr) % 1000000, rec_reason, name, r->events);
+	fflush(stdout);
+
+	for (uint64_t i = 0; i < r->events; i++) {
+		capture_write(rec_fp, rec_event(pos));
+		pos += rec_len(pos);
+		if (r->head < r->tail && pos == r->end)
+			pos = 0;
+	}
+	rec_post_end = get_ts(hdr) + rec_post;
+}
+
+// Called with every event, before it is decoded
+void rec_event_start(struct usbmon_packet *hdr)
+{
+	if (rec_fp && get_ts(hdr) > rec_post_end)
+		rec_close();
+
+	if (rec_fp)
+		capture_write(rec_fp, hdr);
+	else
+		rec_push(hdr);
+}
+
+// Called after the event was decoded, triggers it fired are handled
+void rec_event_end(struct usbmon_packet *hdr)
+{
+	if (rec_signal) {
+		rec_signal = 0;
+		rec_fire("SIGUSR2");
+	}
+	if (rec_reason[0] == '\0')
+		return;
+
+	// Triggers during post-trigger window are in the same capture
+	if (rec_fp == NULL)
+		rec_dump(hdr);
+	rec_reason[0] = '\0';
+}
+
+void rec_finish(void)
+{
+	if (rec_fp)
+		rec_close();
+}
@@ -0,0 +1,113 @@
+/*
+ * Following the device when it is re-enumerated (reset by the driver or
+ * re-plugged) and gets a new address.
+ *
+ * On the same bus the new address is found in the usbmon stream itself,
+ * from the device descriptor read by the hub driver, so no event of the new
+ * device is lost. Netlink uevents and periodic rescans of sysfs catch the
+ * other cases, e.g. the device moved to another bus.
+ */
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#define RESCAN_INTERVAL_MS	1000
+
+#define USB_REQ_GET_DESCRIPTOR	0x06
+#define USB_DT_DEVICE		0x01
+
+// Root of sysfs USB devices, can be a fake tree for testing
+const char *sysfs_root = SYSBASE;
+
+struct enum_watch {
+	uint16_t vid;
+	uint16_t pid;
+	// Pending device descriptor reads of other devices on the bus
+	std::map<uint64_t, int> get_desc;
+};
+
+static struct enum_watch enum_watch;
+
+void enum_watch_init(const char *vidpid)
+{
+	enum_watch.vid = strtol(vidpid, NULL, 16);
+	enum_watch.pid = strtol(vidpid + 5, NULL, 16);
+	enum_watch.get_desc.clear();
+}
+
+/*
+ * Called for events of other devices on the bus. Return address of our
+ * device when its descriptor was just read from a new address, else 0.
+ */
+int enum_event(struct usbmon_packet *hdr)
+{
+	struct usb_ctrlrequest *cr = reinterpret_cast<struct usb_ctrlrequest *>(hdr->s.setup);
+	std::map<uint64_t, int>::iterator it;
+
+	if (hdr->xfer_type != XFER_TYPE_CONTROL || (hdr->epnum & 0x7f) != 0)
+		return 0;
+
+	if (hdr->type == 'S') {
+		if (hdr->flag_setup == 0 && cr->bRequestType == 0x80 &&
+		    cr->bRequest == USB_REQ_GET_DESCRIPTOR && (cr->wValue >> 8) == USB_DT_DEVICE)
+			enum_watch.get_desc[hdr->id] = hdr->devnum;
+		return 0;
+	}
+
+	if ((it = enum_watch.get_desc.find(hdr->id)) == enum_watch.get_desc.end())
+		return 0;
+
+	const int devnum = it->second;
+	enum_watch.get_desc.erase(it);
+
+	// Address 0 is used only before SET_ADDRESS
+	if (hdr->type != 'C' || hdr->status != 0 || hdr->len_cap < 12 || devnum == 0)
+		return 0;
+
+	unsigned char *desc = get_data(hdr);
+	if ((desc[8] | desc[9] << 8) != enum_watch.vid || (desc[10] | desc[11] << 8) != enum_watch.pid)
+		return 0;
+
+	return devnum;
+}
+
+int uevent_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT)) < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	// kernel events
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Drain pending uevents, return true if an USB device was added or removed
+bool uevent_usb_changed(int fd)
+{
+	char buf[4096];
+	bool changed = false;
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		bool usb_device = false, add_remove = false;
+
+		buf[len] = '\0';
+		for (char *p = buf; p < buf + len; p += strlen(p) + 1) {
+			if (!strcmp(p, "DEVTYPE=usb_device"))
+				usb_device = true;
+			else if (!strcmp(p, "ACTION=add") || !strcmp(p, "ACTION=remove"))
+				add_remove = true;
+		}
+		changed |= usb_device && add_remove;
+	}
+	return changed;
+}
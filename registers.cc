@@ -1,16 +1,5 @@
 #include <inttypes.h>
 
-#ifndef ARRAY_SIZE
-#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
-#endif
-
-struct area {
-	uint16_t begin;
-	uint16_t end;
-	const char *name;
-	//void (*print_data)(uint16_t offset);
-};
-
 struct area areas_array[] =  {
 	{ 0x0000, 0x17ff, "MAC REGISTERS" },
 	{ 0x1800, 0x1fff, "WCID search table" },
@@ -36,19 +25,6 @@ struct area *get_area(uint16_t offset)
 	return NULL;
 }
 
-struct field {
-	uint8_t last;
-	uint8_t first;
-	const char *name;
-};
-
-struct reg {
-	uint16_t offset;
-	const char *name;
-	int n_fields;
-	struct field fields[32];
-};
-
 struct reg regs_array[] = {
 	{ 0x010c, "AUX_CTRL", 0, { } },
 	{ 0x0200, "INT_STATUS", 0, { } },
@@ -905,6 +881,17 @@ struct reg *get_reg(uint16_t offset)
 	return NULL;
 }
 
+struct reg *find_reg(const char *name)
+{
+	const int n = ARRAY_SIZE(regs_array);
+
+	for (int i = 0; i < n; i++) {
+		if (!strcasecmp(regs_array[i].name, name))
+			return &regs_array[i];
+	}
+	return NULL;
+}
+
 void regs_array_self_test(void)
 {
 	const int n = ARRAY_SIZE(regs_array);
@@ -933,7 +920,7 @@ void regs_array_self_test(void)
 	}
 }
 
-void print_reg_content(struct reg *reg, uint32_t val, int32_t include = 0xffffffff)
+void print_reg_content(struct reg *reg, uint32_t val, int32_t include)
 {
 	for (int i = reg->n_fields - 1; i >= 0; i--) {
 		struct field *f = &reg->fields[i];
@@ -944,13 +931,13 @@ void print_reg_content(struct reg *reg, uint32_t val, int32_t include = 0xffffff
 	}	
 }
 
-uint32_t decode_reg_val(unsigned char *buf)
+uint32_t decode_reg_val(const unsigned char *buf)
 {
 	// Little endian
 	return buf[3] << 24 | buf[2] << 16 | buf [1] << 8 | buf[0];
 }
 
-void print_buf_reg(struct reg *reg, unsigned char *buf)
+void print_buf_reg(struct reg *reg, const unsigned char *buf)
 {
 	uint32_t val = decode_reg_val(buf);
 
@@ -959,8 +946,6 @@ void print_buf_reg(struct reg *reg, unsigned char *buf)
 	printf("]\n");
 }
 
-enum Content { Full, UpperHalf, LowerHalf };
-
 void print_reg(struct reg *reg, uint32_t val, bool read, Content content)
 {
 	const char *dir1 = read ? "<-" : "->";
@@ -996,9 +981,6 @@ struct special_reg {
 	bool write_is_1; // RW_BIT meaning:
 			 // 	true:  1 is write, 0 is read.
 			 // 	false: 0 is write, 1 is read.
-	enum SpecialRegState state;
-	uint8_t cur_addr;
-	uint8_t cur_data;
 };
 
 #define BBP_SPECIAL_ADDR	0x101c
@@ -1017,11 +999,3 @@ struct special_reg reg_rf = {
 	ADDR_MASK: 0x00003f00,
 	write_is_1: true,
 };
-
-static inline void print_special_reg(struct special_reg *reg, bool read)
-{
-	const char *dir1 = read ? "<-" : "->";
-	const char *dir2 = read ? "[READ]" : "[WRITE]";
-
-	printf("0x%02x %s %s REG%u\t%s\n", reg->cur_data, dir1, reg->name, reg->cur_addr, dir2);
-}
@@ -0,0 +1,309 @@
+/*
+ * rt2x00 USB traffic decoder library.
+ *
+ * A decoder context takes raw usbmon events, matches submissions with
+ * completions and follows the indirect BBP/RF/MCU accesses. Decoded events
+ * are delivered as structures to registered callbacks, nothing is printed.
+ * Contexts are independent, any number of decoders can run in one process.
+ */
+
+#ifndef RT2X00USB_H
+#define RT2X00USB_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <linux/types.h>
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+#endif
+
+#define USB_DIR_IN	0x80
+
+/* this was taken from usbmon.txt in the kernel documentation */
+#define SETUP_LEN 8
+struct usbmon_packet {
+	uint64_t id;			/* 0: URB ID - from submission to callback */
+	unsigned char type;		/* 8: Same as text; extensible. */
+	unsigned char xfer_type;/* ISO (0), Intr, Control, Bulk (3) */
+	unsigned char epnum;	/* Endpoint number and transfer direction */
+	unsigned char devnum;	/* Device address */
+	uint16_t busnum;		/* 12: Bus number */
+	char flag_setup;		/* 14: Same as text */
+	char flag_data;			/* 15: Same as text; Binary zero is OK. */
+	int64_t ts_sec;			/* 16: gettimeofday */
+	int32_t ts_usec;		/* 24: gettimeofday */
+	int status;				/* 28: */
+	unsigned int length;	/* 32: Length of data (submitted or actual) */
+	unsigned int len_cap;	/* 36: Delivered length */
+	union {					/* 40: */
+		unsigned char setup[SETUP_LEN]; /* Only for Control S-type */
+		struct iso_rec {	/* Only for ISO */
+			int error_count;
+			int numdesc;
+		} iso;
+	} s;
+	int interval;			/* 48: Only for Interrupt and ISO */
+	int start_frame;		/* 52: For ISO */
+	unsigned int xfer_flags;/* 56: copy of URB's transfer_flags */
+	unsigned int ndesc;		/* 60: Actual number of ISO descriptors */
+};							/* 64 total length */
+
+// Not from usbmon, written to captures when usbmon lost events and when
+// device got new address, length is number of lost events or old address
+#define EVENT_DROP		'D'
+#define EVENT_REENUM		'R'
+
+#define XFER_TYPE_ISO		0
+#define XFER_TYPE_INTERRUPT	1
+#define XFER_TYPE_CONTROL	2
+#define XFER_TYPE_BULK		3
+
+struct usb_ctrlrequest {
+        __u8 bRequestType;
+        __u8 bRequest;
+        __le16 wValue;
+        __le16 wIndex;
+        __le16 wLength;
+} __attribute__ ((packed));
+
+static inline bool is_read_cr(const struct usb_ctrlrequest *cr)
+{
+	return (cr->bRequestType & 0x80);
+}
+
+static inline unsigned char *get_data(struct usbmon_packet *hdr)
+{
+	return reinterpret_cast<unsigned char *>(hdr) + sizeof(struct usbmon_packet);
+}
+
+static inline const unsigned char *get_data(const struct usbmon_packet *hdr)
+{
+	return reinterpret_cast<const unsigned char *>(hdr) + sizeof(struct usbmon_packet);
+}
+
+// Timestamp in microseconds
+static inline uint64_t get_ts(const struct usbmon_packet *hdr)
+{
+	return hdr->ts_sec * 1000000ULL + hdr->ts_usec;
+}
+
+/* Register database, see registers.cc */
+
+struct area {
+	uint16_t begin;
+	uint16_t end;
+	const char *name;
+	//void (*print_data)(uint16_t offset);
+};
+
+struct field {
+	uint8_t last;
+	uint8_t first;
+	const char *name;
+};
+
+struct reg {
+	uint16_t offset;
+	const char *name;
+	int n_fields;
+	struct field fields[32];
+};
+
+// TX/RX descriptors in bulk transfers
+extern struct reg txinfo, txwi_w0, txwi_w1;
+extern struct reg rxinfo, rxwi_w0, rxwi_w1, rxwi_w2, rxwi_w3, rxd;
+
+enum Content { Full, UpperHalf, LowerHalf };
+
+struct area *get_area(uint16_t offset);
+struct reg *get_reg(uint16_t offset);
+struct reg *find_reg(const char *name);
+void regs_array_self_test(void);
+uint32_t decode_reg_val(const unsigned char *buf);
+void print_reg_content(struct reg *reg, uint32_t val, int32_t include = 0xffffffff);
+void print_buf_reg(struct reg *reg, const unsigned char *buf);
+void print_reg(struct reg *reg, uint32_t val, bool read, Content content);
+
+/* Decoder state */
+
+#define MAX_MAC_REG	(0x8000 / 2)
+#define MAX_RF_REG	255
+#define MAX_BBP_REG	255
+
+// Last known values of registers, as written or read by the driver
+#define MAX_MAC_SHADOW	(0x1800 / 2)
+
+#define MAX_BBP_RF_SHADOW	256	// any 8-bit address read back
+
+struct shadow_regs {
+	uint16_t mac[MAX_MAC_SHADOW];
+	uint8_t bbp[MAX_BBP_RF_SHADOW];
+	uint8_t rf[MAX_BBP_RF_SHADOW];
+	uint8_t mac_known[MAX_MAC_SHADOW / 8];
+	uint8_t bbp_known[MAX_BBP_RF_SHADOW / 8];
+	uint8_t rf_known[MAX_BBP_RF_SHADOW / 8];
+};
+
+static inline bool is_known(const uint8_t *bitmap, int nr)
+{
+	return bitmap[nr / 8] & (1 << (nr % 8));
+}
+
+// State machines of indirect accesses, kept between control transfers
+struct mcu_state {
+	int state;
+	uint8_t command;
+	uint8_t owner;
+	uint8_t token;
+	uint8_t arg0;
+	uint8_t arg1;
+};
+
+struct h2m_bbp_state {
+	int state;
+	bool is_read;
+	uint8_t cur_addr;
+	uint8_t cur_data;
+};
+
+struct special_reg_state {
+	int state;
+	uint8_t cur_addr;
+	uint8_t cur_data;
+};
+
+// Firmware upload being reassembled, see firmware.cc
+struct fw_upload {
+	uint64_t start;
+	uint64_t end;
+	uint32_t active;
+	uint32_t size;		// highest offset written
+	uint32_t bytes;		// total bytes written
+	uint32_t transfers;
+	unsigned char image[0x1000];	// size of the area
+};
+
+// Lower half of a register written with wValue, waiting for the upper half
+struct half_write {
+	uint64_t ts;
+	uint32_t active;
+	uint16_t addr;
+	uint16_t value;
+	// COMPLETE of the URB is held too, delivered after the write
+	uint32_t complete;
+	uint32_t inflight;
+	struct usbmon_packet shdr;
+	struct usbmon_packet hdr;
+};
+
+// Plain data, can be stored in files and compared with memcmp()
+struct decoder_state {
+	struct mcu_state mcu;
+	struct h2m_bbp_state h2m_bbp;
+	struct special_reg_state bbp;
+	struct special_reg_state rf;
+	struct fw_upload fw;
+	struct half_write half;
+};
+
+/* Decoded events */
+
+enum rt2x00usb_event_type {
+	RT2X00USB_MAC_READ = 1,		// addr, value, arg[0] size in bytes
+	RT2X00USB_MAC_WRITE,		// addr, value, arg[0] size in bytes, 2 for value in wValue,
+					// arg[1] 2 if merged from two wValue writes, duration
+	RT2X00USB_MAC_DATA_READ,	// addr, data: other than 32-bit access to registers
+	RT2X00USB_MAC_DATA_WRITE,
+	RT2X00USB_BBP_READ,		// addr, value
+	RT2X00USB_BBP_WRITE,
+	RT2X00USB_RF_READ,
+	RT2X00USB_RF_WRITE,
+	RT2X00USB_MCU_COMMAND,		// addr command, value token, arg[0] arg0, arg[1] arg1
+	RT2X00USB_AREA_READ,		// addr, data: memory outside of registers
+	RT2X00USB_AREA_WRITE,
+	RT2X00USB_AREA_WRITE_VALUE,	// addr, value from wValue
+	RT2X00USB_FIRMWARE,		// data image, value size, arg[0] crc32, arg[1] transfers,
+					// arg[2] bytes written, duration
+	RT2X00USB_CTRL,			// data: not vendor request, setup in shdr
+	RT2X00USB_BULK,			// addr endpoint, data
+	RT2X00USB_TX_FRAME,		// addr WCID, value TXWI_W0, arg[0] frame number in URB,
+					// arg[1] MPDU bytes, arg[2] TXWI_W1, data from TXINFO
+	RT2X00USB_RX_FRAME,		// addr WCID, value RXWI_W1, arg[0] frame number in URB,
+					// arg[1] MPDU bytes, arg[2] RXWI_W2, data from RXINFO to RXD
+	RT2X00USB_BULK_END,		// addr endpoint, len, arg[0] frames, arg[1] MPDU bytes,
+					// arg[2] descriptor bytes
+	RT2X00USB_URB,			// transfer of other type
+	RT2X00USB_DROP,			// value lost usbmon events, decoder state was reset
+	RT2X00USB_REENUM,		// addr new address, value old address, arg[0] bus
+	RT2X00USB_WARN,			// msg, value line in decoder
+	RT2X00USB_COMPLETE,		// addr endpoint, value transfer type, len bytes transferred,
+					// arg[0] status, arg[1] URBs left in flight on the endpoint,
+					// duration from submission; after the events decoded from the URB
+	RT2X00USB_SUBMIT,		// addr endpoint, value transfer type, len bytes requested,
+					// arg[0] URBs in flight on the endpoint including this one
+};
+
+struct rt2x00usb_event {
+	int type;
+	uint64_t ts;			// usec, of the event being decoded
+	uint16_t addr;
+	uint32_t value;
+	uint32_t arg[3];
+	uint64_t duration;		// usec
+	const unsigned char *data;
+	unsigned int len;
+	// Submission and completion the event comes from, if any
+	const struct usbmon_packet *shdr;
+	const struct usbmon_packet *hdr;
+	const char *msg;
+};
+
+// Event and everything it points to are valid only during the call
+typedef void (*rt2x00usb_callback)(const struct rt2x00usb_event *ev, void *priv);
+
+struct rt2x00usb;
+
+struct rt2x00usb *rt2x00usb_new(void);
+void rt2x00usb_free(struct rt2x00usb *d);
+// Callbacks are called in order they were added
+void rt2x00usb_add_callback(struct rt2x00usb *d, rt2x00usb_callback cb, void *priv);
+
+// Merge 16 LSB and 16 MSB wValue writes of a register into one 32-bit write,
+// unpaired half is delivered before any other event but submissions, or when
+// it is held longer than @timeout usec at the next event or rt2x00usb_tick()
+void rt2x00usb_coalesce(struct rt2x00usb *d, uint64_t timeout);
+// @ts is usbmon time without events, deliver unpaired half if it is due
+void rt2x00usb_tick(struct rt2x00usb *d, uint64_t ts);
+// Usec from @ts until unpaired half is due, UINT64_MAX if none is held
+uint64_t rt2x00usb_due(struct rt2x00usb *d, uint64_t ts);
+
+// Decoding of bulk URBs, control transfers are always fully decoded
+enum rt2x00usb_bulk_mode {
+	RT2X00USB_BULK_FULL,		// every URB
+	RT2X00USB_BULK_SAMPLE,		// 1 in @sample URBs, only COMPLETE for others
+	RT2X00USB_BULK_COUNT,		// only COMPLETE, payload of submissions is not kept
+};
+void rt2x00usb_bulk_mode(struct rt2x00usb *d, int mode, unsigned int sample);
+
+// Decode usbmon event, S events are kept until their completion
+void rt2x00usb_decode(struct rt2x00usb *d, struct usbmon_packet *hdr);
+// End of events, deliver what is still being assembled
+void rt2x00usb_finish(struct rt2x00usb *d);
+
+void rt2x00usb_save_state(struct rt2x00usb *d, struct decoder_state *s);
+void rt2x00usb_restore_state(struct rt2x00usb *d, const struct decoder_state *s);
+void rt2x00usb_reset_state(struct rt2x00usb *d);
+struct shadow_regs *rt2x00usb_shadow(struct rt2x00usb *d);
+
+// Submitted URBs waiting for completion
+void rt2x00usb_add_pending(struct rt2x00usb *d, struct usbmon_packet *hdr);
+void rt2x00usb_clear_pending(struct rt2x00usb *d);
+unsigned int rt2x00usb_pending(struct rt2x00usb *d);
+unsigned int rt2x00usb_inflight(struct rt2x00usb *d, uint8_t ep);
+
+// Record all values written to registers, written out by rt2x00usb_write_maps()
+void rt2x00usb_enable_maps(struct rt2x00usb *d);
+void rt2x00usb_write_maps(struct rt2x00usb *d, FILE *mac, FILE *bbp, FILE *rf);
+
+#endif
@@ -33,740 +33,675 @@
 #include <errno.h>
 #include <signal.h>
 #include <assert.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
 
 #include <linux/types.h>
 
 #include <map>
-#include <list>
+#include <vector>
+
+#include "rt2x00usb.h"
 
 #define SYSBASE		"/sys/bus/usb/devices"
 #define USBMON_DEVICE	"/dev/usbmon"
 #define MAX_PACKETS	32
 
-#define USB_DIR_IN	0x80
 #define LINEBUF_LEN	16383
 
+// Default time to wait for the upper half of a register write, usec
+#define COALESCE_TIMEOUT	2000
+
 #if 0
 #define DEBUG(x,...) printf("%s: " x, __func__, ##__VA_ARGS__)
 #else
 #define DEBUG(x,...)
 #endif
 
-/* this was taken from usbmon.txt in the kernel documentation */
-#define SETUP_LEN 8
-struct usbmon_packet {
-	uint64_t id;			/* 0: URB ID - from submission to callback */
-	unsigned char type;		/* 8: Same as text; extensible. */
-	unsigned char xfer_type;/* ISO (0), Intr, Control, Bulk (3) */
-	unsigned char epnum;	/* Endpoint number and transfer direction */
-	unsigned char devnum;	/* Device address */
-	uint16_t busnum;		/* 12: Bus number */
-	char flag_setup;		/* 14: Same as text */
-	char flag_data;			/* 15: Same as text; Binary zero is OK. */
-	int64_t ts_sec;			/* 16: gettimeofday */
-	int32_t ts_usec;		/* 24: gettimeofday */
-	int status;				/* 28: */
-	unsigned int length;	/* 32: Length of data (submitted or actual) */
-	unsigned int len_cap;	/* 36: Delivered length */
-	union {					/* 40: */
-		unsigned char setup[SETUP_LEN]; /* Only for Control S-type */
-		struct iso_rec {	/* Only for ISO */
-			int error_count;
-			int numdesc;
-		} iso;
-	} s;
-	int interval;			/* 48: Only for Interrupt and ISO */
-	int start_frame;		/* 52: For ISO */
-	unsigned int xfer_flags;/* 56: copy of URB's transfer_flags */
-	unsigned int ndesc;		/* 60: Actual number of ISO descriptors */
-};							/* 64 total length */
-
 struct mon_mfetch_arg {
     uint32_t *offvec;		/* Vector of events fetched */
     uint32_t nfetch;		/* Number of events to fetch (out: fetched) */
     uint32_t nflush;		/* Number of events to flush */
 };
 
+struct mon_bin_stats {
+    uint32_t queued;		/* Events in the ring */
+    uint32_t dropped;		/* Events lost since last query */
+};
+
 #define MON_IOC_MAGIC		0x92
 #define MON_IOCX_MFETCH		_IOWR(MON_IOC_MAGIC, 7, struct mon_mfetch_arg)
 #define MON_IOCQ_URB_LEN	_IO(MON_IOC_MAGIC, 1)
+#define MON_IOCG_STATS		_IOR(MON_IOC_MAGIC, 3, struct mon_bin_stats)
+#define MON_IOCT_RING_SIZE	_IO(MON_IOC_MAGIC, 4)
 #define MON_IOCQ_RING_SIZE	_IO(MON_IOC_MAGIC, 5)
 #define MON_IOCH_MFLUSH		_IO(MON_IOC_MAGIC, 8)
 
-#define XFER_TYPE_ISO		0
-#define XFER_TYPE_INTERRUPT	1
-#define XFER_TYPE_CONTROL	2
-#define XFER_TYPE_BULK		3
+// Timestamp of the event being decoded
+static uint64_t cur_ts;
+// Events lost by usbmon
+static uint64_t dropped_events;
 
-struct usb_ctrlrequest {
-        __u8 bRequestType;
-        __u8 bRequest;
-        __le16 wValue;
-        __le16 wIndex;
-        __le16 wLength;
-} __attribute__ ((packed));
+#include "capture.cc"
 
-static inline bool is_read_cr(struct usb_ctrlrequest *cr)
+FILE *f_mac_map;
+FILE *f_rf_map;
+FILE *f_bbp_map;
+FILE *f_capture;
+
+static struct rt2x00usb *decoder;
+
+#include "overload.cc"
+#include "control.cc"
+#include "bus.cc"
+#include "metrics.cc"
+
+#include "aggregation.cc"
+#include "stations.cc"
+#include "rates.cc"
+#include "beacons.cc"
+#include "operations.cc"
+#include "polls.cc"
+#include "mcu.cc"
+#include "queue.cc"
+#include "ftrace.cc"
+#include "tables.cc"
+#include "hexdump.cc"
+#include "payload.cc"
+#include "text.cc"
+#include "recorder.cc"
+
+const char *firmware_dump_name;
+
+// Write uploaded firmware image, next uploads get .1, .2, ... suffix
+void firmware_callback(const struct rt2x00usb_event *ev, void *priv)
 {
-	return (cr->bRequestType & 0x80);
-}
+	static unsigned int uploads;
+	char name[PATH_MAX];
+	FILE *fp;
 
-static unsigned char *get_data(struct usbmon_packet *hdr)
-{
-	return reinterpret_cast<unsigned char *>(hdr) + sizeof(struct usbmon_packet);
-}
+	if (ev->type != RT2X00USB_FIRMWARE)
+		return;
 
-#include "registers.cc"
+	if (uploads == 0)
+		snprintf(name, sizeof(name), "%s", firmware_dump_name);
+	else
+		snprintf(name, sizeof(name), "%s.%u", firmware_dump_name, uploads);
+	uploads++;
 
-#define MAX_MAC_REG	(0x8000 / 2)
-#define MAX_RF_REG	255
-#define MAX_BBP_REG	255
+	if ((fp = fopen(name, "w")) == NULL) {
+		fprintf(stderr, "fail to open file %s\n", name);
+		return;
+	}
+	fwrite(ev->data, ev->len, 1, fp);
+	fclose(fp);
+}
 
-std::list<uint16_t> mac_regs_map[MAX_MAC_REG];
-std::list<uint8_t> rf_regs_map[MAX_RF_REG];
-std::list<uint8_t> bbp_regs_map[MAX_BBP_REG];
+// Interval of periodic statistics reports in usec, 0 means only on exit
+uint64_t stats_interval;
 
-FILE *f_mac_map;
-FILE *f_rf_map;
-FILE *f_bbp_map;
+void stats_report(void)
+{
+	agg_report();
+	sta_report();
+	op_report();
+	poll_report();
+	mcu_report();
+	queue_report();
+	ftrace_report();
+	tab_report();
+	bcn_report();
+	overload_report();
+}
 
-static void mac_add_to_map(uint16_t addr, uint32_t data)
+static void stats_tick(struct usbmon_packet *hdr)
 {
-	assert(addr/2 < MAX_MAC_REG);
+	static uint64_t last;
+	const uint64_t ts = get_ts(hdr);
+
+	if (last == 0)
+		last = ts;
+	if (ts - last < stats_interval)
+		return;
 
-	if (f_mac_map)
-		mac_regs_map[addr/2].push_back(data);
+	last = ts;
+	stats_report();
 }
 
-static void mac_add_data_to_map(struct usb_ctrlrequest *cr, struct usbmon_packet *shdr)
+void process_packet(struct usbmon_packet *hdr)
 {
-	unsigned char *data = get_data(shdr);
-	for (unsigned int i = 0; i < shdr->len_cap/2; i++)
-		mac_add_to_map(cr->wIndex + 2*i , data[i] | (((unsigned short)data[i + 1]) << 8));
+	cur_ts = get_ts(hdr);
+
+	if (stats_interval)
+		stats_tick(hdr);
+	if (hdr->type == EVENT_DROP)
+		dropped_events += hdr->length;
+
+	if (rec_enabled())
+		rec_event_start(hdr);
+	rt2x00usb_decode(decoder, hdr);
+	if (rec_enabled())
+		rec_event_end(hdr);
 }
 
-static void bbp_add_to_map(uint16_t addr, uint8_t data)
+#include "index.cc"
+#include "diff.cc"
+
+struct index_writer capture_index;
+
+// Discard decoder output, return descriptor to pass to output_restore()
+static int output_discard(void)
 {
-	assert(addr < MAX_BBP_REG);
+	int saved, fd;
 
-	if (f_bbp_map)
-		bbp_regs_map[addr].push_back(data);
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	fd = open("/dev/null", O_WRONLY);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+	return saved;
 }
 
-static void rf_add_to_map(uint16_t addr, uint8_t data)
+static void output_restore(int saved)
 {
-	assert(addr < MAX_RF_REG);
-
-	if (f_rf_map)
-		rf_regs_map[addr].push_back(data);
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
 }
 
-void print_data(struct usbmon_packet *hdr)
+/*
+ * Offline decoding of a capture file. With more than one job the capture is
+ * split into chunks decoded in parallel by forked workers, each writing its
+ * output to a temporary file, which are then merged in order.
+ *
+ * Pending URBs at a chunk begin are found by a quick scan of the headers in
+ * the parent. The state machines are brought in sync by decoding the last
+ * CHUNK_OVERLAP events before the chunk with output discarded. Before merging,
+ * state a worker had at its chunk begin is compared with the state previous
+ * worker ended with; on mismatch the chunk is decoded again from that exact
+ * state, so the output is always identical to serial decoding.
+ */
+#define CHUNK_OVERLAP	1024
+#define CHUNKS_PER_JOB	4
+
+struct chunk {
+	size_t warmup;
+	size_t begin;
+	size_t end;
+	std::vector<size_t> pending;	// S events of URBs pending at begin
+	FILE *out;
+	pid_t pid;
+	bool finished;
+	int status;
+};
+
+struct chunk_result {
+	struct decoder_state start;
+	struct decoder_state end;
+};
+
+static void decode_range(struct capture *cap, size_t begin, size_t end)
 {
-	unsigned char *data = get_data(hdr);
+	for (size_t off = begin; off < end; off = capture_next(cap, off)) {
+		struct usbmon_packet *hdr = capture_event(cap, off);
 
-	printf(" [DATA:");
-	for (unsigned int i = 0; i < hdr->len_cap; i++)
-		printf(" %02x", data[i]);
-	printf("]\n");
+		if (hdr->type == '@')
+			/* filler packet */
+			continue;
+		process_packet(hdr);
+	}
 }
 
-uint32_t get_reg_val(struct usbmon_packet *hdr, int nr = 0)
+static void split_capture(struct capture *cap, int nchunks, std::vector<struct chunk> &chunks)
 {
-	unsigned char *buf = get_data(hdr);
-	buf += nr * sizeof(uint32_t);
-	return decode_reg_val(buf);
+	std::map<uint64_t, size_t> pending;
+	std::map<uint64_t, size_t>::iterator it;
+	size_t recent[CHUNK_OVERLAP];
+	unsigned int nr = 0;
+	const size_t step = cap->len / nchunks + 1;
+	size_t next = step;
+	struct chunk c;
+
+	c.warmup = c.begin = capture_first(cap);
+	c.finished = false;
+	c.out = NULL;
+
+	for (size_t off = c.begin; off < cap->len; off = capture_next(cap, off)) {
+		struct usbmon_packet hdr;
+
+		if (off >= next) {
+			c.end = off;
+			chunks.push_back(c);
+
+			c.begin = off;
+			c.warmup = recent[nr < CHUNK_OVERLAP ? 0 : nr % CHUNK_OVERLAP];
+			c.pending.clear();
+			for (it = pending.begin(); it != pending.end(); ++it)
+				c.pending.push_back(it->second);
+
+			next = off + step;
+		}
+		recent[nr++ % CHUNK_OVERLAP] = off;
+
+		// Track URBs the same way the decoder does
+		capture_header(cap, off, &hdr);
+		if (hdr.type == 'S')
+			pending[hdr.id] = off;
+		else if (hdr.type == 'C')
+			pending.erase(hdr.id);
+		else if (hdr.type == EVENT_REENUM)
+			pending.clear();
+	}
+
+	c.end = cap->len;
+	chunks.push_back(c);
 }
 
-void process_special_register_rw(struct usb_ctrlrequest *cr, struct usbmon_packet *shdr, struct usbmon_packet *hdr, struct special_reg *reg)
+static pid_t run_chunk(struct capture *cap, struct chunk *c, struct chunk_result *res,
+		       const struct decoder_state *from)
 {
-	const uint32_t DATA_MASK = 0x000000ff;
-	const uint32_t ADDR_MASK = reg->ADDR_MASK;
-	const uint32_t RW_BIT	 = 0x00010000; // 0 - Write, 1 - Read
-	const uint32_t KICK_BIT	 = 0x00020000;
+	pid_t pid;
 
-	if (is_read_cr(cr)) {
-		// Read
-		assert(hdr->len_cap == 4);
-		uint32_t reg_val = get_reg_val(hdr);
+	fflush(stdout);
+	if ((pid = fork()) != 0)
+		return pid;
 
-		if (reg->state == KICK_READ) {
-			bool busy = reg_val & KICK_BIT;
-			if (busy)
-				return;
+	if (from == NULL) {
+		output_discard();
+		decode_range(cap, c->warmup, c->begin);
+	}
 
-			if (reg->cur_addr != ((reg_val & ADDR_MASK) >> 8))
-				printf("WARN %d: cur_addr %02x addr %02x reg_val %08x\n", __LINE__, reg->cur_addr, (reg_val & ADDR_MASK) >> 8, reg_val);
+	rt2x00usb_clear_pending(decoder);
+	for (unsigned int i = 0; i < c->pending.size(); i++)
+		rt2x00usb_add_pending(decoder, capture_event(cap, c->pending[i]));
+	if (from)
+		rt2x00usb_restore_state(decoder, from);
+	rt2x00usb_save_state(decoder, &res->start);
 
-			reg->cur_data = reg_val & DATA_MASK;
+	// Warmup output may still be buffered
+	fflush(stdout);
+	dup2(fileno(c->out), STDOUT_FILENO);
+	decode_range(cap, c->begin, c->end);
+	fflush(stdout);
 
-			print_special_reg(reg, true);
+	rt2x00usb_save_state(decoder, &res->end);
+	_exit(0);
+}
 
-			reg->state = CHECKING_STATUS;
-		} else {
-			if (reg->state != CHECKING_STATUS)
-				printf("WARN %d: reg->state (%d) != CHECKING_STATUS\n", __LINE__, reg->state);
-		}
-	} else {
-		// Write
-		if (shdr->len_cap == 4) {
-			uint32_t reg_val = get_reg_val(shdr);
-
-			reg->cur_data = reg_val & DATA_MASK;
-			reg->cur_addr = (reg_val & ADDR_MASK) >> 8;
-
-			bool do_read = reg_val & RW_BIT;
-			if (reg->write_is_1)
-				do_read = !do_read;
-			bool do_kick = reg_val & KICK_BIT;
-
-			assert(do_kick == true);
-
-			if (do_read)
-				reg->state = KICK_READ;
-			else {
-				print_special_reg(reg, false);
-				reg->state = CHECKING_STATUS;
-
-				if (reg->addr == BBP_SPECIAL_ADDR)
-					bbp_add_to_map(reg->cur_addr, reg->cur_data);
-				else if (reg->addr == RF_SPECIAL_ADDR && f_rf_map)
-					rf_add_to_map(reg->cur_addr, reg->cur_data);
-			}
-		} else if (shdr->len_cap == 0) {
-			if (cr->wIndex == reg->addr) {
-				reg->cur_data = cr->wValue & DATA_MASK;
-				reg->cur_addr = (cr->wValue & ADDR_MASK) >> 8;
+static void copy_output(FILE *out)
+{
+	char buf[65536];
+	size_t n;
 
-				reg->state = SET_ADDR_DATA;
-			} else {
-				if (reg->state != SET_ADDR_DATA) {
-					reg->state = CHECKING_STATUS;
-					return;
-				}
+	fflush(stdout);
+	rewind(out);
+	while ((n = fread(buf, 1, sizeof(buf), out)) > 0)
+		fwrite(buf, 1, n, stdout);
+	fclose(out);
+}
 
-				// UpperHalf (cr->wIndex == 0x101e)
-				bool do_read = cr->wValue & (RW_BIT >> 16);
-				if (reg->write_is_1)
-					do_read = !do_read;
-				bool do_kick = cr->wValue & (KICK_BIT >> 16);
+static int decode_capture_parallel(struct capture *cap, int jobs)
+{
+	std::vector<struct chunk> chunks;
+	struct chunk_result *res;
+	struct decoder_state prev_end;
+	int started = 0, running = 0, merged = 0, n;
+
+	split_capture(cap, jobs * CHUNKS_PER_JOB, chunks);
+	n = chunks.size();
+
+	res = static_cast<struct chunk_result *>(mmap(NULL, n * sizeof(*res), PROT_READ | PROT_WRITE,
+						       MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+	if (res == MAP_FAILED) {
+		printf("unable to mmap chunk results: %s\n", strerror(errno));
+		return -1;
+	}
 
-				assert(do_kick == true);
+	rt2x00usb_save_state(decoder, &prev_end);
 
-				if (do_read == false) {
-					print_special_reg(reg, false);
-					reg->state = CHECKING_STATUS;
+	while (merged < n) {
+		while (running < jobs && started < n) {
+			struct chunk *c = &chunks[started];
 
-					if (reg->addr == BBP_SPECIAL_ADDR)
-						bbp_add_to_map(reg->cur_addr, reg->cur_data);
-					else if (reg->addr == RF_SPECIAL_ADDR && f_rf_map)
-						rf_add_to_map(reg->cur_addr, reg->cur_data);
-				} else
-					reg->state = KICK_READ;
+			if ((c->out = tmpfile()) == NULL ||
+			    (c->pid = run_chunk(cap, c, &res[started], NULL)) < 0) {
+				printf("failed to start decoding job: %s\n", strerror(errno));
+				return -1;
 			}
-		} else
-			assert(false);
-	}
-}
-
-void process_register_rw(struct usb_ctrlrequest *cr, struct usbmon_packet *shdr, struct usbmon_packet *hdr)
-{
-	struct reg *reg = get_reg(cr->wIndex);
-	// We can write or read halves of two consequitive registers at once
-	struct reg *reg1 = get_reg(cr->wIndex - 2);
-	struct reg *reg2 = get_reg(cr->wIndex + 2);
-
-	if (is_read_cr(cr)) {
-		// Read
-		assert(shdr->len_cap == 0);
-
-		if (hdr->len_cap != 4) {
-			printf("CTRL: READ %d BYTES FROM REGISTER 0x04%x\n", hdr->len_cap, cr->wIndex);
-			print_data(hdr);
-			return;
+			started++;
+			running++;
 		}
 
-		uint32_t reg_val = get_reg_val(hdr);
-
-		if (reg)
-			print_reg(reg, reg_val, true, Full);
-		else {
-			if (reg1 && reg2) {
-				print_reg(reg1, reg_val & 0xffff, true, UpperHalf);
-				print_reg(reg2, reg_val >> 16, true, LowerHalf);
-			 } else {
-				// Unknown register
-				printf("0x%08x <- REG 0x%04x\n", reg_val, cr->wIndex);
+		int status;
+		pid_t pid = wait(&status);
+		for (int i = merged; i < started; i++) {
+			if (chunks[i].pid == pid) {
+				chunks[i].finished = true;
+				chunks[i].status = status;
+				running--;
 			}
 		}
-	} else {
-		// Write
-		assert(hdr->len_cap == 0);
-
-		if (shdr->len_cap != 4 && shdr->len_cap != 0) {
-			printf("CTRL: WRITE %d BYTES TO REGISTER 0x%04x\n", shdr->len_cap, cr->wIndex);
-			print_data(shdr);
-			mac_add_data_to_map(cr, shdr);
-			return;
-		}
 
-		if (shdr->len_cap == 4) {
-			uint32_t reg_val = get_reg_val(shdr);
-
-			if (!reg1 || !reg2) {
-				mac_add_to_map(cr->wIndex, reg_val & 0xffff);	// LowerHalf
-				mac_add_to_map(cr->wIndex + 2, reg_val >> 16);	// UpperHalf 
+		while (merged < n && chunks[merged].finished) {
+			struct chunk *c = &chunks[merged];
+
+			if (c->status != 0 || memcmp(&res[merged].start, &prev_end, sizeof(prev_end))) {
+				// Speculation failed, decode again from the exact state
+				DEBUG("chunk %d out of sync\n", merged);
+				fflush(c->out);
+				ftruncate(fileno(c->out), 0);
+				rewind(c->out);
+				pid = run_chunk(cap, c, &res[merged], &prev_end);
+				waitpid(pid, &c->status, 0);
 			}
 
-			if (reg) {
-				print_reg(reg, reg_val, false, Full);
-			} else {
-				if (reg1 && reg2) {
-					// Special case - write to two different but consecutive registers
-					print_reg(reg1, reg_val & 0xffff, false, UpperHalf);
-					print_reg(reg2, reg_val >> 16, false, LowerHalf);
-				} else {
-					// Unknown register
-					printf("0x%08x -> REG 0x%04x\n", reg_val, cr->wIndex);
-				}
+			copy_output(c->out);
+			if (c->status != 0) {
+				printf("decoding job failed at offset %zu\n", c->begin);
+				return -1;
 			}
-		} else if (shdr->len_cap == 0) {
-			mac_add_to_map(cr->wIndex, cr->wValue); // Lower or Upper Half
-
-			// Using wValue as data
-			if (reg)
-				print_reg(reg, cr->wValue, false, LowerHalf);
-			else if (reg1)
-				print_reg(reg1, cr->wValue, false, UpperHalf);
-			else
-				printf("0x%04x -> REG 0x%04x\n", cr->wValue, cr->wIndex);
-		}
-	}
-}
 
-static bool process_mcu_request(struct usb_ctrlrequest *cr, struct usbmon_packet *shdr, struct usbmon_packet *hdr)
-{
-	const uint16_t H2M_MAILBOX_CSR = 0x7010;
-	const uint32_t OWNER_BIT = 0x00000001;
-	const uint32_t HOST_CMD = 0x404;
-
-	static int state = 0;
-	static uint8_t command;
-	static uint8_t owner;
-	static uint8_t token;
-	static uint8_t arg0;
-	static uint8_t arg1;
-
-	switch (state) {
-	case 0:
-		// Check busy or not
-		if (cr->wIndex == H2M_MAILBOX_CSR) {
-			if (is_read_cr(cr)) {
-				assert(hdr->len_cap == 4);
-
-				uint32_t reg_val = get_reg_val(hdr);
-
-				if (!(reg_val & OWNER_BIT)) // not busy
-					state = 1;
-			} else {
-				// For some MCU command driver skip "check busy" part
-				state = 1;
-				goto state_1;
-			}
-		} else {
-			return false;
+			prev_end = res[merged].end;
+			merged++;
 		}
-		break;
-	case 1:
-state_1:
-		if (cr->wIndex != H2M_MAILBOX_CSR)
-			return false;
-
-		if (is_read_cr(cr))
-			goto stop_processing;
-
-		if (hdr->len_cap == 4) {
-			uint32_t reg_val = get_reg_val(hdr);
-			arg0 = reg_val & 0x000000ff;
-			arg1 = (reg_val & 0x0000ff00) >> 8;
-			token = (reg_val & 0x00ff0000) >> 16;
-			owner = (reg_val & 0xff000000) >> 24;
-			state = 3;
-		} else {
-			// Write 16 LSB to MAILBOX_CSR
-			assert(cr->wIndex == H2M_MAILBOX_CSR);
-			arg0 = cr->wValue & 0x00ff;
-			arg1 = (cr->wValue & 0xff00) >> 8;
-			state = 2;
-		}
-		break;
-	case 2:
-		// Write 16 MSB to MAILBOX_CSR
-		if (cr->wIndex != H2M_MAILBOX_CSR + 2)
-			goto stop_processing;
-		assert(!is_read_cr(cr));
-
-		token = cr->wValue & 0x00ff;
-		owner = (cr->wValue & 0xff00) >> 8;
-		state = 3;
-		break;
-	case 3:
-		if (cr->wIndex != HOST_CMD)
-			goto stop_processing;
-		assert(!is_read_cr(cr));
-
-		if (hdr->len_cap == 4) {
-			uint32_t reg_val = get_reg_val(hdr);
-			command = reg_val & 0xff;
-			goto print;
-		} else {
-			command = cr->wValue & 0xff;
-			state = 4;
-		}
-		break;
-	case 4:
-		if (cr->wIndex != HOST_CMD + 2)
-			goto stop_processing;
-		assert(!is_read_cr(cr));
-print:
-		printf("MCU COMMAND %02x Token %02x arg0 %02x arg1 %02x\n", command, token, arg0, arg1);
-		state = 0;
-		break;
 	}
 
-	// Packet was processed here
-	return true;
-
-stop_processing:
-	printf("WARN %d: fail to parse MCU command at state %d\n", __LINE__, state);
-	state = 0;
-	return false;
+	munmap(res, n * sizeof(*res));
+	return 0;
 }
 
-// Return: 0 not processing, 1 not processing, but in middle state (not process MCU), 2 - processing
-static int process_h2m_bbp(struct usb_ctrlrequest *cr, struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+/*
+ * Decode events with timestamps in [from, to], starting from the nearest
+ * index checkpoint if there is one. Optionally (re)build the index.
+ */
+static void decode_capture_serial(struct capture *cap, const char *name, uint64_t from, uint64_t to,
+				  struct index_writer *iw)
 {
-	const uint16_t H2M_BBP_AGENT = 0x7028;
-	const uint32_t KICK_BIT	 = 0x00020000;
-
-	static int state = 0;
-	static bool is_read;
-	static uint8_t cur_addr;
-	static uint8_t cur_data;
-
-	switch (state) {
-	case 0:
-		// Check busy
-		if (cr->wIndex == H2M_BBP_AGENT) {
-			DEBUG("step 0\n");
-			if (!is_read_cr(cr))
-				break;
-
-			assert(hdr->len_cap == 4);
-			uint32_t reg_val = get_reg_val(hdr);
-
-			if (!(reg_val & KICK_BIT)) // not busy
-				state = 1;
-		} else {
-			return 0;
-		}
-		break;
-	case 1:
-		DEBUG("step 1\n");
-		// Ignore most of MCU processing, it can be mixed with H2M_BBP_AGENT I/O
-		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
-			break;
-
-		if (is_read_cr(cr))
-			break;
+	size_t off = capture_first(cap);
+	int saved = -1;
 
-		if (cr->wIndex != H2M_BBP_AGENT)
-			return 1;
+	if (from) {
+		uint64_t start = index_restore(cap, name, from);
 
-		// Write 16 LSB to H2M_BBP_AGENT
-		cur_addr = (cr->wValue & 0xff00) >> 8;
-		cur_data = cr->wValue & 0x00ff;
-		state = 2;
-		break;
-	case 2:
-		DEBUG("step 2\n");
-		// Ignore most of MCU processing, it can be mixed with H2M_BBP_AGENT I/O
-		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
-			break;
-
-		if (cr->wIndex != H2M_BBP_AGENT + 2)
-			return 1;
+		if (start)
+			off = start;
+		else
+			fprintf(stderr, "%s: no index, decoding from the start\n", name);
+		saved = output_discard();
+	}
 
-		assert(!is_read_cr(cr));
-		is_read = (cr->wValue & 0x1) ? true : false;
-		state = 3;
-		break;
-	case 3:
-		DEBUG("step 3\n");
-		// Ignore most of MCU processing
-		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
-			break;
+	for (; off < cap->len; off = capture_next(cap, off)) {
+		struct usbmon_packet *hdr = capture_event(cap, off);
+		uint64_t ts = get_ts(hdr);
 
-		// End of MCU processing
-		if (cr->wIndex == 0x0406) {
-			if (is_read) {
-				state = 4;
-			} else {
-				printf("0x%02x -> BBP REG%u\t[WRITE]\n", cur_data, cur_addr);
-				state = 0;
-
-				bbp_add_to_map(cur_addr, cur_data);
-			}
-		} else {
-			return 1;
+		if (saved >= 0 && ts >= from) {
+			output_restore(saved);
+			saved = -1;
 		}
-		break;
-	case 4:
-		DEBUG("step 4\n");
-		// Ignore most of MCU processing, it can be mixed with H2M_BBP_AGENT I/O
-		if (cr->wIndex == 0x7010 || cr->wIndex == 0x7012 || cr->wIndex == 0x404)
+		if (ts > to)
 			break;
 
-		if (cr->wIndex != H2M_BBP_AGENT)
-			return 1;
-
-		assert(is_read_cr(cr));
-		assert(hdr->len_cap == 4);
-
-		uint32_t reg_val = get_reg_val(hdr);
-		uint8_t addr = (reg_val & 0xff00) >> 8;
-		cur_data = reg_val & 0x00ff;
-
-		if (addr != cur_addr)
-			printf("WARN %d: BBP read expected addr %u get %u\n", __LINE__, cur_addr, addr);
-
-		printf("0x%02x <- BBP REG%u\t[READ]\n", cur_data, addr);
-
-		state = 0;
-		break;
+		if (iw->fp)
+			index_event(iw, hdr, off);
+		if (hdr->type == '@')
+			/* filler packet */
+			continue;
+		process_packet(hdr);
 	}
 
-	// Packet was processed here
-	return 2;
+	if (saved >= 0)
+		output_restore(saved);
 }
 
-void process_control_packet(struct usbmon_packet *shdr, struct usbmon_packet *hdr)
+/*
+ * Parse time as seconds since the epoch, "+seconds" since capture start or
+ * local time of the day "HH:MM[:SS[.frac]]" at or after capture start.
+ */
+static int parse_time(const char *str, uint64_t start, uint64_t *ts)
 {
-	struct usb_ctrlrequest *cr = reinterpret_cast<struct usb_ctrlrequest *>(shdr->s.setup);
-	int ret;
-
-	if (!(cr->bRequestType & 0x40)) {
-		// Not vendor request
-		// FIXME: print data and length
-		printf("CTRL: %02x %02x Value: %04x Index %04x Lenght %04x\n",
-		       cr->bRequestType, cr->bRequest, cr->wValue, cr->wIndex, cr->wLength);
-		return;
+	unsigned int hour, min;
+	double sec = 0;
+	char *end;
+
+	if (str[0] == '+') {
+		sec = strtod(str + 1, &end);
+		if (*end || sec < 0)
+			return -1;
+		*ts = start + (uint64_t) (sec * 1000000);
+		return 0;
 	}
 
-	// FIXME: check urb statuses
-
-	ret = process_h2m_bbp(cr, shdr, hdr);
-	if (ret == 2)
-		goto out;
-	if (ret == 0 && process_mcu_request(cr, shdr, hdr))
-		goto out;
-
-	if (cr->wIndex > 0x17ff) {
-		// Not registers area
-		struct area *area = get_area(cr->wIndex);
-		const char *name = area ? area->name : "Unknown area";
-
-		if (is_read_cr(cr)) {
-			// Read
-			printf("CTRL: READ %d BYTES FROM 0x%04x (%s)\n", hdr->len_cap, cr->wIndex, name);
-			print_data(hdr);
-		} else {
-			// Write
-			if (shdr->len_cap == 0) {
-				assert(cr->wLength == 0);
-				printf("CTRL: WRITE VALUE 0x%04x TO 0x%04x (%s)\n", cr->wValue, cr->wIndex, name);
-				mac_add_to_map(cr->wIndex , cr->wValue);
-			} else {
-				printf("CTRL: WRITE %d BYTES TO 0x%04x (%s)\n", shdr->len_cap, cr->wIndex, name);
-				print_data(shdr);
-				mac_add_data_to_map(cr, shdr);
-			}
-		}
-
-		goto out;
+	if (strchr(str, ':')) {
+		time_t t = start / 1000000;
+		struct tm tm;
+
+		if (sscanf(str, "%u:%u:%lf", &hour, &min, &sec) < 2)
+			return -1;
+
+		localtime_r(&t, &tm);
+		tm.tm_hour = hour;
+		tm.tm_min = min;
+		tm.tm_sec = 0;
+		tm.tm_isdst = -1;
+		*ts = mktime(&tm) * 1000000ULL + (uint64_t) (sec * 1000000);
+		// Time of the day before capture start means the next day
+		if (*ts + 1000000 < start)
+			*ts += 86400 * 1000000ULL;
+		return 0;
 	}
 
-	// BBP and RF registers are indirectly addressed, print only valuable data
-	if (cr->wIndex == reg_bbp.addr || cr->wIndex == reg_bbp.addr + 2)
-		process_special_register_rw(cr, shdr, hdr, &reg_bbp);
-	else if (cr->wIndex == reg_rf.addr || cr->wIndex == reg_rf.addr + 2)
-		process_special_register_rw(cr, shdr, hdr, &reg_rf);
-	else
-		process_register_rw(cr, shdr, hdr);
-
-out:
-	// Seems when asserion fail lines are not printed in order, flush should fix that
-	fflush(stdout);
-
+	sec = strtod(str, &end);
+	if (*end || sec < 0)
+		return -1;
+	*ts = (uint64_t) (sec * 1000000);
+	return 0;
 }
 
-void print_rxinfo(unsigned char *buf, int len)
+int decode_capture(char *name, int jobs, const char *from_str, const char *to_str, bool build_index)
 {
-	int frame_nr = 0;
-
-	while (len > 24) { // FIXME: why 24
-		uint32_t rxinfo_val = decode_reg_val(buf);
-		int frame_len = rxinfo_val & 0xffff;
+	struct capture cap;
+	struct index_writer iw;
+	uint64_t from = 0, to = UINT64_MAX;
+	int ret = 0;
 
-		printf("  READ FRAME%d (%d BYTES)\n", frame_nr++, frame_len);
-
-		print_buf_reg(&rxinfo, buf + 0);
-		print_buf_reg(&rxwi_w0, buf + 4);
-		print_buf_reg(&rxwi_w1, buf + 8);
-		print_buf_reg(&rxwi_w2, buf + 12);
-		print_buf_reg(&rxwi_w3, buf + 16);
-
-		frame_len += 4; // RXINFO size
-		assert(frame_len <= len - 4);
+	if (capture_open(&cap, name))
+		return -1;
 
-		print_buf_reg(&rxd, buf + frame_len);
+	if (from_str || to_str) {
+		uint64_t start = 0;
+		struct usbmon_packet hdr;
 
-		frame_len += 4; // RXD size
-		len -= frame_len;
-		buf += frame_len;
+		if (capture_first(&cap) < cap.len) {
+			capture_header(&cap, capture_first(&cap), &hdr);
+			start = get_ts(&hdr);
+		}
+		if ((from_str && parse_time(from_str, start, &from)) ||
+		    (to_str && parse_time(to_str, start, &to))) {
+			printf("invalid time format\n");
+			capture_close(&cap);
+			return -1;
+		}
 	}
-}
-void print_txinfo(unsigned char *buf, int len)
-{
-	int frame_nr = 0;
 
-	while (len > 20) { // FIXME: why 16
-		uint32_t txinfo_val = decode_reg_val(buf);
-		int frame_len = txinfo_val & 0xffff;
+	iw.fp = NULL;
+	if (build_index && index_create(&iw, name)) {
+		printf("unable to create index for %s: %s\n", name, strerror(errno));
+		capture_close(&cap);
+		return -1;
+	}
 
-		printf("   WRITE FRAME%d (%d BYTES)\n", frame_nr++, frame_len);
+	if (jobs > 1 && !from && !iw.fp && to == UINT64_MAX)
+		ret = decode_capture_parallel(&cap, jobs);
+	else
+		decode_capture_serial(&cap, name, from, to, &iw);
 
-		print_buf_reg(&txinfo, buf);
-		print_buf_reg(&txwi_w0, buf + 4);
-		print_buf_reg(&txwi_w1, buf + 8);
+	if (cap.truncated)
+		fprintf(stderr, "%s: truncated capture at offset %zu\n", name, cap.truncated);
 
-		frame_len += 4; // TXINFO size
-		len -= frame_len;
-		buf += frame_len;
-	}
+	index_close(&iw);
+	capture_close(&cap);
+	return ret;
 }
 
-void process_bulk_packet(struct usbmon_packet *shdr, struct usbmon_packet *hdr)
-{
-	const int ep = hdr->epnum & 0x7f;
-
-	if (hdr->epnum & USB_DIR_IN) {
-		// Read
-		unsigned char *buf = get_data(hdr);
-		const int len = hdr->len_cap;
+// Requested usbmon ring size in bytes, 0 keeps the current one
+int ring_size;
 
-		printf("BULK%d <- READ %d BYTES\n", ep, len);
+// Interval of usbmon statistics queries in usec
+#define USBMON_STATS_INTERVAL	100000
 
-		if (0) {
-			for (int i = 0; i < len; i++)
-				printf("%02x ", buf[i]);
-			printf("\n");
-		}
+static uint64_t monotonic_us(void)
+{
+	struct timespec ts;
 
-		print_rxinfo(buf, len);
-	} else {
-		// Write
-		unsigned char *buf = get_data(shdr);
-		const int len = shdr->len_cap;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
-		printf("BULK%d -> WRITE %d BYTES\n", ep, len);
+// Clock of usbmon timestamps
+static uint64_t realtime_us(void)
+{
+	struct timeval tv;
 
-		if (0) {
-			for (int i = 0; i < len; i++)
-				printf("%02x ", buf[i]);
-			printf("\n");
-		}
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
 
-		print_txinfo(buf, len);
+/*
+ * Pass an event not coming from usbmon to the decoder and the capture, with
+ * timestamp of event @at or current time.
+ */
+static void inject_event(unsigned char type, int bus, int address, unsigned int length,
+			 const struct usbmon_packet *at = NULL)
+{
+	struct usbmon_packet ev;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	memset(&ev, 0, sizeof(ev));
+	ev.type = type;
+	ev.busnum = bus;
+	ev.devnum = address;
+	ev.ts_sec = at ? at->ts_sec : tv.tv_sec;
+	ev.ts_usec = at ? at->ts_usec : tv.tv_usec;
+	ev.length = length;
+
+	if (f_capture) {
+		uint64_t off = capture_write(f_capture, &ev);
+		index_event(&capture_index, &ev, off);
 	}
+	process_packet(&ev);
 }
 
-void process_packet(struct usbmon_packet *hdr)
+/*
+ * Check if usbmon lost events since last call. Lost events are passed to the
+ * decoder as an EVENT_DROP event, which is also written to the capture so
+ * that offline decoding recovers the same way.
+ */
+static void check_drops(int fd, int bus, int address)
 {
-	static std::map<uint64_t, char *> pkts_map;
+	struct mon_bin_stats stats;
 
-	if (hdr->type == 'S') {
-		const int len = sizeof(struct usbmon_packet) + hdr->len_cap;
-		char *tmp = new char[len];
-		memcpy(tmp, hdr, len);
-		pkts_map[hdr->id] = tmp;
+	if (ioctl(fd, MON_IOCG_STATS, &stats) < 0)
 		return;
-	}
-
-	assert(hdr->type == 'C');
-
-	std::map<uint64_t, char *>::iterator it = pkts_map.find(hdr->id);
-	if (it == pkts_map.end()) // not yet mapped
+	metrics_queued(stats.queued);
+	if (stats.dropped == 0)
 		return;
-	char *buf = it->second;
-	struct usbmon_packet *shdr = reinterpret_cast<struct usbmon_packet *>(buf);
-
-	assert(shdr->id == hdr->id);
-	assert(shdr->xfer_type == hdr->xfer_type);
-
-	if (shdr->epnum != hdr->epnum)
-		printf("WARN %d: EP missmash shdr->epnum %02x hdr->epnum %02x\n", __LINE__, shdr->epnum, hdr->epnum);
-
-	if (shdr->xfer_type == 2)
-		process_control_packet(shdr, hdr);
-	else if (shdr->xfer_type == 3)
-		process_bulk_packet(shdr, hdr);
-	else {
-		const char *xfer_name[] = {
-			" iso",
-			"intr",
-			"ctrl",
-			"bulk"
-		};
-		const char *dir = (hdr->epnum & USB_DIR_IN) ? "<-" : "->";
-		const int ep = hdr->epnum & 0x7f;
-
-		printf("%p %s %s %d\n", (void *) shdr->id, xfer_name[shdr->xfer_type], dir, ep);
-	}
-
-	delete[] buf;
-	pkts_map.erase(it);
 
-	return;
+	DEBUG("%u events queued\n", stats.queued);
+	inject_event(EVENT_DROP, bus, address, stats.dropped);
 }
 
-void sniff(int bus, int address)
+int find_device(char *vidpid, int *bus, int *address);
+
+#include "reenum.cc"
+
+/*
+ * Decode events of device @vidpid at @bus and @address. Return when the
+ * device shows up on another bus, with its new location in @bus and
+ * @address, or on error.
+ */
+int sniff(char *vidpid, int *bus, int *address)
 {
 	struct mon_mfetch_arg mfetch;
 	struct usbmon_packet *hdr;
-	int kbuf_len, fd, nflush;
+	struct pollfd pfd[2];
+	int kbuf_len, fd, nflush, uevent_fd, ret = -1;
 	char *mbuf, path[64];
 	uint32_t vec[MAX_PACKETS];
+	uint64_t last_check = 0, last_rescan, events = 0;
 
-	snprintf(path, 63, "%s%d", USBMON_DEVICE, bus);
+	snprintf(path, 63, "%s%d", USBMON_DEVICE, *bus);
 	if ((fd = open(path, O_RDONLY)) == -1) {
 		printf("unable to open %s: %s\n", path, strerror(errno));
-		return;
+		return -1;
+	}
+
+	if (ring_size && ioctl(fd, MON_IOCT_RING_SIZE, ring_size) < 0) {
+		printf("failed to set kernel USB buffer size to %d: %s\n", ring_size, strerror(errno));
+		return -1;
 	}
 
 	if ((kbuf_len = ioctl(fd, MON_IOCQ_RING_SIZE)) <= 0) {
 		printf("failed to determine kernel USB buffer size: %s\n", strerror(errno));
-		return;
+		return -1;
 	}
 
 	mbuf = static_cast<char* >(mmap(NULL, kbuf_len, PROT_READ, MAP_SHARED, fd, 0));
 	if (mbuf == MAP_FAILED) {
 		printf("unable to mmap %d bytes: %s\n", kbuf_len, strerror(errno));
-		return;
+		return -1;
 	}
 
+	enum_watch_init(vidpid);
+	uevent_fd = uevent_open();
+	last_rescan = monotonic_us();
+
+	pfd[0].fd = fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = uevent_fd;
+	pfd[1].events = POLLIN;
+
 	nflush = 0;
 	while (1) {
+		int new_bus, new_address;
+		int timeout = RESCAN_INTERVAL_MS;
+		const uint64_t due = rt2x00usb_due(decoder, realtime_us());
+
+		// Unpaired half is delivered on time also when no events follow
+		if (due / 1000 + 1 < (uint64_t) timeout)
+			timeout = due / 1000 + 1;
+
+		// Events or device changes, sysfs is rescanned also when idle
+		if (poll(pfd, uevent_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR) {
+			printf("poll failed: %s\n", strerror(errno));
+			break;
+		}
+
+		uint64_t now = monotonic_us();
+		bool changed = uevent_fd >= 0 && (pfd[1].revents & POLLIN) && uevent_usb_changed(uevent_fd);
+
+		if (changed || now - last_rescan >= RESCAN_INTERVAL_MS * 1000) {
+			last_rescan = now;
+			if (find_device(vidpid, &new_bus, &new_address) &&
+			    (new_bus != *bus || new_address != *address)) {
+				inject_event(EVENT_REENUM, new_bus, new_address, *address);
+				*address = new_address;
+				if (new_bus != *bus) {
+					*bus = new_bus;
+					ret = 0;
+					break;
+				}
+			}
+		}
+
+		if (!(pfd[0].revents & POLLIN)) {
+			rt2x00usb_tick(decoder, realtime_us());
+			continue;
+		}
+
 		mfetch.offvec = vec;
 		mfetch.nfetch = MAX_PACKETS;
 		mfetch.nflush = nflush;
@@ -777,59 +712,85 @@ void sniff(int bus, int address)
 			if (hdr->type == '@')
 				/* filler packet */
 				continue;
-			if (hdr->busnum != bus || hdr->devnum != address)
-				/* some other device */
+			if (hdr->busnum != *bus)
 				continue;
+			if (hdr->devnum != *address) {
+				/* some other device, unless it is ours re-enumerated */
+				if ((new_address = enum_event(hdr)) == 0)
+					continue;
+				inject_event(EVENT_REENUM, *bus, new_address, *address, hdr);
+				*address = new_address;
+			}
+			if (f_capture) {
+				uint64_t off = capture_write(f_capture, hdr);
+				index_event(&capture_index, hdr, off);
+			}
 			process_packet(hdr);
+			events++;
+		}
+
+		// Upper half could still be in the ring
+		if (mfetch.nfetch < MAX_PACKETS)
+			rt2x00usb_tick(decoder, realtime_us());
+
+		// Events are lost when the ring is full, so after ones already in it
+		now = monotonic_us();
+		if (mfetch.nfetch && (metrics_enabled() || overload_enabled)) {
+			const uint64_t lag = realtime_us() - cur_ts;
+			metrics_lag(lag);
+			overload_check(now, lag);
 		}
+
+		if (now - last_check >= USBMON_STATS_INTERVAL) {
+			check_drops(fd, *bus, *address);
+			last_check = now;
+		}
+
+		ctl_publish(now, mfetch.nfetch < MAX_PACKETS, events, rt2x00usb_pending(decoder));
 	}
 
+	if (uevent_fd >= 0)
+		close(uevent_fd);
 	munmap(mbuf, kbuf_len);
-	ioctl(fd, MON_IOCH_MFLUSH, mfetch.nfetch);
+	ioctl(fd, MON_IOCH_MFLUSH, nflush);
 	close(fd);
+	return ret;
+}
+
+static int read_sysfs(const char *dev, const char *attr, char *buf, int len)
+{
+	char path[PATH_MAX];
+	int fd, n;
+
+	snprintf(path, sizeof(path), "%s/%s/%s", sysfs_root, dev, attr);
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	memset(buf, 0, len + 1);
+	n = read(fd, buf, len);
+	close(fd);
+	return n;
 }
 
 int check_device(struct dirent *de, char *vidpid, int *bus, int *address)
 {
-	int fd;
-	char path[128], vid[5], buf[5];
+	char buf[5];
 
 	/* vendor */
-	memcpy(vid, vidpid, 4);
-	vid[4] = '\0';
-	sprintf(path, "%s/%s/idVendor", SYSBASE, de->d_name);
-	if ((fd = open(path, O_RDONLY)) == -1)
-		return 0;
-	buf[4] = '\0';
-	if ((read(fd, buf, 4) != 4) || strncmp(vid, buf, 4)) {
-		close(fd);
+	if (read_sysfs(de->d_name, "idVendor", buf, 4) != 4 || strncmp(vidpid, buf, 4))
 		return 0;
-	}
 
 	/* product */
-	sprintf(path, "%s/%s/idProduct", SYSBASE, de->d_name);
-	if ((fd = open(path, O_RDONLY)) == -1)
+	if (read_sysfs(de->d_name, "idProduct", buf, 4) != 4 || strncmp(vidpid + 5, buf, 4))
 		return 0;
-	buf[4] = '\0';
-	if ((read(fd, buf, 4) != 4) || strncmp(vidpid+5, buf, 4)) {
-		close(fd);
-		return 0;
-	}
 
 	/* bus */
-	sprintf(path, "%s/%s/busnum", SYSBASE, de->d_name);
-	if ((fd = open(path, O_RDONLY)) == -1)
+	if (read_sysfs(de->d_name, "busnum", buf, 4) < 0)
 		return 0;
-	memset(buf, 0, 5);
-	read(fd, buf, 4);
 	*bus = strtol(buf, NULL, 10);
 
 	/* address */
-	sprintf(path, "%s/%s/devnum", SYSBASE, de->d_name);
-	if ((fd = open(path, O_RDONLY)) == -1)
+	if (read_sysfs(de->d_name, "devnum", buf, 4) < 0)
 		return 0;
-	memset(buf, 0, 5);
-	read(fd, buf, 4);
 	*address = strtol(buf, NULL, 10);
 
 	return 1;
@@ -841,7 +802,7 @@ int find_device(char *vidpid, int *bus, int *address)
 	struct dirent *de;
 	int found;
 
-	if (!(dir = opendir(SYSBASE)))
+	if (!(dir = opendir(sysfs_root)))
 		return 0;
 
 	found = 0;
@@ -858,7 +819,22 @@ int find_device(char *vidpid, int *bus, int *address)
 
 void usage(void)
 {
-	printf("usage: rt2x00_usbdump -d <vid:pid> [-m mac_regs_file] [-b bbp_regs_file] [-r rf_regs_file]\n");
+	printf("usage: rt2x00_usbdump -d <vid:pid> [-w capture_file] [--ring-size bytes]\n"
+	       "                      [--control socket] [--sysfs dir] [--overload[=sample_ms[,count_ms]]]\n"
+	       "                      [--overload-sample n] [options]\n");
+	printf("       rt2x00_usbdump --bus-attach name\n");
+	printf("       rt2x00_usbdump --diff capture_file capture_file\n");
+	printf("       rt2x00_usbdump -f capture_file [-j jobs] [--index] [--from time] [--to time] [options]\n");
+	printf("options: [-m mac_regs_file] [-b bbp_regs_file] [-r rf_regs_file]\n"
+	       "         [--agg-stats] [--sta-stats] [--stats-interval seconds] [--no-frames]\n"
+	       "         [--rate-timeline] [--rate-csv file] [--rate-bin file] [--firmware-dump file]\n"
+	       "         [--dump-payload] [--payload-cap bytes] [--payload-file file]\n"
+	       "         [--bus name] [--coalesce[=usec]] [--ops]\n"
+	       "         [--poll-stats] [--mcu-stats] [--queue-stats[=usec]] [--tables] [--beacons] [--metrics file] [--metrics-interval seconds]\n"
+	       "         [--ftrace trace_file] [--ftrace-offset seconds]\n"
+	       "         [--record file] [--record-window events|seconds's'] [--record-post seconds]\n"
+	       "         [--record-size bytes] [--trigger warn|status|crc[=count[/ms]]|REG[.FIELD]=value]\n");
+	printf("time is seconds since the epoch, +seconds since capture start or HH:MM[:SS[.frac]]\n");
 }
 
 int open_map(FILE **fp, char *name)
@@ -873,103 +849,149 @@ int open_map(FILE **fp, char *name)
 	return 0;
 }
 
-/* Print only last REG_PRINT_LIMIT registers */
-#define REG_PRINT_LIMIT 5
-
-void create_mac_map(std::list<uint16_t> mac_regs_map[], FILE *fp)
+void close_map(FILE **fp)
 {
-	 if (!fp)
-		return;
-
-	for (int i = 0; i < MAX_MAC_REG; i++) {
-		std::list<uint16_t> &l = mac_regs_map[i];
-		std::list<uint16_t>::iterator it;
-
-		const uint16_t addr = i*2;
-		struct reg *reg;
-		bool lower_half;
-
-		if (i & 1) {
-			lower_half = false;
-			reg = get_reg(addr - 2);
-		} else {
-			lower_half = true;
-			reg = get_reg(addr);
-		}
-	
-		const char *name = reg ? reg->name : "UNKNOWN";
-		const char *half = lower_half ? "L" : "U";
-
-		fprintf(fp, "%04x %s %s ", addr, name, half);
-		int k;
-		for (k = l.size(), it = l.begin(); it != l.end(); ++it, k--)
-			if (k <= REG_PRINT_LIMIT)
-				fprintf(fp, " %04x", *it);
-		fprintf(fp, "\n");
-	}
-
-	fflush(fp);
-	fclose(fp);
+	if (*fp)
+		fclose(*fp);
+	*fp = NULL;
 }
 
-template <typename T>
-void create_map(T arr[], int N, FILE *fp)
+void finish(void)
 {
-	if (!fp)
-		return;
-
-	for (int i = 0; i < N; i++) {
-		typename T::iterator it;
-		T &l = arr[i];
-
-		fprintf(fp, "%d:\t", i);
-#if 0
-		int last_value = -1;
-		int repeats = 0;
-		for (it = l.begin(); it != l.end(); ++it) {
-			if (last_value == static_cast<int>(*it)) {
-				repeats++;
-			} else {
-				if (repeats > 0)
-					fprintf(fp, "(%d)", repeats);
-				fprintf(fp, " %02x", *it);
-				last_value = *it;
-				repeats = 0;
-			}
-		}
-#else
-		int k;
-		for (k = l.size(), it = l.begin(); it != l.end(); ++it, k--)
-			if (k <= REG_PRINT_LIMIT)
-				fprintf(fp, " %02x", *it);
-	
-#endif
-		fprintf(fp, "\n");
+	rt2x00usb_finish(decoder);
+	op_finish();
+	rec_finish();
+	stats_report();
+
+	rt2x00usb_write_maps(decoder, f_mac_map, f_bbp_map, f_rf_map);
+	close_map(&f_mac_map);
+	close_map(&f_bbp_map);
+	close_map(&f_rf_map);
+
+	rate_close();
+	payload_close();
+	bus_close();
+	metrics_write();
+
+	if (f_capture) {
+		fclose(f_capture);
+		index_close(&capture_index);
 	}
 
-	fflush(fp);
-	fclose(fp);
+	fflush(stdout);
 }
 
 void term(int sig)
 {
-	create_mac_map(mac_regs_map, f_mac_map);
-	create_map(rf_regs_map, MAX_RF_REG, f_rf_map);
-	create_map(bbp_regs_map, MAX_BBP_REG,f_bbp_map);
-
-	fflush(stdout);
+	finish();
 	exit(0);
 }
 
 int main(int argc, char **argv)
 {
 	int opt, bus, address;
-	char device[16];
+	char device[16] = "";
+	char *capture_name = NULL;
+	const char *control_path = NULL;
+	char *from = NULL, *to = NULL;
+	bool build_index = false;
+	int jobs = 0;
+	uint64_t coalesce = 0;
+	bool diff = false;
+
+	enum {
+		OPT_INDEX = 0x100,
+		OPT_FROM,
+		OPT_TO,
+		OPT_AGG_STATS,
+		OPT_STA_STATS,
+		OPT_STATS_INTERVAL,
+		OPT_NO_FRAMES,
+		OPT_RATE_TIMELINE,
+		OPT_RATE_CSV,
+		OPT_RATE_BIN,
+		OPT_FIRMWARE_DUMP,
+		OPT_DUMP_PAYLOAD,
+		OPT_PAYLOAD_CAP,
+		OPT_PAYLOAD_FILE,
+		OPT_RING_SIZE,
+		OPT_CONTROL,
+		OPT_BUS,
+		OPT_BUS_ATTACH,
+		OPT_SYSFS,
+		OPT_COALESCE,
+		OPT_OPS,
+		OPT_POLL_STATS,
+		OPT_QUEUE_STATS,
+		OPT_MCU_STATS,
+		OPT_DIFF,
+		OPT_METRICS,
+		OPT_METRICS_INTERVAL,
+		OPT_FTRACE,
+		OPT_FTRACE_OFFSET,
+		OPT_OVERLOAD,
+		OPT_OVERLOAD_SAMPLE,
+		OPT_RECORD,
+		OPT_RECORD_WINDOW,
+		OPT_RECORD_POST,
+		OPT_RECORD_SIZE,
+		OPT_TRIGGER,
+		OPT_TABLES,
+		OPT_BEACONS,
+	};
+	static const struct option long_options[] = {
+		{ "device",	required_argument, NULL, 'd' },
+		{ "mac-map",	required_argument, NULL, 'm' },
+		{ "bbp-map",	required_argument, NULL, 'b' },
+		{ "rf-map",	required_argument, NULL, 'r' },
+		{ "write",	required_argument, NULL, 'w' },
+		{ "file",	required_argument, NULL, 'f' },
+		{ "jobs",	required_argument, NULL, 'j' },
+		{ "index",	no_argument,	   NULL, OPT_INDEX },
+		{ "from",	required_argument, NULL, OPT_FROM },
+		{ "to",		required_argument, NULL, OPT_TO },
+		{ "agg-stats",	no_argument,	   NULL, OPT_AGG_STATS },
+		{ "sta-stats",	no_argument,	   NULL, OPT_STA_STATS },
+		{ "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+		{ "no-frames",	no_argument,	   NULL, OPT_NO_FRAMES },
+		{ "rate-timeline", no_argument,	   NULL, OPT_RATE_TIMELINE },
+		{ "rate-csv",	required_argument, NULL, OPT_RATE_CSV },
+		{ "rate-bin",	required_argument, NULL, OPT_RATE_BIN },
+		{ "firmware-dump", required_argument, NULL, OPT_FIRMWARE_DUMP },
+		{ "dump-payload", no_argument,	   NULL, OPT_DUMP_PAYLOAD },
+		{ "payload-cap", required_argument, NULL, OPT_PAYLOAD_CAP },
+		{ "payload-file", required_argument, NULL, OPT_PAYLOAD_FILE },
+		{ "ring-size",	required_argument, NULL, OPT_RING_SIZE },
+		{ "control",	required_argument, NULL, OPT_CONTROL },
+		{ "bus",	required_argument, NULL, OPT_BUS },
+		{ "bus-attach",	required_argument, NULL, OPT_BUS_ATTACH },
+		{ "sysfs",	required_argument, NULL, OPT_SYSFS },
+		{ "coalesce",	optional_argument, NULL, OPT_COALESCE },
+		{ "ops",	no_argument,	   NULL, OPT_OPS },
+		{ "poll-stats",	no_argument,	   NULL, OPT_POLL_STATS },
+		{ "queue-stats",	optional_argument, NULL, OPT_QUEUE_STATS },
+		{ "mcu-stats",	no_argument,	   NULL, OPT_MCU_STATS },
+		{ "diff",	no_argument,	   NULL, OPT_DIFF },
+		{ "metrics",	required_argument, NULL, OPT_METRICS },
+		{ "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+		{ "ftrace",	required_argument, NULL, OPT_FTRACE },
+		{ "ftrace-offset", required_argument, NULL, OPT_FTRACE_OFFSET },
+		{ "overload",	optional_argument, NULL, OPT_OVERLOAD },
+		{ "overload-sample", required_argument, NULL, OPT_OVERLOAD_SAMPLE },
+		{ "record",	required_argument, NULL, OPT_RECORD },
+		{ "record-window", required_argument, NULL, OPT_RECORD_WINDOW },
+		{ "record-post", required_argument, NULL, OPT_RECORD_POST },
+		{ "record-size", required_argument, NULL, OPT_RECORD_SIZE },
+		{ "trigger",	required_argument, NULL, OPT_TRIGGER },
+		{ "tables",	no_argument,	   NULL, OPT_TABLES },
+		{ "beacons",	no_argument,	   NULL, OPT_BEACONS },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	regs_array_self_test();
 
 	// FIXME: device autorecognize
-	while ((opt = getopt(argc, argv, "d:m:b:r:")) != -1) {
+	while ((opt = getopt_long(argc, argv, "d:m:b:r:w:f:j:", long_options, NULL)) != -1) {
 		switch (opt) {
 		case 'd':
 			if (optarg == NULL || strlen(optarg) != 9 || strspn(optarg, "01234567890abcdef:") != 9) {
@@ -993,17 +1015,272 @@ int main(int argc, char **argv)
 			if (open_map(&f_bbp_map, optarg) != 0)
 				goto err;
 			break;
+		case 'w':
+			if ((f_capture = capture_create(optarg)) == NULL ||
+			    index_create(&capture_index, optarg) != 0)
+				goto err;
+			break;
+		case 'f':
+			capture_name = optarg;
+			break;
+		case 'j':
+			jobs = atoi(optarg);
+			if (jobs < 1) {
+				printf("invalid number of jobs\n");
+				return 1;
+			}
+			break;
+		case OPT_INDEX:
+			build_index = true;
+			break;
+		case OPT_FROM:
+			from = optarg;
+			break;
+		case OPT_TO:
+			to = optarg;
+			break;
+		case OPT_AGG_STATS:
+			agg_enabled = true;
+			break;
+		case OPT_STA_STATS:
+			sta_enabled = true;
+			break;
+		case OPT_STATS_INTERVAL:
+			stats_interval = strtod(optarg, NULL) * 1000000;
+			break;
+		case OPT_NO_FRAMES:
+			print_frames = false;
+			break;
+		case OPT_RATE_TIMELINE:
+			rate_print = true;
+			break;
+		case OPT_RATE_CSV:
+			if (rate_open_csv(optarg) != 0)
+				goto err;
+			break;
+		case OPT_RATE_BIN:
+			if (rate_open_bin(optarg) != 0)
+				goto err;
+			break;
+		case OPT_FIRMWARE_DUMP:
+			firmware_dump_name = optarg;
+			break;
+		case OPT_DUMP_PAYLOAD:
+			dump_payload = true;
+			break;
+		case OPT_PAYLOAD_CAP:
+			dump_payload_cap = atoi(optarg);
+			break;
+		case OPT_PAYLOAD_FILE:
+			if (payload_open(optarg) != 0)
+				goto err;
+			break;
+		case OPT_RING_SIZE:
+			ring_size = strtol(optarg, NULL, 0);
+			break;
+		case OPT_CONTROL:
+			control_path = optarg;
+			break;
+		case OPT_BUS:
+			if (bus_create(optarg) != 0) {
+				printf("unable to create event bus %s: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case OPT_SYSFS:
+			sysfs_root = optarg;
+			break;
+		case OPT_COALESCE:
+			coalesce = optarg ? strtoull(optarg, NULL, 0) : COALESCE_TIMEOUT;
+			if (coalesce == 0) {
+				printf("invalid coalesce timeout\n");
+				return 1;
+			}
+			break;
+		case OPT_OPS:
+			op_enabled = true;
+			break;
+		case OPT_POLL_STATS:
+			poll_enabled = true;
+			break;
+		case OPT_QUEUE_STATS:
+			queue_enabled = true;
+			if (optarg && (queue_starve = strtoull(optarg, NULL, 0)) == 0) {
+				printf("invalid starvation threshold\n");
+				return 1;
+			}
+			break;
+		case OPT_MCU_STATS:
+			mcu_enabled = true;
+			break;
+		case OPT_DIFF:
+			diff = true;
+			break;
+		case OPT_METRICS:
+			metrics_name = optarg;
+			break;
+		case OPT_METRICS_INTERVAL:
+			metrics_interval = atoi(optarg);
+			if (metrics_interval == 0) {
+				printf("invalid metrics interval\n");
+				return 1;
+			}
+			break;
+		case OPT_FTRACE:
+			if (ftrace_load(optarg) != 0)
+				goto err;
+			break;
+		case OPT_FTRACE_OFFSET:
+			ftrace_offset = strtod(optarg, NULL) * 1000000;
+			break;
+		case OPT_OVERLOAD:
+			if (overload_parse(optarg) != 0) {
+				printf("invalid overload thresholds\n");
+				return 1;
+			}
+			break;
+		case OPT_OVERLOAD_SAMPLE:
+			overload_sample = atoi(optarg);
+			if (overload_sample < 2) {
+				printf("invalid overload sampling\n");
+				return 1;
+			}
+			break;
+		case OPT_RECORD:
+			rec_name = optarg;
+			break;
+		case OPT_RECORD_WINDOW:
+			if (rec_parse_window(optarg) != 0) {
+				printf("invalid record window\n");
+				return 1;
+			}
+			break;
+		case OPT_RECORD_POST:
+			rec_post = strtod(optarg, NULL) * 1000000;
+			break;
+		case OPT_RECORD_SIZE:
+			rec_size = strtoull(optarg, NULL, 0);
+			break;
+		case OPT_TRIGGER:
+			if (rec_parse_trigger(optarg) != 0) {
+				printf("invalid trigger %s\n", optarg);
+				return 1;
+			}
+			break;
+		case OPT_TABLES:
+			tab_enabled = true;
+			break;
+		case OPT_BEACONS:
+			bcn_enabled = true;
+			break;
+		case OPT_BUS_ATTACH:
+			if (bus_attach(optarg) != 0)
+				printf("unable to attach to event bus %s: %s\n", optarg, strerror(errno));
+			return 1;
 		default:
 			usage();
 			return 1;
 		}
 	}
 
+	if (diff) {
+		if (argc - optind != 2) {
+			usage();
+			return 1;
+		}
+		return diff_captures(argv[optind], argv[optind + 1]) ? 1 : 0;
+	}
+
+	// Text output first, other consumers print after it
+	decoder = rt2x00usb_new();
+	rt2x00usb_coalesce(decoder, coalesce);
+	// Flight recorder prints nothing until a trigger
+	if (!rec_enabled())
+		rt2x00usb_add_callback(decoder, text_callback, NULL);
+	if (payload_enabled())
+		rt2x00usb_add_callback(decoder, payload_callback, NULL);
+	if (sta_enabled)
+		rt2x00usb_add_callback(decoder, sta_callback, NULL);
+	if (rate_enabled())
+		rt2x00usb_add_callback(decoder, rate_callback, NULL);
+	if (agg_enabled)
+		rt2x00usb_add_callback(decoder, agg_callback, NULL);
+	if (op_enabled)
+		rt2x00usb_add_callback(decoder, op_callback, NULL);
+	if (poll_enabled)
+		rt2x00usb_add_callback(decoder, poll_callback, NULL);
+	if (mcu_enabled)
+		rt2x00usb_add_callback(decoder, mcu_callback, NULL);
+	if (queue_enabled)
+		rt2x00usb_add_callback(decoder, queue_callback, NULL);
+	if (ftrace_enabled())
+		rt2x00usb_add_callback(decoder, ftrace_callback, NULL);
+	if (tab_enabled)
+		rt2x00usb_add_callback(decoder, tab_callback, NULL);
+	if (bcn_enabled)
+		rt2x00usb_add_callback(decoder, bcn_callback, NULL);
+	if (firmware_dump_name)
+		rt2x00usb_add_callback(decoder, firmware_callback, NULL);
+	if (control_path)
+		rt2x00usb_add_callback(decoder, ctl_callback, NULL);
+	if (bus_enabled())
+		rt2x00usb_add_callback(decoder, bus_callback, NULL);
+	if (metrics_enabled()) {
+		rt2x00usb_add_callback(decoder, metrics_callback, NULL);
+		if (metrics_start() != 0) {
+			printf("unable to start metrics writer: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+	if (rec_enabled()) {
+		rt2x00usb_add_callback(decoder, rec_callback, NULL);
+		if (rec_start() != 0) {
+			printf("unable to allocate %" PRIu64 " bytes for flight recorder\n", rec_size);
+			return 1;
+		}
+	}
+	if (f_mac_map || f_bbp_map || f_rf_map)
+		rt2x00usb_enable_maps(decoder);
+
 	signal(SIGINT, term);
 	signal(SIGTERM, term);
 
-	if (find_device(device, &bus, &address))
-		sniff(bus, address);
+	if (capture_name) {
+		// Register maps, statistics, traces, tables, files written and flight recorder need events in order
+		bool serial = f_mac_map || f_bbp_map || f_rf_map || agg_enabled || sta_enabled ||
+			      op_enabled || poll_enabled || mcu_enabled || queue_enabled || rate_enabled() ||
+			      ftrace_enabled() || tab_enabled || bcn_enabled ||
+			      payload_enabled() || bus_enabled() || metrics_enabled() || firmware_dump_name ||
+			      rec_enabled();
+
+		if (serial && jobs > 1) {
+			printf("register maps, statistics, ftrace, tables, beacons, queue stats, payload file, event bus,\n"
+			       "metrics, firmware dump and flight recorder need serial decoding\n");
+			return 1;
+		}
+		if (jobs == 0)
+			jobs = serial ? 1 : sysconf(_SC_NPROCESSORS_ONLN);
+
+		int ret = decode_capture(capture_name, jobs, from, to, build_index);
+		finish();
+		return ret ? 1 : 0;
+	}
+
+	if (device[0] == '\0') {
+		usage();
+		return 1;
+	}
+
+	if (control_path && ctl_start(control_path) != 0) {
+		printf("unable to create control socket %s: %s\n", control_path, strerror(errno));
+		return 1;
+	}
+
+	if (!find_device(device, &bus, &address))
+		return 0;
+	// Device moved to another bus
+	while (sniff(device, &bus, &address) == 0)
+		;
 	return 0;
 
 err:
@@ -0,0 +1,175 @@
+/*
+ * Per station (WCID) traffic and airtime accounting from TXWI/RXWI. TX
+ * retries and failures come from TX_STA_FIFO reads, retries are estimated
+ * like the driver does, from difference of MCS in TXWI and the final one.
+ */
+
+#define MAX_WCID	256
+#define TX_STA_FIFO	0x1718
+
+enum PhyMode { PHY_CCK = 0, PHY_OFDM, PHY_HT_MIX, PHY_HT_GF };
+
+struct sta_stats {
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t airtime;	// usec
+	// TX only
+	uint64_t status;
+	uint64_t failed;
+	uint64_t retries;
+	uint8_t last_mcs;
+	// RX only
+	uint64_t rssi[3];
+};
+
+bool sta_enabled;
+static struct sta_stats sta_tx[MAX_WCID];
+static struct sta_stats sta_rx[MAX_WCID];
+
+// Rate in 100 kbps units, HT rates are for long guard interval
+static unsigned int phy_rate(int phymode, int mcs, int bw)
+{
+	static const unsigned int cck[] = { 10, 20, 55, 110 };
+	static const unsigned int ofdm[] = { 60, 90, 120, 180, 240, 360, 480, 540 };
+	static const unsigned int ht20[] = { 65, 130, 195, 260, 390, 520, 585, 650 };
+	static const unsigned int ht40[] = { 135, 270, 405, 540, 810, 1080, 1215, 1350 };
+
+	switch (phymode) {
+	case PHY_CCK:
+		return cck[mcs & 0x3];
+	case PHY_OFDM:
+		return ofdm[mcs & 0x7];
+	default:
+		return (bw ? ht40 : ht20)[mcs & 0x7] * ((mcs & 0x1f) / 8 + 1);
+	}
+}
+
+// Estimated time on air of a frame, without inter-frame spaces and ACK
+uint32_t airtime_us(int phymode, int mcs, int bw, int sgi, int bytes)
+{
+	const unsigned int rate = phy_rate(phymode, mcs, bw);
+	// SERVICE and tail bits for OFDM
+	const uint64_t bits = 8ULL * bytes + 22;
+	uint64_t nsym;
+
+	switch (phymode) {
+	case PHY_CCK:
+		// Bit 3 of MCS selects short preamble
+		return ((mcs & 0x8) ? 96 : 192) + (8ULL * bytes * 10 + rate - 1) / rate;
+	case PHY_OFDM:
+		nsym = (bits * 10 + rate * 4 - 1) / (rate * 4);
+		return 20 + nsym * 4;
+	default:
+		// Legacy and HT preambles plus one HT-LTF per spatial stream
+		nsym = (bits * 10 + rate * 4 - 1) / (rate * 4);
+		return 36 + 4 * ((mcs & 0x1f) / 8 + 1) + (nsym * (sgi ? 36 : 40) + 9) / 10;
+	}
+}
+
+// @buf points to TXINFO
+static void sta_tx_frame(const unsigned char *buf)
+{
+	const uint32_t w0 = decode_reg_val(buf + 4);
+	const uint32_t w1 = decode_reg_val(buf + 8);
+	const int wcid = (w1 >> 8) & 0xff;
+	const int bytes = (w1 >> 16) & 0xfff;
+	const int mcs = (w0 >> 16) & 0x7f;
+	struct sta_stats *st = &sta_tx[wcid];
+
+	st->frames++;
+	st->bytes += bytes;
+	st->airtime += airtime_us(w0 >> 30, mcs, (w0 >> 23) & 1, (w0 >> 24) & 1, bytes);
+	st->last_mcs = mcs;
+}
+
+// @buf points to RXINFO
+static void sta_rx_frame(const unsigned char *buf)
+{
+	const uint32_t w0 = decode_reg_val(buf + 4);
+	const uint32_t w1 = decode_reg_val(buf + 8);
+	const uint32_t w2 = decode_reg_val(buf + 12);
+	const int wcid = w0 & 0xff;
+	const int bytes = (w0 >> 16) & 0xfff;
+	struct sta_stats *st = &sta_rx[wcid];
+
+	st->frames++;
+	st->bytes += bytes;
+	st->airtime += airtime_us(w1 >> 30, (w1 >> 16) & 0x7f, (w1 >> 23) & 1, (w1 >> 24) & 1, bytes);
+	for (int i = 0; i < 3; i++)
+		st->rssi[i] += (w2 >> (8 * i)) & 0xff;
+}
+
+// Value read from TX_STA_FIFO
+static void sta_tx_status(uint32_t val)
+{
+	const int wcid = (val >> 8) & 0xff;
+	const int mcs = (val >> 16) & 0x7f;
+	struct sta_stats *st = &sta_tx[wcid];
+
+	if (!(val & 0x1)) // TXQ_VLD
+		return;
+
+	st->status++;
+	if (!(val & 0x20)) // TXQ_OK
+		st->failed++;
+	if (st->last_mcs > mcs)
+		st->retries += st->last_mcs - mcs;
+}
+
+void sta_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	if (ev->type == RT2X00USB_TX_FRAME)
+		sta_tx_frame(ev->data);
+	else if (ev->type == RT2X00USB_RX_FRAME)
+		sta_rx_frame(ev->data);
+	else if (ev->type == RT2X00USB_MAC_READ && ev->addr == TX_STA_FIFO)
+		sta_tx_status(ev->value);
+}
+
+static int sta_cmp(const void *a, const void *b)
+{
+	const int x = *static_cast<const int *>(a);
+	const int y = *static_cast<const int *>(b);
+	const uint64_t ax = sta_tx[x].airtime + sta_rx[x].airtime;
+	const uint64_t ay = sta_tx[y].airtime + sta_rx[y].airtime;
+
+	if (ax != ay)
+		return ax < ay ? 1 : -1;
+	return x - y;
+}
+
+void sta_report(void)
+{
+	int order[MAX_WCID];
+	uint64_t airtime = 0;
+
+	if (!sta_enabled)
+		return;
+
+	for (int i = 0; i < MAX_WCID; i++) {
+		order[i] = i;
+		airtime += sta_tx[i].airtime + sta_rx[i].airtime;
+	}
+	qsort(order, MAX_WCID, sizeof(order[0]), sta_cmp);
+
+	const double total = airtime ? airtime : 1;
+
+	for (int i = 0; i < MAX_WCID; i++) {
+		const int wcid = order[i];
+		struct sta_stats *tx = &sta_tx[wcid];
+		struct sta_stats *rx = &sta_rx[wcid];
+
+		if (tx->frames || tx->status)
+			printf("STA WCID %d TX: %" PRIu64 " frames %" PRIu64 " bytes airtime %.3f ms (%.1f%%)"
+			       " status %" PRIu64 " failed %" PRIu64 " retries %" PRIu64 "\n",
+			       wcid, tx->frames, tx->bytes, tx->airtime / 1000.0, 100.0 * tx->airtime / total,
+			       tx->status, tx->failed, tx->retries);
+		if (rx->frames)
+			printf("STA WCID %d RX: %" PRIu64 " frames %" PRIu64 " bytes airtime %.3f ms (%.1f%%)"
+			       " rssi %.1f %.1f %.1f\n",
+			       wcid, rx->frames, rx->bytes, rx->airtime / 1000.0, 100.0 * rx->airtime / total,
+			       (double) rx->rssi[0] / rx->frames, (double) rx->rssi[1] / rx->frames,
+			       (double) rx->rssi[2] / rx->frames);
+	}
+	fflush(stdout);
+}
@@ -0,0 +1,296 @@
+/*
+ * Shadow of the on-chip security tables: WCID search table, pairwise keys,
+ * IV/EIV, WCID attributes, shared keys and shared key mode. Accesses update
+ * the entries they touch and are printed as decoded changes of the entries
+ * instead of hex dumps. Entries first written with their reset value (the
+ * driver clears all of them at initialization) are only counted. Current
+ * state of the tables is printed with the statistics. Pairwise keys of the
+ * last WCIDs share memory with beacon slots, those are left to the beacons.
+ */
+
+#define TAB_WCIDS	256
+#define TAB_FIELDS	6
+#define TAB_FIELD_LEN	64
+
+enum TabType {
+	TAB_WCID,
+	TAB_KEY,
+	TAB_IV,
+	TAB_ATTR,
+	TAB_SHARED_KEY,
+	TAB_SHARED_MODE,
+	TAB_TYPES
+};
+
+struct tab_def {
+	uint16_t base;
+	uint16_t entry_size;
+	uint16_t entries;
+	const char *name;
+};
+
+static const struct tab_def tab_defs[TAB_TYPES] = {
+	{ 0x1800, 8,  TAB_WCIDS, "WCID search" },		// MAC, 2 reserved bytes
+	{ 0x4000, 32, TAB_WCIDS, "key" },		// key, TX MIC, RX MIC
+	{ 0x6000, 8,  TAB_WCIDS, "IV" },		// IV, EIV
+	{ 0x6800, 4,  TAB_WCIDS, "attribute" },
+	{ 0x6c00, 32, 32,        "shared key" },	// 4 keys of 8 BSS
+	{ 0x7000, 4,  4,         "shared key mode" },	// 4 bits per key, 2 BSS
+};
+
+struct tab_stats {
+	uint64_t changes;
+	uint64_t unchanged;	// entry written with what it already had
+	uint64_t initialized;	// unknown entry written with reset value
+};
+
+bool tab_enabled;
+static uint8_t tab_mem[TAB_TYPES][TAB_WCIDS * 32];
+static uint8_t tab_known[TAB_TYPES][TAB_WCIDS];
+static struct tab_stats tab_stats[TAB_TYPES];
+
+static const char *tab_cipher(int cipher)
+{
+	static const char *name[] = {
+		"none", "WEP40", "WEP104", "TKIP", "CCMP", "CKIP64", "CKIP128", "TKIP-no-MIC", "SMS4",
+	};
+
+	return cipher < (int) ARRAY_SIZE(name) ? name[cipher] : "unknown";
+}
+
+static bool tab_zero(const uint8_t *p, int len)
+{
+	for (int i = 0; i < len; i++)
+		if (p[i])
+			return false;
+	return true;
+}
+
+// Value driver writes when it clears the entry
+static bool tab_reset(int type, const uint8_t *e)
+{
+	const struct tab_def *t = &tab_defs[type];
+
+	if (type == TAB_WCID && e[0] == 0xff && !memcmp(e, e + 1, 5))
+		return true;
+	return tab_zero(e, t->entry_size);
+}
+
+// Decoded fields of entry @e, empty ones are not printed
+static void tab_format(int type, const uint8_t *e, char f[TAB_FIELDS][TAB_FIELD_LEN])
+{
+	const uint32_t val = decode_reg_val(e);
+
+	memset(f, 0, TAB_FIELDS * TAB_FIELD_LEN);
+
+	switch (type) {
+	case TAB_WCID:
+		snprintf(f[0], TAB_FIELD_LEN, "MAC %02x:%02x:%02x:%02x:%02x:%02x", e[0], e[1], e[2], e[3], e[4], e[5]);
+		break;
+	case TAB_KEY:
+	case TAB_SHARED_KEY:
+		snprintf(f[0], TAB_FIELD_LEN, "key %s", tab_zero(e, 16) ? "cleared" : "set");
+		snprintf(f[1], TAB_FIELD_LEN, "MIC %s", tab_zero(e + 16, 16) ? "cleared" : "set");
+		break;
+	case TAB_IV:
+		snprintf(f[0], TAB_FIELD_LEN, "IV %02x%02x%02x%02x", e[0], e[1], e[2], e[3]);
+		snprintf(f[1], TAB_FIELD_LEN, "EIV %08x", decode_reg_val(e + 4));
+		snprintf(f[2], TAB_FIELD_LEN, "key index %d%s", e[3] >> 6, e[3] & 0x20 ? " ext IV" : "");
+		break;
+	case TAB_ATTR:
+		snprintf(f[0], TAB_FIELD_LEN, "cipher %s", tab_cipher(((val >> 1) & 0x7) | ((val >> 7) & 0x8)));
+		snprintf(f[1], TAB_FIELD_LEN, "%s key", val & 0x1 ? "pairwise" : "shared");
+		snprintf(f[2], TAB_FIELD_LEN, "BSS %u", ((val >> 4) & 0x7) | ((val >> 8) & 0x8));
+		snprintf(f[3], TAB_FIELD_LEN, "RX_WIUDF %u", (val >> 7) & 0x7);
+		break;
+	case TAB_SHARED_MODE:
+		for (int i = 0; i < 4; i++)
+			snprintf(f[i], TAB_FIELD_LEN, "key %d %s/%s", i, tab_cipher((val >> (4 * i)) & 0x7),
+				 tab_cipher((val >> (16 + 4 * i)) & 0x7));
+		break;
+	}
+}
+
+static void tab_name(int type, int nr, char *name, size_t len)
+{
+	switch (type) {
+	case TAB_SHARED_KEY:
+		snprintf(name, len, "SHARED BSS %d key %d", nr / 4, nr % 4);
+		break;
+	case TAB_SHARED_MODE:
+		snprintf(name, len, "SHARED BSS %d/%d mode", 2 * nr, 2 * nr + 1);
+		break;
+	case TAB_WCID:
+		snprintf(name, len, "WCID %d", nr);
+		break;
+	default:
+		snprintf(name, len, "WCID %d %s", nr, tab_defs[type].name);
+		break;
+	}
+}
+
+// Entry @nr of table @type changed from @old, @was_known tells if it was
+static void tab_print(int type, int nr, const uint8_t *old, bool was_known, bool read)
+{
+	const struct tab_def *t = &tab_defs[type];
+	const uint8_t *e = &tab_mem[type][nr * t->entry_size];
+	char of[TAB_FIELDS][TAB_FIELD_LEN], nf[TAB_FIELDS][TAB_FIELD_LEN];
+	char name[32];
+	bool printed = false;
+
+	if (!was_known && tab_reset(type, e)) {
+		tab_stats[type].initialized++;
+		return;
+	}
+	if (was_known && !memcmp(old, e, t->entry_size)) {
+		tab_stats[type].unchanged++;
+		if (read)
+			return;
+	} else {
+		tab_stats[type].changes++;
+	}
+
+	tab_name(type, nr, name, sizeof(name));
+	printf("TABLE %s%s:", name, read ? " read" : "");
+
+	tab_format(type, old, of);
+	tab_format(type, e, nf);
+	// Keys are not printed, only if they are set, changed or cleared
+	if ((type == TAB_KEY || type == TAB_SHARED_KEY) && was_known && memcmp(old, e, 16) &&
+	    !tab_zero(old, 16) && !tab_zero(e, 16))
+		snprintf(nf[0], TAB_FIELD_LEN, "key changed");
+	for (int i = 0; i < TAB_FIELDS; i++) {
+		if (nf[i][0] == '\0' || (was_known && !strcmp(of[i], nf[i])))
+			continue;
+		printf(" %s", nf[i]);
+		printed = true;
+	}
+	printf("%s\n", printed ? "" : " unchanged");
+}
+
+// Apply @len bytes at @addr to every entry they touch
+static void tab_update(uint16_t addr, const unsigned char *data, unsigned int len, bool read)
+{
+	for (int type = 0; type < TAB_TYPES; type++) {
+		const struct tab_def *t = &tab_defs[type];
+		const unsigned int size = t->entry_size * t->entries;
+
+		if (addr + len <= t->base || addr >= t->base + size)
+			continue;
+
+		const unsigned int begin = addr > t->base ? addr - t->base : 0;
+		const unsigned int end = addr + len < t->base + size ? addr + len - t->base : size;
+
+		for (unsigned int nr = begin / t->entry_size; nr * t->entry_size < end; nr++) {
+			uint8_t *e = &tab_mem[type][nr * t->entry_size];
+			uint8_t old[32];
+			const unsigned int from = begin > nr * t->entry_size ? begin : nr * t->entry_size;
+			const unsigned int to = end < (nr + 1) * t->entry_size ? end : (nr + 1) * t->entry_size;
+			const bool was_known = tab_known[type][nr];
+
+			if (bcn_slot(t->base + nr * t->entry_size) >= 0)
+				continue;
+			memcpy(old, e, t->entry_size);
+			memcpy(tab_mem[type] + from, data + (t->base + from - addr), to - from);
+			tab_known[type][nr] = 1;
+			tab_print(type, nr, old, was_known, read);
+		}
+	}
+}
+
+static bool tab_in(uint16_t addr, unsigned int len)
+{
+	if (bcn_slot(addr) >= 0)
+		return false;
+
+	for (int type = 0; type < TAB_TYPES; type++) {
+		const struct tab_def *t = &tab_defs[type];
+
+		if (addr >= t->base && addr + len <= (unsigned int) (t->base + t->entry_size * t->entries))
+			return true;
+	}
+	return false;
+}
+
+// Area access printed by the tables instead of a hex dump
+bool tab_covers(const struct rt2x00usb_event *ev)
+{
+	return tab_enabled && tab_in(ev->addr, ev->type == RT2X00USB_AREA_WRITE_VALUE ? 2 : ev->len);
+}
+
+void tab_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	unsigned char buf[2];
+
+	switch (ev->type) {
+	case RT2X00USB_AREA_READ:
+	case RT2X00USB_AREA_WRITE:
+		tab_update(ev->addr, ev->data, ev->len, ev->type == RT2X00USB_AREA_READ);
+		break;
+	case RT2X00USB_AREA_WRITE_VALUE:
+		buf[0] = ev->value;
+		buf[1] = ev->value >> 8;
+		tab_update(ev->addr, buf, 2, false);
+		break;
+	}
+}
+
+// Entry of a WCID, or a shared key, as it is now
+static void tab_report_entry(int type, int nr)
+{
+	const struct tab_def *t = &tab_defs[type];
+	char f[TAB_FIELDS][TAB_FIELD_LEN];
+
+	if (!tab_known[type][nr] || tab_reset(type, &tab_mem[type][nr * t->entry_size]))
+		return;
+
+	tab_format(type, &tab_mem[type][nr * t->entry_size], f);
+	for (int i = 0; i < TAB_FIELDS; i++)
+		if (f[i][0])
+			printf(" %s", f[i]);
+}
+
+void tab_report(void)
+{
+	char name[32];
+
+	if (!tab_enabled)
+		return;
+
+	for (int type = 0; type < TAB_TYPES; type++)
+		if (tab_stats[type].changes + tab_stats[type].unchanged + tab_stats[type].initialized)
+			printf("TABLE %s: %" PRIu64 " changes %" PRIu64 " unchanged %" PRIu64 " initialized\n",
+			       tab_defs[type].name, tab_stats[type].changes, tab_stats[type].unchanged,
+			       tab_stats[type].initialized);
+
+	for (int nr = 0; nr < TAB_WCIDS; nr++) {
+		bool used = false;
+
+		for (int type = TAB_WCID; type <= TAB_ATTR; type++)
+			used |= tab_known[type][nr] &&
+				!tab_reset(type, &tab_mem[type][nr * tab_defs[type].entry_size]);
+		if (!used)
+			continue;
+
+		printf("TABLE WCID %d:", nr);
+		for (int type = TAB_WCID; type <= TAB_ATTR; type++)
+			tab_report_entry(type, nr);
+		printf("\n");
+	}
+
+	for (int nr = 0; nr < tab_defs[TAB_SHARED_KEY].entries; nr++) {
+		const int mode = nr / 8;
+		const uint32_t val = decode_reg_val(&tab_mem[TAB_SHARED_MODE][mode * 4]);
+		const int cipher = (val >> (16 * (nr / 4 % 2) + 4 * (nr % 4))) & 0x7;
+
+		if (!(tab_known[TAB_SHARED_KEY][nr] && !tab_zero(&tab_mem[TAB_SHARED_KEY][nr * 32], 32)) &&
+		    !(tab_known[TAB_SHARED_MODE][mode] && cipher))
+			continue;
+
+		tab_name(TAB_SHARED_KEY, nr, name, sizeof(name));
+		printf("TABLE %s: cipher %s", name, tab_known[TAB_SHARED_MODE][mode] ? tab_cipher(cipher) : "unknown");
+		tab_report_entry(TAB_SHARED_KEY, nr);
+		printf("\n");
+	}
+	fflush(stdout);
+}
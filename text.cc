@@ -0,0 +1,178 @@
+/*
+ * Text output of decoded events, the default consumer of the decoder.
+ */
+
+// Print TXWI/RXWI descriptors of every frame in bulk URBs
+bool print_frames = true;
+// Dump bulk and not vendor control payloads
+bool dump_payload;
+
+static void print_data(const unsigned char *data, unsigned int len)
+{
+	printf(" [DATA:");
+	print_hex(data, len);
+	printf("]\n");
+}
+
+static void text_mac(const struct rt2x00usb_event *ev, bool read)
+{
+	struct reg *reg = get_reg(ev->addr);
+	// We can write or read halves of two consequitive registers at once
+	struct reg *reg1 = get_reg(ev->addr - 2);
+	struct reg *reg2 = get_reg(ev->addr + 2);
+	const char *dir = read ? "<-" : "->";
+
+	if (ev->arg[0] == 2) {
+		// Using wValue as data
+		if (reg)
+			print_reg(reg, ev->value, false, LowerHalf);
+		else if (reg1)
+			print_reg(reg1, ev->value, false, UpperHalf);
+		else
+			printf("0x%04x -> REG 0x%04x\n", ev->value, ev->addr);
+	} else if (reg) {
+		print_reg(reg, ev->value, read, Full);
+	} else if (reg1 && reg2) {
+		// Special case - access to two different but consecutive registers
+		print_reg(reg1, ev->value & 0xffff, read, UpperHalf);
+		print_reg(reg2, ev->value >> 16, read, LowerHalf);
+	} else {
+		// Unknown register
+		printf("0x%08x %s REG 0x%04x\n", ev->value, dir, ev->addr);
+	}
+}
+
+static void text_area(const struct rt2x00usb_event *ev)
+{
+	struct area *area = get_area(ev->addr);
+	const char *name = area ? area->name : "Unknown area";
+
+	if (tab_covers(ev) || bcn_covers(ev))
+		return;
+
+	if (ev->type == RT2X00USB_AREA_READ) {
+		printf("CTRL: READ %d BYTES FROM 0x%04x (%s)\n", ev->len, ev->addr, name);
+		print_data(ev->data, ev->len);
+	} else if (ev->type == RT2X00USB_AREA_WRITE) {
+		printf("CTRL: WRITE %d BYTES TO 0x%04x (%s)\n", ev->len, ev->addr, name);
+		print_data(ev->data, ev->len);
+	} else {
+		printf("CTRL: WRITE VALUE 0x%04x TO 0x%04x (%s)\n", ev->value, ev->addr, name);
+	}
+}
+
+static void text_frame(const struct rt2x00usb_event *ev)
+{
+	const unsigned char *buf = ev->data;
+	const int frame_len = decode_reg_val(buf) & 0xffff;
+
+	if (ev->type == RT2X00USB_RX_FRAME) {
+		printf("  READ FRAME%d (%d BYTES)\n", ev->arg[0], frame_len);
+
+		print_buf_reg(&rxinfo, buf + 0);
+		print_buf_reg(&rxwi_w0, buf + 4);
+		print_buf_reg(&rxwi_w1, buf + 8);
+		print_buf_reg(&rxwi_w2, buf + 12);
+		print_buf_reg(&rxwi_w3, buf + 16);
+		print_buf_reg(&rxd, buf + ev->len - 4);
+	} else {
+		printf("   WRITE FRAME%d (%d BYTES)\n", ev->arg[0], frame_len);
+
+		print_buf_reg(&txinfo, buf);
+		print_buf_reg(&txwi_w0, buf + 4);
+		print_buf_reg(&txwi_w1, buf + 8);
+	}
+}
+
+void text_callback(const struct rt2x00usb_event *ev, void *priv)
+{
+	static const char *xfer_name[] = {
+		" iso",
+		"intr",
+		"ctrl",
+		"bulk"
+	};
+	const struct usb_ctrlrequest *cr;
+
+	switch (ev->type) {
+	case RT2X00USB_MAC_READ:
+	case RT2X00USB_MAC_WRITE:
+		text_mac(ev, ev->type == RT2X00USB_MAC_READ);
+		break;
+	case RT2X00USB_MAC_DATA_READ:
+		printf("CTRL: READ %d BYTES FROM REGISTER 0x04%x\n", ev->len, ev->addr);
+		print_data(ev->data, ev->len);
+		break;
+	case RT2X00USB_MAC_DATA_WRITE:
+		printf("CTRL: WRITE %d BYTES TO REGISTER 0x%04x\n", ev->len, ev->addr);
+		print_data(ev->data, ev->len);
+		break;
+	case RT2X00USB_BBP_READ:
+	case RT2X00USB_BBP_WRITE:
+	case RT2X00USB_RF_READ:
+	case RT2X00USB_RF_WRITE: {
+		const bool read = ev->type == RT2X00USB_BBP_READ || ev->type == RT2X00USB_RF_READ;
+		const bool bbp = ev->type == RT2X00USB_BBP_READ || ev->type == RT2X00USB_BBP_WRITE;
+
+		printf("0x%02x %s %s REG%u\t%s\n", ev->value, read ? "<-" : "->", bbp ? "BBP" : "RF",
+		       ev->addr, read ? "[READ]" : "[WRITE]");
+		break;
+	}
+	case RT2X00USB_MCU_COMMAND:
+		printf("MCU COMMAND %02x Token %02x arg0 %02x arg1 %02x\n", ev->addr, ev->value, ev->arg[0], ev->arg[1]);
+		break;
+	case RT2X00USB_AREA_READ:
+	case RT2X00USB_AREA_WRITE:
+	case RT2X00USB_AREA_WRITE_VALUE:
+		text_area(ev);
+		break;
+	case RT2X00USB_FIRMWARE:
+		printf("FIRMWARE: %u bytes crc32 0x%08x written in %u transfers (%u bytes) during %.3f ms, %.0f bytes/s\n",
+		       ev->value, ev->arg[0], ev->arg[1], ev->arg[2], ev->duration / 1000.0,
+		       ev->duration ? ev->arg[2] * 1000000.0 / ev->duration : 0.0);
+		break;
+	case RT2X00USB_CTRL:
+		// FIXME: print data and length
+		cr = reinterpret_cast<const struct usb_ctrlrequest *>(ev->shdr->s.setup);
+		printf("CTRL: %02x %02x Value: %04x Index %04x Lenght %04x\n",
+		       cr->bRequestType, cr->bRequest, cr->wValue, cr->wIndex, cr->wLength);
+		if (dump_payload && ev->len)
+			print_data(ev->data, ev->len);
+		break;
+	case RT2X00USB_BULK:
+		if (ev->addr & USB_DIR_IN)
+			printf("BULK%d <- READ %d BYTES\n", ev->addr & 0x7f, ev->len);
+		else
+			printf("BULK%d -> WRITE %d BYTES\n", ev->addr & 0x7f, ev->len);
+		if (dump_payload)
+			print_data(ev->data, ev->len);
+		break;
+	case RT2X00USB_TX_FRAME:
+	case RT2X00USB_RX_FRAME:
+		if (print_frames)
+			text_frame(ev);
+		break;
+	case RT2X00USB_URB:
+		printf("%p %s %s %d\n", (void *) ev->shdr->id, xfer_name[ev->value],
+		       (ev->addr & USB_DIR_IN) ? "<-" : "->", ev->addr & 0x7f);
+		break;
+	case RT2X00USB_DROP:
+		printf("DROP %" PRIu64 ".%06" PRIu64 ": %u events lost, decoder state reset\n",
+		       ev->ts / 1000000, ev->ts % 1000000, ev->value);
+		break;
+	case RT2X00USB_REENUM:
+		printf("REENUMERATED %" PRIu64 ".%06" PRIu64 ": bus %d device %u -> %d, decoder state reset\n",
+		       ev->ts / 1000000, ev->ts % 1000000, ev->arg[0], ev->value, ev->addr);
+		break;
+	case RT2X00USB_WARN:
+		printf("WARN %d: %s\n", ev->value, ev->msg);
+		break;
+	case RT2X00USB_COMPLETE:
+	case RT2X00USB_SUBMIT:
+		return;
+	}
+
+	// Seems when asserion fail lines are not printed in order, flush should fix that
+	if (ev->shdr && ev->shdr->xfer_type == XFER_TYPE_CONTROL)
+		fflush(stdout);
+}